@@ -7,10 +7,20 @@
 
 typedef struct item Item;
 typedef struct dir Dir;
+typedef struct watch Watch;
+typedef struct fetch Fetch;
+typedef struct host Host;
+typedef struct decoder Decoder;
+typedef struct plus Plus;
+
+#define ITEMPREFETCHED	1 /* raw was prefetched and not viewed yet */
+#define ITEMNOPREFETCH	2 /* prefetching failed, don't retry */
+#define ITEMPLUS	4 /* listed as a Gopher+ item */
 
 struct item {
 	char type;
 	char redtype;
+	char flags;
 	char *username;
 	char *selector;
 	char *host;
@@ -19,6 +29,7 @@ struct item {
 	char *tag;
 	void *dat;
 	Item *entry;
+	Item *link;
 };
 
 struct dir {
@@ -26,18 +37,146 @@ struct dir {
 	size_t nitems;
 	size_t printoff;
 	size_t curline;
+	char **linestart;	/* lazy dirs: start of each line in raw */
+	char *parsed;	/* lazy dirs: how each line was split */
+	char *chunks;	/* lazy dirs: materialized chunks of items */
+	size_t nresident;
+	unsigned long long sum;	/* of the raw menu */
+	Plus *plus;	/* Gopher+ attributes of each line */
+	Fetch *plusfetch;
+};
+
+struct watch {
+	int fd;
+	short events;
+	long long deadline;	/* now() time of the timeout, 0 for none */
+	void (*cb)(Watch *w, short revents); /* revents 0 on timeout */
+	unsigned long id;
+	Watch *next;
+};
+
+enum { FetchQueued, FetchConnect, FetchHandshake, FetchSend, FetchRecv };
+
+struct fetch {
+	Watch w;	/* first, the watch callback gets the fetch */
+	Host *host;
+	struct addrinfo *addrs, *addr;
+	char *msg;
+	size_t msglen, sent;
+	char *buf;	/* response, NUL-terminated */
+	size_t len, size, maxsize;
+	int state;
+	int slot;	/* holds a scheduler slot */
+	long long queued;
+	Fetch *qnext;
+	int background;	/* rate limited, gives way to the user */
+	int ok;
+	int *finished;
+	void (*done)(Fetch *f);
+	/* if set, takes the len bytes of buf past maxsize instead of
+	 * failing, 1 to go on, 0 to pause a bit, -1 to give up */
+	int (*more)(Fetch *f);
+	size_t passed;	/* bytes handed to more() */
+	void *arg;
 };
 
+const char *archiveadd(Item *item);
+char *archivequery(const char *query, size_t *nhits, const char **err);
+void archivestats(FILE *fp);
+const char *archivesync(void);
+int connectrace(char **name, char **port, size_t n, size_t *won);
+int connectto(const char *host, const char *port);
+void csoclose(void);
+char *csoquery(const char *host, const char *port, const char *query,
+               const char **err);
+void csostats(FILE *fp);
+int decode(Decoder *d, const char *buf, size_t len);
+const char *decodeclose(Decoder *d);
+Decoder *decodeopen(char type, int dest);
 void die(const char *fmt, ...);
+Item *diritem(Dir *dir, size_t i);
+const char *dirtext(Dir *dir, size_t i, size_t *len);
+void dnsprefetch(const char *host, const char *port);
+void fetchcancel(Fetch *f);
+void fetchfinish(Fetch *f);
+char *homepath(const char *path);
+void hostfailed(Host *h);
+Fetch *fetchstart(const char *host, const char *port, const char *selector,
+                  size_t maxsize, void (*done)(Fetch *), void *arg);
+int getkey(void);
+ssize_t getkeyline(char **line, size_t *size);
+char *getkeys(char *buf, int size);
 size_t mbsprint(const char *s, size_t len);
+void netclose(int fd);
+int netconnect(const struct addrinfo *addr);
+ssize_t netread(int fd, void *buf, size_t n, int timeout);
+int nettls(int fd, const char *host, const char *port, const char **err);
+int netwait(int fd, int timeout);
+long long now(void);
+void netstats(FILE *fp);
+int pooltake(const char *host, const char *port);
+void preconnect(const char *host, const char *port);
+void proxy(char *addr, Item *root);
+int resolve(const char *host, const char *port, struct addrinfo **addrs);
+void schedbind(Host *h, int fd);
+void schedput(Host *h);
+Host *schedwait(const char *name, const char *port);
+void tlsclose(int fd);
+int tlsconnect(int fd, const char *host, const char *port, const char **err);
+int tlspending(int fd);
+ssize_t tlsread(int fd, void *buf, size_t n);
+void tlssave(void);
+void tlsstats(FILE *fp);
+void tlsuse(const char *host, const char *port);
+int tlswanted(const char *host, const char *port);
+ssize_t tlswrite(int fd, const void *buf, size_t n);
+void traceclose(void);
+int tracedue(void);
+char *traceget(const char *host, const char *port, const char *selector,
+               size_t *len);
+void tracepaint(void);
+void traceput(const char *host, const char *port, const char *selector,
+              const char *buf, size_t len);
+void tracerecord(const char *path, const char *url);
+char *tracereplay(const char *path);
+int tracereplaying(void);
+void tracescreen(const char *dir);
+void tracestats(FILE *fp);
+void watchadd(Watch *w);
+void watchdel(Watch *w);
+void *xreallocarray(void *m, const size_t n, const size_t s);
+void *xmalloc(const size_t n);
+void *xcalloc(size_t n);
+char *xstrdup(const char *str);
 #ifdef NEED_STRCASESTR
 char *strcasestr(const char *h, const char *n);
 #endif /* NEED_STRCASESTR */
+char *localpath(Item *item);
+const char *plusdescribe(Item *item);
 const char *typedisplay(char t);
+Item *searchsession(const char *query, Item *entry);
+char *sharedget(const char *key, size_t *len);
+int sharedopen(const char *path);
+void sharedput(const char *key, const char *buf, size_t len);
+void sharedstats(FILE *fp);
+Item *sessionstats(Item *entry);
+void revalidate(Item *entry);
+int revalidating(Item *entry);
+void waitinput(void);
+void idxadd(Item *item);
+void idxdrop(Item *item);
+void idxmove(Item **moves, size_t n);
+void idxfree(void);
+size_t idxquery(const char *query, Item ***hits);
+int idxstep(void);
 void uicleanup(void);
 void uidisplay(Item *entry);
+void uirefresh(Item *entry, Dir *old);
+int uiidle(void);
 char *uiprompt(char *fmt, ...);
+char *uiliveprompt(void (*typed)(const char *input), char *fmt, ...);
 Item *uiselectitem(Item *entry);
 void uisetup(void);
 void uisigwinch(int signal);
 void uistatus(char *fmt, ...);
+int uiviewtext(Item *item);
@@ -0,0 +1,153 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Screen UI navigation keys */
+#define _key_lndown	'j' /* move one line down */
+#define _key_entrydown	'J' /* move to next link */
+#define _key_lnup	'k' /* move one line up */
+#define _key_entryup	'K' /* move to previous link */
+#define _key_pgdown	'd' /* move one screen down */
+#define _key_pgup	'u' /* move one screen up */
+#define _key_home	'g' /* move to the top of page */
+#define _key_end	'G' /* move to the bottom of page */
+#define _key_pgnext	'l' /* view highlighted item */
+#define _key_pgprev	'q' /* view previous item */
+#define _key_cururi	'p' /* print item uri */
+#define _key_seluri	'y' /* print page uri */
+#define _key_fetch	'L' /* refetch current item */
+#define _key_help	'?' /* display help */
+#define _key_quit	'Q' /* exit sacc */
+#define _key_search	'/' /* search */
+#define _key_searchnext	'n' /* search same string forward */
+#define _key_searchprev	'N' /* search same string backward */
+#define _key_searchall	'S' /* search all fetched pages */
+#define _key_goto	':' /* go to line or percentage of text */
+#define _key_stats	'i' /* show session statistics */
+
+#define _dir_color YELLOW BOLD
+#define _text_color CYAN BOLD
+
+/* view text items with the builtin pager instead of $PAGER */
+static int builtinpager = 0;
+
+/* default plumber */
+static char *plumber = "open";
+
+/* hand the plumber the items it opens while they download: 0 once
+ * complete, 1 as a growing file, with an empty "<file>.done" created
+ * next to it once complete, 2 through a FIFO, the complete copy
+ * being kept all the same */
+static int plumbstream = 0;
+
+/* decode BinHex (type 4) and uuencoded (type 6) items as they are
+ * downloaded, saving the file they hold */
+static int decodedownloads = 1;
+
+/* keep the answers to the last csocache CSO (type 2) queries, the
+ * connection to each CSO server staying open between them */
+static int csocache = 32;
+
+/* responses larger than this are kept in a mapped file in the
+ * temporary directory rather than in memory (0 to disable) */
+static size_t spillsize = 8 * 1024 * 1024;
+
+/* menus with more lines than this are parsed as they are viewed
+ * (0 to disable), keeping at most lazychunks chunks of parsed items */
+static size_t lazylines = 10000;
+static size_t lazychunks = 16;
+
+/* keep the text items in session snapshots, not only the menus */
+static int snapshotbodies = 1;
+
+/* once the cursor rested prefetchdelay ms, fetch the highlighted item
+ * and the next prefetchlinks links in the background, with at most
+ * prefetchmax transfers (0 to disable) of up to prefetchsize bytes,
+ * sharing prefetchrate bytes per second (0 for no limit) */
+static int prefetchmax = 0;
+static int prefetchlinks = 1;
+static int prefetchdelay = 300;
+static size_t prefetchsize = 1024 * 1024;
+static size_t prefetchrate = 64 * 1024;
+
+/* connect ahead to the hosts of the highlighted item and the next
+ * poollinks links, keeping at most poolmax unused connections (0 to
+ * disable) for poolidle ms */
+static int poolmax = 0;
+static int poollinks = 3;
+static int poolidle = 5000;
+
+/* fetch the attributes of the items of Gopher+ menus in one request,
+ * to know their type and size ahead */
+static int gopherplus = 1;
+
+/* keep the results of the last searchcache queries of each search item
+ * (0 to disable); with searchlive, those of a type 7 search follow the
+ * query as it is typed, the server being asked once typing pauses for
+ * searchdelay ms */
+static int searchcache = 8;
+static int searchlive = 1;
+static int searchdelay = 300;
+
+/* resolve the hosts linked from a fetched menu in the background,
+ * dnsmax at a time (0 to disable), keeping the addresses dnsttl s;
+ * resolutions taking over dnstimeout ms fail */
+static int dnsmax = 4;
+static int dnsttl = 300;
+static int dnstimeout = 10000;
+
+/* race the connections to an item and its '+' mirrors, remembering
+ * which servers answer fastest (0 to disable) */
+static int racemirrors = 0;
+
+/* keep at most netmax connections open (hostmax to a single server)
+ * and open netrate new ones per second (0 for no limit); background
+ * work leaves a failing server alone for up to backoffmax seconds */
+static int netmax = 8;
+static int hostmax = 2;
+static int netrate = 10;
+static int backoffmax = 300;
+
+/* speak TLS with the servers of gophers:// URLs and the items they
+ * link to on the same port, checking their certificate against the
+ * system ones unless tlsverify is 0; the sessions are kept in the file
+ * tlscache, relative to $HOME (NULL to forget them on exit), for the
+ * next connections to skip the full handshake */
+static int tlsverify = 1;
+static char *tlscache = ".sacc-tls";
+
+/* give up on a server not accepting the connection in connecttimeout
+ * ms, not answering in firstbytetimeout ms or stalling for idletimeout
+ * ms (0 for no limit); failed fetches are retried until fetchdeadline
+ * ms passed since the first try (0 to disable) */
+static int connecttimeout = 10000;
+static int firstbytetimeout = 15000;
+static int idletimeout = 30000;
+static int fetchdeadline = 45000;
+
+/* proxy mode (-p) keeps responses of up to proxysize bytes for
+ * proxyttl s, in at most proxycache bytes, passing bigger ones on
+ * uncached */
+static size_t proxysize = 16 * 1024 * 1024;
+static size_t proxycache = 64 * 1024 * 1024;
+static int proxyttl = 600;
+/* "host:port" the proxy fetches from besides the one of its root */
+static char *proxyhosts[] = { NULL };
+
+/* share the fetched items with the other sacc processes through the
+ * file sharedcache (NULL to disable, e.g. "/tmp/sacc-cache") holding
+ * sharedsize bytes of them, for sharedttl s */
+static char *sharedcache = NULL;
+static size_t sharedsize = 32 * 1024 * 1024;
+static int sharedttl = 300;
+
+/* index the menus and text items fetched in the file archive, relative
+ * to $HOME (NULL to disable, e.g. ".sacc-archive"), for sacc -f to find
+ * them again offline */
+static char *archive = NULL;
+
+/* replaying a trace (-T), wait at most replaypause ms between two keys
+ * of the user, for the pauses of the session not to drag on (-1 keeps
+ * them as recorded) */
+static int replaypause = 200;
+
+/* temporary directory template (must end with six 'X' characters) */
+static char tmpdir[] = "/tmp/sacc-XXXXXX";
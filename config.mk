@@ -7,7 +7,12 @@ MANDIR = $(PREFIX)/share/man/man1
 #UI=txt
 # ti (screen-oriented)
 UI=ti
-LIBS=`pkg-config --libs ncurses`
+LIBS=`pkg-config --libs ncurses` -lpthread
+
+# TLS (gophers://) through OpenSSL, to leave it out empty TLSLIBS and
+# define NO_TLS in your cflags
+TLSLIBS = -lssl -lcrypto
+#CFLAGS = -DNO_TLS
 
 # Define NEED_ASPRINTF and/or NEED_STRCASESTR in your cflags if your system does
 # not provide asprintf() or strcasestr(), respectively.
@@ -0,0 +1,284 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "common.h"
+
+#include "config.h"
+
+#define LINEMAX	1024 /* longer response lines are truncated */
+
+typedef struct csoconn Csoconn;
+typedef struct csoresult Csoresult;
+
+/* a ph connection kept open across queries */
+struct csoconn {
+	char *host, *port;
+	int fd;
+	char buf[BUFSIZ];
+	size_t off, len;
+	Csoconn *next;
+};
+
+struct csoresult {
+	char *key;	/* host:port, tab, query */
+	char *raw;
+	Csoresult *next; /* most recently used first */
+};
+
+static Csoconn *conns;
+static Csoresult *results;
+static size_t nresults;
+static unsigned long long nqueries, ncachehits, nconnects, nreused;
+
+static void
+connclose(Csoconn *c)
+{
+	Csoconn **cp;
+
+	for (cp = &conns; *cp != c; cp = &(*cp)->next)
+		;
+	*cp = c->next;
+	netclose(c->fd);
+	free(c->host);
+	free(c->port);
+	free(c);
+}
+
+static Csoconn *
+connget(const char *host, const char *port, int *reused)
+{
+	Csoconn *c;
+	int fd;
+
+	for (c = conns; c; c = c->next) {
+		if (!strcmp(c->host, host) && !strcmp(c->port, port)) {
+			*reused = 1;
+			return c;
+		}
+	}
+
+	*reused = 0;
+	if ((fd = connectto(host, port)) < 0)
+		return NULL;
+	++nconnects;
+
+	c = xcalloc(sizeof(Csoconn));
+	c->host = xstrdup(host);
+	c->port = xstrdup(port);
+	c->fd = fd;
+	c->next = conns;
+	conns = c;
+
+	return c;
+}
+
+/* read a response line without its end, 0 on end of file, -1 on
+ * error */
+static int
+csoline(Csoconn *c, char *line, int first)
+{
+	size_t n = 0;
+	ssize_t r;
+	char ch;
+
+	for (;;) {
+		if (c->off == c->len) {
+			r = netread(c->fd, c->buf, sizeof(c->buf),
+			            (first && !n) ? firstbytetimeout :
+			            idletimeout);
+			if (r <= 0)
+				return r;
+			c->off = 0;
+			c->len = r;
+		}
+		ch = c->buf[c->off++];
+		if (ch == '\n')
+			break;
+		if (ch != '\r' && n < LINEMAX)
+			line[n++] = (ch == '\t') ? ' ' : ch;
+	}
+	line[n] = '\0';
+
+	return 1;
+}
+
+static void
+putinfo(FILE *fp, const char *s)
+{
+	fprintf(fp, "i%s\tErr\tcso\t0\r\n", *s ? s : " ");
+}
+
+/* turn a ph response into a menu of information lines, an empty line
+ * between the entries, 0 if the connection went away */
+static int
+readresponse(Csoconn *c, FILE *fp, const char **err)
+{
+	char line[LINEMAX+1], *p, *field, *value;
+	long code, entry, last = 0;
+	int r, first = 1;
+
+	while ((r = csoline(c, line, first)) > 0) {
+		first = 0;
+		p = line + (line[0] == '-');
+		code = strtol(p, &p, 10);
+		if (*p == ':')
+			++p;
+		if (line[0] != '-') {
+			/* 1xx are notices, 200 closes a successful
+			 * answer and others tell why it failed */
+			if (code != 200)
+				putinfo(fp, p);
+			else if (!last)
+				putinfo(fp, "No match");
+			if (code >= 200)
+				return 1;
+			continue;
+		}
+		entry = strtol(p, &field, 10);
+		if (code != 200 || *field != ':' ||
+		    !(value = strchr(++field, ':'))) {
+			putinfo(fp, p);
+			continue;
+		}
+		*value++ = '\0';
+		field += strspn(field, " ");
+		value += strspn(value, " ");
+		if (last && entry != last)
+			putinfo(fp, "");
+		last = entry;
+		fprintf(fp, "i%s: %s\tErr\tcso\t0\r\n", field, value);
+	}
+
+	if (r < 0 && errno == ETIMEDOUT)
+		*err = first ? "server didn't answer" : "server stalled";
+	else if (r < 0)
+		*err = strerror(errno);
+	else
+		*err = "connection closed by the server";
+
+	return first && r == 0 ? 0 : -1;
+}
+
+static char *
+resultget(const char *key)
+{
+	Csoresult **rp, *r;
+
+	for (rp = &results; (r = *rp); rp = &r->next) {
+		if (!strcmp(r->key, key)) {
+			*rp = r->next;
+			r->next = results;
+			results = r;
+			return xstrdup(r->raw);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+resultput(char *key, const char *raw)
+{
+	Csoresult **rp, *r;
+
+	r = xmalloc(sizeof(Csoresult));
+	r->key = key;
+	r->raw = xstrdup(raw);
+	r->next = results;
+	results = r;
+
+	if (++nresults <= (size_t)csocache)
+		return;
+	for (rp = &results; (*rp)->next; rp = &(*rp)->next)
+		;
+	r = *rp;
+	*rp = NULL;
+	--nresults;
+	free(r->key);
+	free(r->raw);
+	free(r);
+}
+
+/* run a ph query on host:port, returning the answer as a menu; *err
+ * is why it failed, NULL when connectto() already told */
+char *
+csoquery(const char *host, const char *port, const char *query,
+         const char **err)
+{
+	Csoconn *c;
+	FILE *fp;
+	char *key, *msg, *raw = NULL;
+	size_t len;
+	int r, reused, tries;
+
+	if (asprintf(&key, "%s:%s\t%s", host, port, query) < 0)
+		die("asprintf: %s", strerror(errno));
+	if (csocache && (raw = resultget(key))) {
+		++ncachehits;
+		free(key);
+		return raw;
+	}
+
+	/* default to all the fields of the matching entries */
+	if (asprintf(&msg, "query %s%s\r\n", query,
+	             strstr(query, "return") ? "" : " return all") < 0)
+		die("asprintf: %s", strerror(errno));
+
+	*err = NULL;
+	++nqueries;
+	for (tries = 0; tries < 2; ++tries) {
+		if (!(c = connget(host, port, &reused)))
+			break;
+		c->off = c->len = 0;
+		if (!(fp = open_memstream(&raw, &len)))
+			die("open_memstream: %s", strerror(errno));
+		if (send(c->fd, msg, strlen(msg), MSG_NOSIGNAL) < 0) {
+			*err = strerror(errno);
+			r = 0;
+		} else {
+			r = readresponse(c, fp, err);
+		}
+		fclose(fp);
+		if (r > 0) {
+			nreused += reused;
+			break;
+		}
+		clear(&raw);
+		connclose(c);
+		/* the server may have dropped the idle connection */
+		if (!reused || r < 0)
+			break;
+	}
+	free(msg);
+
+	if (raw && csocache)
+		resultput(key, raw);
+	else
+		free(key);
+
+	return raw;
+}
+
+/* say goodbye to the servers */
+void
+csoclose(void)
+{
+	while (conns) {
+		send(conns->fd, "quit\r\n", 6, MSG_NOSIGNAL);
+		connclose(conns);
+	}
+}
+
+void
+csostats(FILE *fp)
+{
+	if (!nqueries && !ncachehits)
+		return;
+	fprintf(fp, "cso: %llu queries, %llu cached, %llu connections, "
+	        "%llu reused\n", nqueries, ncachehits, nconnects, nreused);
+}
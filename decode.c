@@ -0,0 +1,358 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define LINEMAX	256	/* longer uuencoded lines are malformed */
+#define HDRMAX	(1 + 255 + 1 + 4 + 4 + 2 + 4 + 4)
+
+enum { UuBegin, UuData, UuEnd, UuDone };
+enum { HqxStart, HqxData, HqxDone };
+enum { HqxNamelen, HqxHeader, HqxHeadercrc, HqxFork, HqxForkcrc, HqxEnd };
+
+struct decoder {
+	char type;
+	int dest;
+	int state;
+	const char *err;
+	/* uuencode */
+	char line[LINEMAX];
+	size_t linelen;
+	int linetoolong;
+	/* binhex: 6-bit groups, run-length expansion and the file layout */
+	int atlinestart;
+	uint32_t bits;
+	int nbits;
+	int rle, last;
+	int part;
+	unsigned char hdr[HDRMAX];
+	size_t hdrlen, need;
+	uint16_t crc, expect;
+	int ncrc;
+	/* buffered output */
+	char out[BUFSIZ];
+	size_t outlen;
+	int failed;	/* errno of the failed write */
+};
+
+static const char hqxchars[] =
+	"!\"#$%&'()*+,-012345689@ABCDEFGHIJKLMNPQRSTUVXYZ[`abcdefhijklmpqr";
+
+static signed char uutab[256], hqxtab[256];
+static uint16_t crctab[256];
+
+static void
+inittables(void)
+{
+	static int ready;
+	unsigned int i, j, c;
+
+	if (ready)
+		return;
+
+	memset(uutab, -1, sizeof(uutab));
+	for (i = ' '; i <= '`'; ++i)
+		uutab[i] = (i - ' ') & 0x3f;
+
+	memset(hqxtab, -1, sizeof(hqxtab));
+	for (i = 0; hqxchars[i]; ++i)
+		hqxtab[(unsigned char)hqxchars[i]] = i;
+
+	/* CRC-16/XMODEM, as BinHex uses */
+	for (i = 0; i < 256; ++i) {
+		for (c = i << 8, j = 0; j < 8; ++j)
+			c = (c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1;
+		crctab[i] = c;
+	}
+
+	ready = 1;
+}
+
+static void
+flush(Decoder *d)
+{
+	char *p = d->out;
+	ssize_t n;
+
+	for (; d->outlen && !d->failed; d->outlen -= n, p += n) {
+		if ((n = write(d->dest, p, d->outlen)) < 0)
+			d->failed = errno;
+	}
+	d->outlen = 0;
+}
+
+static void
+put(Decoder *d, unsigned char c)
+{
+	if (d->outlen == sizeof(d->out))
+		flush(d);
+	d->out[d->outlen++] = c;
+}
+
+static void
+uuline(Decoder *d)
+{
+	const unsigned char *p = (unsigned char *)d->line;
+	size_t len = d->linelen;
+	int n, i, v[4];
+
+	while (len && (p[len-1] == '\r' || p[len-1] == ' '))
+		--len;
+
+	switch (d->state) {
+	case UuBegin:
+		if (len > 6 && !strncmp(d->line, "begin ", 6))
+			d->state = UuData;
+		return;
+	case UuEnd:
+		if (len >= 3 && !strncmp(d->line, "end", 3))
+			d->state = UuDone;
+		else
+			d->err = "missing end line";
+		return;
+	}
+
+	if (d->linetoolong) {
+		d->err = "line too long";
+		return;
+	}
+	/* an empty line or a zero length terminates the data */
+	if (!len || !(n = uutab[p[0]])) {
+		d->state = UuEnd;
+		return;
+	}
+	if (n < 0) {
+		d->err = "invalid character";
+		return;
+	}
+
+	for (++p, --len; n > 0; n -= 3, p += 4, len -= 4) {
+		/* encoders may trim the trailing blanks of the line */
+		for (i = 0; i < 4; ++i) {
+			if ((v[i] = (i < len) ? uutab[p[i]] : 0) < 0) {
+				d->err = "invalid character";
+				return;
+			}
+		}
+		if (len < 4)
+			len = 4;
+		put(d, v[0] << 2 | v[1] >> 4);
+		if (n > 1)
+			put(d, (v[1] & 0xf) << 4 | v[2] >> 2);
+		if (n > 2)
+			put(d, (v[2] & 0x3) << 6 | v[3]);
+	}
+}
+
+static void
+uudecode(Decoder *d, const char *buf, size_t len)
+{
+	const char *nl;
+	size_t n;
+
+	while (len && !d->err && d->state != UuDone) {
+		nl = memchr(buf, '\n', len);
+		n = nl ? nl - buf : len;
+		if (d->linelen + n > sizeof(d->line)) {
+			d->linetoolong = 1;
+			n = sizeof(d->line) - d->linelen;
+		}
+		memcpy(d->line + d->linelen, buf, n);
+		d->linelen += n;
+		if (!nl)
+			return;
+		uuline(d);
+		d->linelen = 0;
+		d->linetoolong = 0;
+		len -= nl + 1 - buf;
+		buf = nl + 1;
+	}
+}
+
+static uint32_t
+getbe(const unsigned char *p, int n)
+{
+	uint32_t v = 0;
+
+	while (n--)
+		v = v << 8 | *p++;
+	return v;
+}
+
+/* lay a byte out of the run-length expansion over the BinHex file:
+ * header, data fork and the CRCs guarding them; the resource fork is
+ * of no use away from a Mac and is skipped */
+static void
+hqxbyte(Decoder *d, unsigned char c)
+{
+	const unsigned char *h;
+
+	switch (d->part) {
+	case HqxNamelen:
+		if (c == 0) {
+			d->err = "invalid header";
+			return;
+		}
+		d->hdr[d->hdrlen++] = c;
+		d->need = 1 + c + 1 + 4 + 4 + 2 + 4 + 4;
+		d->part = HqxHeader;
+		break;
+	case HqxHeader:
+		d->hdr[d->hdrlen++] = c;
+		if (d->hdrlen == d->need)
+			d->part = HqxHeadercrc;
+		break;
+	case HqxFork:
+		put(d, c);
+		if (!--d->need)
+			d->part = HqxForkcrc;
+		break;
+	case HqxHeadercrc:
+	case HqxForkcrc:
+		d->expect = d->expect << 8 | c;
+		if (++d->ncrc < 2)
+			return;
+		if (d->expect != d->crc) {
+			d->err = "CRC mismatch";
+			return;
+		}
+		d->crc = d->expect = d->ncrc = 0;
+		if (d->part == HqxForkcrc) {
+			d->part = HqxEnd;
+			return;
+		}
+		h = d->hdr + d->hdrlen - 8;
+		d->need = getbe(h, 4);
+		d->part = d->need ? HqxFork : HqxForkcrc;
+		return;
+	case HqxEnd:
+		return;
+	}
+	d->crc = d->crc << 8 ^ crctab[(d->crc >> 8 ^ c) & 0xff];
+}
+
+/* expand the 0x90 runs: 0x90 n repeats the last byte n-1 more times,
+ * 0x90 0 is a literal 0x90 */
+static void
+hqxrle(Decoder *d, unsigned char c)
+{
+	int n;
+
+	if (d->rle) {
+		d->rle = 0;
+		if (c == 0) {
+			hqxbyte(d, d->last = 0x90);
+		} else if (d->last < 0) {
+			d->err = "invalid run";
+		} else {
+			for (n = c - 1; n > 0 && !d->err; --n)
+				hqxbyte(d, d->last);
+		}
+	} else if (c == 0x90) {
+		d->rle = 1;
+	} else {
+		hqxbyte(d, d->last = c);
+	}
+}
+
+static void
+hqxdecode(Decoder *d, const char *buf, size_t len)
+{
+	unsigned char c;
+	int v;
+
+	for (; len && !d->err && d->state != HqxDone; ++buf, --len) {
+		c = *buf;
+		if (d->state == HqxStart) {
+			/* the data starts at the first ':' opening a line,
+			 * after the "(This file must be converted..." one */
+			if (c == ':' && d->atlinestart)
+				d->state = HqxData;
+			d->atlinestart = (c == '\n' || c == '\r');
+			continue;
+		}
+		if (c == ':') {
+			d->state = HqxDone;
+			break;
+		}
+		if ((v = hqxtab[c]) < 0) {
+			if (c == '\n' || c == '\r' || c == ' ' || c == '\t')
+				continue;
+			d->err = "invalid character";
+			break;
+		}
+		d->bits = d->bits << 6 | v;
+		if ((d->nbits += 6) >= 8) {
+			d->nbits -= 8;
+			hqxrle(d, d->bits >> d->nbits & 0xff);
+		}
+	}
+}
+
+/* set up the decoding of an item of the given type to dest, NULL when
+ * the type isn't encoded */
+Decoder *
+decodeopen(char type, int dest)
+{
+	Decoder *d;
+
+	if (type != '4' && type != '6')
+		return NULL;
+
+	inittables();
+	d = xcalloc(sizeof(Decoder));
+	d->type = type;
+	d->dest = dest;
+	d->atlinestart = 1;
+	d->last = -1;
+
+	return d;
+}
+
+/* decode the next len bytes of the item, 0 if writing failed */
+int
+decode(Decoder *d, const char *buf, size_t len)
+{
+	if (d->type == '6')
+		uudecode(d, buf, len);
+	else
+		hqxdecode(d, buf, len);
+
+	return !d->failed;
+}
+
+/* flush and free the decoder, returning NULL once the whole item was
+ * decoded or why it couldn't be */
+const char *
+decodeclose(Decoder *d)
+{
+	const char *err;
+
+	if (d->type == '6' && d->linelen && !d->err && d->state != UuDone)
+		uuline(d);
+	flush(d);
+
+	if (d->failed)
+		err = strerror(d->failed);
+	else if (d->err)
+		err = d->err;
+	else if (d->type == '6' && d->state == UuBegin)
+		err = "no begin line";
+	else if (d->type == '6' && d->state != UuDone)
+		err = "truncated data";
+	else if (d->type == '4' && d->state == HqxStart)
+		err = "no BinHex data";
+	else if (d->type == '4' && d->part < HqxEnd)
+		err = "truncated data";
+	else
+		err = NULL;
+
+	free(d);
+
+	return err;
+}
@@ -0,0 +1,1263 @@
+/* See LICENSE file for copyright and license details. */
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+#include "config.h"
+
+#define WORDMAX	32	/* longer words are truncated */
+#define SLICE	65536	/* bytes indexed per idle step */
+
+typedef struct term Term;
+
+struct term {
+	char word[WORDMAX+1];
+	Item **items;
+	size_t nitems;
+	size_t size;
+	Term *next;
+};
+
+static Term **buckets;
+static size_t nbuckets, nterms;
+static Item **queue;
+static size_t nqueue, queuesize;
+static size_t qoff; /* progress into queue[0] */
+
+static int
+iswordc(unsigned char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+	       (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+static size_t
+hash(const char *w)
+{
+	size_t h = 2166136261u;
+
+	for (; *w; ++w)
+		h = (h ^ (unsigned char)*w) * 16777619u;
+
+	return h;
+}
+
+static void
+rehash(void)
+{
+	Term **nb, *t, *next;
+	size_t i, h, n = nbuckets ? nbuckets * 2 : 1024;
+
+	nb = xcalloc(n * sizeof(Term *));
+	for (i = 0; i < nbuckets; ++i) {
+		for (t = buckets[i]; t; t = next) {
+			next = t->next;
+			h = hash(t->word) & (n-1);
+			t->next = nb[h];
+			nb[h] = t;
+		}
+	}
+	free(buckets);
+	buckets = nb;
+	nbuckets = n;
+}
+
+static Term *
+lookup(const char *w, int create)
+{
+	Term *t;
+	size_t h;
+
+	if (nbuckets) {
+		for (t = buckets[hash(w) & (nbuckets-1)]; t; t = t->next) {
+			if (!strcmp(t->word, w))
+				return t;
+		}
+	}
+	if (!create)
+		return NULL;
+
+	if (nterms >= nbuckets)
+		rehash();
+	t = xcalloc(sizeof(Term));
+	strcpy(t->word, w);
+	h = hash(w) & (nbuckets-1);
+	t->next = buckets[h];
+	buckets[h] = t;
+	++nterms;
+
+	return t;
+}
+
+/* copy the lowercased word starting at s into w, return its length */
+static size_t
+pickword(const char *s, char *w)
+{
+	size_t i, n;
+
+	for (i = n = 0; iswordc(s[i]); ++i) {
+		if (n < WORDMAX)
+			w[n++] = tolower((unsigned char)s[i]);
+	}
+	w[n] = '\0';
+
+	return i;
+}
+
+static void
+addword(const char *w, Item *item)
+{
+	Term *t = lookup(w, 1);
+
+	if (t->nitems && t->items[t->nitems-1] == item)
+		return;
+	if (t->nitems == t->size) {
+		t->size = t->size ? t->size * 2 : 4;
+		t->items = xreallocarray(t->items, t->size, sizeof(Item *));
+	}
+	t->items[t->nitems++] = item;
+}
+
+/* index at least `len' bytes of `s' for `item', return bytes consumed */
+static size_t
+addtext(const char *s, size_t len, Item *item)
+{
+	char w[WORDMAX+1];
+	size_t i, n;
+
+	for (i = 0; s[i] && (i < len || iswordc(s[i])); i += n) {
+		if (!(n = pickword(s + i, w))) {
+			n = 1;
+			continue;
+		}
+		if (n > 1)
+			addword(w, item);
+	}
+
+	return i;
+}
+
+static void
+dequeue(size_t i)
+{
+	memmove(queue + i, queue + i+1, (--nqueue - i) * sizeof(Item *));
+	if (i == 0)
+		qoff = 0;
+}
+
+void
+idxadd(Item *item)
+{
+	if (nqueue == queuesize) {
+		queuesize = queuesize ? queuesize * 2 : 16;
+		queue = xreallocarray(queue, queuesize, sizeof(Item *));
+	}
+	queue[nqueue++] = item;
+}
+
+/* index a bounded slice of the pending items, return 0 when done */
+int
+idxstep(void)
+{
+	Item *item;
+	Dir *dir;
+	const char *s;
+	size_t n, len;
+
+	if (!nqueue)
+		return 0;
+
+	item = queue[0];
+	/* lazy dirs are read from their lines, leaving the items alone */
+	if ((dir = item->dat)) {
+		for (n = 0; qoff < dir->nitems && n < SLICE; ++qoff) {
+			if ((s = dirtext(dir, qoff, &len)))
+				n += addtext(s, len, item);
+		}
+		if (qoff >= dir->nitems)
+			dequeue(0);
+	} else if (item->raw) {
+		qoff += addtext(item->raw + qoff, SLICE, item);
+		if (!item->raw[qoff])
+			dequeue(0);
+	} else {
+		dequeue(0);
+	}
+
+	return nqueue != 0;
+}
+
+static int
+cmpptr(const void *a, const void *b)
+{
+	const Item *pa = *(Item * const *)a, *pb = *(Item * const *)b;
+
+	return (pa > pb) - (pa < pb);
+}
+
+/* give the words indexed for each first item of the n pairs of moves,
+ * sorted by it, to the second one, which took its raw over */
+void
+idxmove(Item **moves, size_t n)
+{
+	Item **m;
+	Term *t;
+	size_t i, j;
+
+	if (!n)
+		return;
+	for (i = 0; i < nqueue; ++i) {
+		if ((m = bsearch(&queue[i], moves, n, 2 * sizeof(Item *),
+		                 cmpptr)))
+			queue[i] = m[1];
+	}
+	for (i = 0; i < nbuckets; ++i) {
+		for (t = buckets[i]; t; t = t->next) {
+			for (j = 0; j < t->nitems; ++j) {
+				if ((m = bsearch(&t->items[j], moves, n,
+				                 2 * sizeof(Item *), cmpptr)))
+					t->items[j] = m[1];
+			}
+		}
+	}
+}
+
+void
+idxdrop(Item *item)
+{
+	Term *t;
+	size_t i, j, n;
+
+	for (i = 0; i < nqueue; ++i) {
+		if (queue[i] == item)
+			dequeue(i--);
+	}
+	for (i = 0; i < nbuckets; ++i) {
+		for (t = buckets[i]; t; t = t->next) {
+			for (j = n = 0; j < t->nitems; ++j) {
+				if (t->items[j] != item)
+					t->items[n++] = t->items[j];
+			}
+			t->nitems = n;
+		}
+	}
+}
+
+
+/* items matching all words of `query', in fetch order */
+size_t
+idxquery(const char *query, Item ***hits)
+{
+	char w[WORDMAX+1];
+	Term **q = NULL, *t, *shortest = NULL;
+	Item ***sorted, **r;
+	size_t i, j, k, n, nq = 0, nhits = 0;
+
+	*hits = NULL;
+	while (idxstep())
+		;
+
+	for (i = 0; query[i]; i += n) {
+		if ((n = pickword(query + i, w)) < 2) {
+			n = n ? n : 1;
+			continue;
+		}
+		if (!(t = lookup(w, 0)) || !t->nitems)
+			goto end;
+		q = xreallocarray(q, nq+1, sizeof(Term *));
+		q[nq++] = t;
+		if (!shortest || t->nitems < shortest->nitems)
+			shortest = t;
+	}
+	if (!shortest)
+		goto end;
+
+	/* sort the other posting lists once so membership is a bsearch */
+	sorted = xreallocarray(NULL, nq, sizeof(Item **));
+	for (j = 0; j < nq; ++j) {
+		sorted[j] = xreallocarray(NULL, q[j]->nitems, sizeof(Item *));
+		memcpy(sorted[j], q[j]->items, q[j]->nitems * sizeof(Item *));
+		qsort(sorted[j], q[j]->nitems, sizeof(Item *), cmpptr);
+	}
+
+	*hits = xreallocarray(NULL, shortest->nitems, sizeof(Item *));
+	for (i = 0; i < shortest->nitems; ++i) {
+		for (k = 0; k < nq; ++k) {
+			r = bsearch(&shortest->items[i], sorted[k],
+			            q[k]->nitems, sizeof(Item *), cmpptr);
+			if (!r)
+				break;
+		}
+		if (k == nq)
+			(*hits)[nhits++] = shortest->items[i];
+	}
+
+	for (j = 0; j < nq; ++j)
+		free(sorted[j]);
+	free(sorted);
+	if (!nhits)
+		clear(hits);
+end:
+	free(q);
+	return nhits;
+}
+
+void
+idxfree(void)
+{
+	Term *t, *next;
+	size_t i;
+
+	for (i = 0; i < nbuckets; ++i) {
+		for (t = buckets[i]; t; t = next) {
+			next = t->next;
+			free(t->items);
+			free(t);
+		}
+	}
+	clear(&buckets);
+	clear(&queue);
+	nbuckets = nterms = nqueue = queuesize = qoff = 0;
+}
+
+/*
+ * The archive: an index of the menus and text items ever fetched, kept
+ * on disk for finding them again offline. Documents are keyed by their
+ * type, selector, host and port; a document fetched again replaces its
+ * former version.
+ *
+ * It is a set of segments, the files archive.1, archive.2 and so on,
+ * listed oldest first in the manifest, the file archive itself. A
+ * document in a segment is replaced by one of the same key in a newer
+ * segment. archivesync() writes the pending documents as a new segment
+ * under a lock, merging in the newest segments while they hold no more
+ * than twice as many documents as those they are merged with. A
+ * document is thus rewritten a logarithmic number of times, and the
+ * segments stay few.
+ * The new manifest is renamed over the old one, so readers never see a
+ * partial archive.
+ *
+ * Segment layout: a header, the document records (type followed by the
+ * NUL-terminated selector, host, port and title) sorted by key, a table
+ * of their offsets, the postings and the table of terms sorted by word.
+ * The postings of a term are the ascending ids of its documents, as
+ * LEB128 deltas.
+ */
+
+#define ARCHMAGIC	"SACCARCH"
+#define ARCHVERSION	1
+#define ARCHPENDING	256	/* documents kept in memory before a merge */
+#define ARCHDAMAGED	"damaged, left as is"
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t ndocs;
+	uint32_t nterms;
+	uint32_t pad;
+	uint64_t docs;		/* offset of the document offsets */
+	uint64_t terms;		/* offset of the terms */
+	uint64_t size;		/* size of the whole file */
+} Archhdr;
+
+typedef struct {
+	char word[WORDMAX+1];	/* NUL-padded */
+	char pad[3];
+	uint32_t ndocs;
+	uint64_t postings;
+	uint64_t len;
+} Archterm;
+
+typedef struct {
+	char *rec;	/* as laid out in the file */
+	size_t reclen;
+	char *words;	/* sorted distinct words, NUL-terminated */
+	size_t nwords;
+} Archdoc;
+
+typedef struct {
+	const char *word;
+	uint32_t id;
+} Archpair;
+
+typedef struct {
+	char *addr;
+	size_t len;
+	const Archhdr *hdr;
+	const uint64_t *docs;
+	const Archterm *terms;
+} Archmap;
+
+/* what a merge reads from: a segment, or the pending documents and
+ * their words when it has no map */
+typedef struct {
+	Archmap m;
+	Archpair *pairs;
+	size_t npairs;
+	uint32_t ndocs;
+	uint32_t *newid;	/* of its documents in the merged segment */
+	uint32_t doc;		/* next document to merge */
+	size_t term;		/* next term to merge */
+	const char *last;	/* record merged before */
+} Archsrc;
+
+static Archdoc *pending;
+static size_t npending;
+static int archoff;	/* archiving stopped after a failure */
+static unsigned long long narchived, nsynced, nmerges, nwritten;
+
+/* compare the type, selector, host and port of two records */
+static int
+keycmp(const char *a, const char *b)
+{
+	int n = 0;
+
+	for (;; ++a, ++b) {
+		if (*a != *b)
+			return (unsigned char)*a - (unsigned char)*b;
+		if (!*a && ++n == 3)
+			return 0;
+	}
+}
+
+static int
+cmpdoc(const void *a, const void *b)
+{
+	return keycmp(((const Archdoc *)a)->rec, ((const Archdoc *)b)->rec);
+}
+
+static int
+cmpstr(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int
+cmppair(const void *a, const void *b)
+{
+	const Archpair *pa = a, *pb = b;
+	int r;
+
+	if ((r = strcmp(pa->word, pb->word)))
+		return r;
+	return (pa->id > pb->id) - (pa->id < pb->id);
+}
+
+static int
+cmpid(const void *a, const void *b)
+{
+	uint32_t ia = *(const uint32_t *)a, ib = *(const uint32_t *)b;
+
+	return (ia > ib) - (ia < ib);
+}
+
+/* the distinct words of s, packed sorted into *words */
+static size_t
+distinct(const char *s, size_t len, char **words)
+{
+	char w[WORDMAX+1], **set, **v, *buf, *p;
+	size_t i, n, h, k, nset = 64, nw = 0, blen = 0;
+
+	set = xcalloc(nset * sizeof(char *));
+	for (i = 0; i < len && s[i]; i += n) {
+		if ((n = pickword(s + i, w)) < 2) {
+			n = n ? n : 1;
+			continue;
+		}
+		for (h = hash(w) & (nset-1); set[h]; h = (h+1) & (nset-1)) {
+			if (!strcmp(set[h], w))
+				break;
+		}
+		if (set[h])
+			continue;
+		set[h] = xstrdup(w);
+		if (++nw * 2 < nset)
+			continue;
+		/* grow the set, keeping it half empty */
+		v = set;
+		set = xcalloc(nset * 2 * sizeof(char *));
+		for (h = 0; h < nset; ++h) {
+			if (!v[h])
+				continue;
+			k = hash(v[h]) & (nset*2-1);
+			while (set[k])
+				k = (k+1) & (nset*2-1);
+			set[k] = v[h];
+		}
+		free(v);
+		nset *= 2;
+	}
+
+	for (h = n = 0; h < nset; ++h) {
+		if (set[h])
+			set[n++] = set[h];
+	}
+	qsort(set, n, sizeof(char *), cmpstr);
+	for (i = 0; i < n; ++i)
+		blen += strlen(set[i]) + 1;
+	p = buf = xmalloc(blen ? blen : 1);
+	for (i = 0; i < n; ++i) {
+		p = stpcpy(p, set[i]) + 1;
+		free(set[i]);
+	}
+	free(set);
+	*words = buf;
+
+	return n;
+}
+
+/* text of a menu to index: the names of its items, one per line */
+static char *
+menutext(Item *item, size_t *len)
+{
+	Dir *dir = item->dat;
+	FILE *fp;
+	const char *s;
+	char *text = NULL;
+	size_t i, n;
+
+	if (!(fp = open_memstream(&text, len)))
+		die("open_memstream: %s", strerror(errno));
+	/* lazy dirs are read from their lines, leaving the items alone */
+	for (i = 0; i < dir->nitems; ++i) {
+		if ((s = dirtext(dir, i, &n)))
+			fprintf(fp, "%.*s\n", (int)n, s);
+	}
+	fclose(fp);
+
+	return text;
+}
+
+static void
+pendingfree(void)
+{
+	size_t i;
+
+	for (i = 0; i < npending; ++i) {
+		free(pending[i].rec);
+		free(pending[i].words);
+	}
+	npending = 0;
+}
+
+/* queue the content of a freshly fetched item for the archive, the
+ * error of the merge it led to if it failed */
+const char *
+archiveadd(Item *item)
+{
+	Archdoc d, *p;
+	FILE *fp;
+	char *text;
+	size_t len;
+
+	/* a replay shows nothing new to keep */
+	if (!archive || archoff || tracereplaying() || !item->raw ||
+	    !item->host || !item->port ||
+	    (item->type != '0' && item->type != '1'))
+		return NULL;
+	if (item->type == '1' && !item->dat)
+		return NULL;
+
+	if (!(fp = open_memstream(&d.rec, &d.reclen)))
+		die("open_memstream: %s", strerror(errno));
+	fprintf(fp, "%c%s%c%s%c%s%c%s%c", item->type, item->selector, 0,
+	        item->host, 0, item->port, 0,
+	        (item->username && *item->username) ? item->username :
+	        *item->selector ? item->selector : item->host, 0);
+	fclose(fp);
+
+	if (item->type == '1') {
+		text = menutext(item, &len);
+		d.nwords = distinct(text, len, &d.words);
+		free(text);
+	} else {
+		d.nwords = distinct(item->raw, SIZE_MAX, &d.words);
+	}
+
+	/* the latest version of a document wins */
+	for (p = pending; p < pending + npending; ++p) {
+		if (!keycmp(p->rec, d.rec)) {
+			free(p->rec);
+			free(p->words);
+			*p = d;
+			return NULL;
+		}
+	}
+	pending = xreallocarray(pending, npending+1, sizeof(Archdoc));
+	pending[npending++] = d;
+	++narchived;
+
+	if (npending >= ARCHPENDING)
+		return archivesync();
+
+	return NULL;
+}
+
+static int
+archmap(Archmap *m, int fd)
+{
+	struct stat st;
+
+	memset(m, 0, sizeof(*m));
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(Archhdr))
+		return 0;
+	m->len = st.st_size;
+	m->addr = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (m->addr == MAP_FAILED) {
+		m->addr = NULL;
+		return 0;
+	}
+	m->hdr = (const Archhdr *)m->addr;
+	if (memcmp(m->hdr->magic, ARCHMAGIC, sizeof(m->hdr->magic)) ||
+	    m->hdr->version != ARCHVERSION || m->hdr->size != m->len ||
+	    m->hdr->docs > m->len ||
+	    m->hdr->ndocs > (m->len - m->hdr->docs) / sizeof(uint64_t) ||
+	    m->hdr->terms > m->len ||
+	    m->hdr->nterms > (m->len - m->hdr->terms) / sizeof(Archterm)) {
+		munmap(m->addr, m->len);
+		m->addr = NULL;
+		return 0;
+	}
+	m->docs = (const uint64_t *)(m->addr + m->hdr->docs);
+	m->terms = (const Archterm *)(m->addr + m->hdr->terms);
+
+	return 1;
+}
+
+static void
+archunmap(Archmap *m)
+{
+	if (m->addr)
+		munmap(m->addr, m->len);
+}
+
+static char *
+segpath(const char *path, unsigned long n)
+{
+	char *p;
+
+	if (asprintf(&p, "%s.%lu", path, n) < 0)
+		die("asprintf: %s", strerror(errno));
+
+	return p;
+}
+
+/* map segment n of the archive at path */
+static const char *
+segmap(Archmap *m, const char *path, unsigned long n)
+{
+	const char *err = NULL;
+	char *p;
+	int fd;
+
+	p = segpath(path, n);
+	if ((fd = open(p, O_RDONLY|O_CLOEXEC)) < 0) {
+		err = strerror(errno);
+	} else {
+		if (!archmap(m, fd))
+			err = ARCHDAMAGED;
+		close(fd);
+	}
+	free(p);
+
+	return err;
+}
+
+/* the segments listed in the manifest at path, none without one */
+static const char *
+readmanifest(const char *path, unsigned long **segs, size_t *nsegs)
+{
+	FILE *fp;
+	char line[64], *end;
+	unsigned long n, last = 0;
+
+	*segs = NULL;
+	*nsegs = 0;
+	if (!(fp = fopen(path, "r")))
+		return (errno == ENOENT) ? NULL : strerror(errno);
+	if (!fgets(line, sizeof(line), fp) ||
+	    strcmp(line, ARCHMAGIC " 1\n"))
+		goto damaged;
+	while (fgets(line, sizeof(line), fp)) {
+		errno = 0;
+		n = strtoul(line, &end, 10);
+		if (errno || end == line || strcmp(end, "\n") || n <= last)
+			goto damaged;
+		*segs = xreallocarray(*segs, *nsegs + 1, sizeof(**segs));
+		(*segs)[(*nsegs)++] = last = n;
+	}
+	if (ferror(fp))
+		goto damaged;
+	fclose(fp);
+
+	return NULL;
+damaged:
+	fclose(fp);
+	free(*segs);
+	*segs = NULL;
+	*nsegs = 0;
+
+	return ARCHDAMAGED;
+}
+
+/* decode the postings of t, NULL if they are damaged */
+static uint32_t *
+postings(const Archmap *m, const Archterm *t)
+{
+	const unsigned char *p, *end;
+	uint32_t *ids, id = 0;
+	uint64_t v;
+	size_t i;
+	int shift;
+
+	if (t->postings > m->len || t->len > m->len - t->postings ||
+	    t->ndocs > t->len)
+		return NULL;
+	p = (const unsigned char *)m->addr + t->postings;
+	end = p + t->len;
+	ids = xreallocarray(NULL, t->ndocs ? t->ndocs : 1, sizeof(uint32_t));
+	for (i = 0; i < t->ndocs; ++i) {
+		for (v = 0, shift = 0; p < end && shift < 35; shift += 7) {
+			v |= (uint64_t)(*p & 0x7f) << shift;
+			if (!(*p++ & 0x80))
+				break;
+		}
+		if (p > end || v > UINT32_MAX - id ||
+		    (id += v) >= m->hdr->ndocs) {
+			free(ids);
+			return NULL;
+		}
+		ids[i] = id;
+	}
+
+	return ids;
+}
+
+static void
+putvarint(FILE *fp, uint32_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		fputc((v & 0x7f) | 0x80, fp);
+	fputc(v, fp);
+}
+
+/* the record of a document and its length, NULL if it is damaged */
+static const char *
+docrec(const Archmap *m, uint32_t id, size_t *len)
+{
+	uint64_t off = m->docs[id];
+	const char *p, *end = m->addr + m->hdr->docs;
+	int i;
+
+	/* the records come before the table of their offsets */
+	if (off < sizeof(Archhdr) || off >= m->hdr->docs)
+		return NULL;
+	for (p = m->addr + off + 1, i = 0; i < 4; ++i, ++p) {
+		if (p >= end || !(p = memchr(p, '\0', end - p)))
+			return NULL;
+	}
+	*len = p - (m->addr + off);
+
+	return m->addr + off;
+}
+
+static const char *
+srcrec(const Archsrc *s, size_t *len)
+{
+	if (!s->m.addr) {
+		*len = pending[s->doc].reclen;
+		return pending[s->doc].rec;
+	}
+	return docrec(&s->m, s->doc, len);
+}
+
+/* the next word of s, NULL at the end */
+static const char *
+srcword(const Archsrc *s)
+{
+	if (!s->m.addr)
+		return (s->term < s->npairs) ? s->pairs[s->term].word : NULL;
+	return (s->term < s->m.hdr->nterms) ? s->m.terms[s->term].word : NULL;
+}
+
+static void
+addid(uint32_t **ids, size_t *n, size_t *size, uint32_t id)
+{
+	if (*n == *size) {
+		*size = *size ? 2 * *size : 64;
+		*ids = xreallocarray(*ids, *size, sizeof(uint32_t));
+	}
+	(*ids)[(*n)++] = id;
+}
+
+/* merge the documents of the sources, the newest last, into a segment
+ * written to fp */
+static const char *
+writeseg(FILE *fp, Archsrc *src, size_t nsrc)
+{
+	Archhdr hdr;
+	Archterm t, *terms = NULL;
+	Archsrc *s, *min;
+	const char *rec, *minrec = NULL, *w, *sw, *err = NULL;
+	uint64_t *offs = NULL;
+	uint32_t *ids = NULL, *p, n = 0, last;
+	size_t i, len, minlen = 0, nids, maxids = 0, nterms = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	/* the documents by key, the newest version of each */
+	for (;;) {
+		for (min = NULL, s = src; s < src + nsrc; ++s) {
+			if (s->doc == s->ndocs)
+				continue;
+			if (!(rec = srcrec(s, &len)) ||
+			    (s->last && keycmp(s->last, rec) >= 0)) {
+				err = ARCHDAMAGED;
+				goto end;
+			}
+			if (!min || keycmp(rec, minrec) <= 0) {
+				min = s;
+				minrec = rec;
+				minlen = len;
+			}
+		}
+		if (!min)
+			break;
+		for (s = src; s < src + nsrc; ++s) {
+			if (s->doc == s->ndocs ||
+			    keycmp((rec = srcrec(s, &len)), minrec))
+				continue;
+			s->newid[s->doc++] = (s == min) ? n : UINT32_MAX;
+			s->last = rec;
+		}
+		offs = xreallocarray(offs, n + 1, sizeof(uint64_t));
+		offs[n++] = ftell(fp);
+		fwrite(minrec, 1, minlen, fp);
+	}
+	hdr.docs = ftell(fp);
+	hdr.ndocs = n;
+	fwrite(offs, sizeof(uint64_t), n, fp);
+
+	/* the terms by word, with the new ids of their documents */
+	for (;;) {
+		for (w = NULL, s = src; s < src + nsrc; ++s) {
+			if (!(sw = srcword(s)))
+				continue;
+			if (s->m.addr && !memchr(sw, '\0', WORDMAX+1)) {
+				err = ARCHDAMAGED;
+				goto end;
+			}
+			if (!w || strcmp(sw, w) < 0)
+				w = sw;
+		}
+		if (!w)
+			break;
+		memset(&t, 0, sizeof(t));
+		snprintf(t.word, sizeof(t.word), "%.*s", WORDMAX, w);
+		for (nids = 0, s = src; s < src + nsrc; ++s) {
+			if (!(sw = srcword(s)) || strcmp(sw, t.word))
+				continue;
+			if (!s->m.addr) {
+				for (; s->term < s->npairs &&
+				     !strcmp(s->pairs[s->term].word, t.word);
+				     ++s->term)
+					addid(&ids, &nids, &maxids,
+					      s->newid[s->pairs[s->term].id]);
+				continue;
+			}
+			if (!(p = postings(&s->m, &s->m.terms[s->term]))) {
+				err = ARCHDAMAGED;
+				goto end;
+			}
+			for (i = 0; i < s->m.terms[s->term].ndocs; ++i) {
+				if (s->newid[p[i]] != UINT32_MAX)
+					addid(&ids, &nids, &maxids,
+					      s->newid[p[i]]);
+			}
+			free(p);
+			/* a segment out of order would merge wrong */
+			if (++s->term < s->m.hdr->nterms &&
+			    strncmp(s->m.terms[s->term].word, t.word,
+			            WORDMAX+1) <= 0) {
+				err = ARCHDAMAGED;
+				goto end;
+			}
+		}
+		if (!nids)
+			continue;
+		qsort(ids, nids, sizeof(uint32_t), cmpid);
+		t.postings = ftell(fp);
+		for (i = 0, last = 0; i < nids; last = ids[i++])
+			putvarint(fp, ids[i] - last);
+		t.ndocs = nids;
+		t.len = ftell(fp) - t.postings;
+		terms = xreallocarray(terms, nterms+1, sizeof(Archterm));
+		terms[nterms++] = t;
+	}
+
+	/* 8-byte aligned terms, read in place */
+	while (ftell(fp) % 8)
+		fputc(0, fp);
+	hdr.terms = ftell(fp);
+	hdr.nterms = nterms;
+	fwrite(terms, sizeof(Archterm), nterms, fp);
+	memcpy(hdr.magic, ARCHMAGIC, sizeof(hdr.magic));
+	hdr.version = ARCHVERSION;
+	hdr.size = ftell(fp);
+	rewind(fp);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fseek(fp, hdr.size, SEEK_SET);
+end:
+	free(terms);
+	free(offs);
+	free(ids);
+
+	return err;
+}
+
+/* a new temporary file next to path */
+static FILE *
+tmpopen(const char *path, char **tmp)
+{
+	FILE *fp;
+	int fd;
+
+	if (asprintf(tmp, "%s.XXXXXX", path) < 0)
+		die("asprintf: %s", strerror(errno));
+	if ((fd = mkstemp(*tmp)) < 0)
+		return NULL;
+	if (!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(*tmp);
+	}
+
+	return fp;
+}
+
+/* merge the pending documents into the archive; a damaged archive is
+ * left as is, and on any failure the pending documents are dropped and
+ * archiving stops for the session */
+const char *
+archivesync(void)
+{
+	Archsrc *src = NULL, *s;
+	Archpair *pairs = NULL;
+	FILE *fp;
+	unsigned long *segs = NULL, next;
+	uint64_t n = npending, size;
+	size_t i, j, k, nsegs = 0, npairs = 0;
+	char *path, *lock = NULL, *tmp = NULL, *seg = NULL, *w;
+	const char *err = NULL;
+	int lockfd = -1;
+
+	if (!npending)
+		return NULL;
+	if (!(path = homepath(archive))) {
+		archoff = 1;
+		pendingfree();
+		return "no $HOME";
+	}
+	if (asprintf(&lock, "%s.lock", path) < 0)
+		die("asprintf: %s", strerror(errno));
+	/* other sacc processes merge into the same archive */
+	if ((lockfd = open(lock, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) < 0 ||
+	    flock(lockfd, LOCK_EX) < 0) {
+		err = strerror(errno);
+		goto end;
+	}
+	if ((err = readmanifest(path, &segs, &nsegs)))
+		goto end;
+
+	/* merge in the newest segments holding no more than twice as many
+	 * documents as those they are merged with, src[k] on */
+	src = xcalloc((nsegs + 1) * sizeof(Archsrc));
+	for (k = nsegs; k > 0; --k) {
+		s = &src[k-1];
+		if ((err = segmap(&s->m, path, segs[k-1])))
+			goto end;
+		if (s->m.hdr->ndocs > 2 * n) {
+			archunmap(&s->m);
+			s->m.addr = NULL;
+			break;
+		}
+		n += s->ndocs = s->m.hdr->ndocs;
+		s->newid = xreallocarray(NULL, s->ndocs ? s->ndocs : 1,
+		                         sizeof(uint32_t));
+	}
+
+	/* the pending documents come last, winning over the others, and
+	 * their words by word then id */
+	qsort(pending, npending, sizeof(Archdoc), cmpdoc);
+	for (i = 0; i < npending; ++i) {
+		pairs = xreallocarray(pairs, npairs + pending[i].nwords,
+		                      sizeof(Archpair));
+		for (w = pending[i].words, j = 0; j < pending[i].nwords;
+		     ++j, w += strlen(w) + 1) {
+			pairs[npairs].word = w;
+			pairs[npairs++].id = i;
+		}
+	}
+	qsort(pairs, npairs, sizeof(Archpair), cmppair);
+	s = &src[nsegs];
+	s->pairs = pairs;
+	s->npairs = npairs;
+	s->ndocs = npending;
+	s->newid = xreallocarray(NULL, npending, sizeof(uint32_t));
+
+	next = nsegs ? segs[nsegs-1] + 1 : 1;
+	seg = segpath(path, next);
+	if (!(fp = tmpopen(path, &tmp))) {
+		err = strerror(errno);
+		goto end;
+	}
+	if ((err = writeseg(fp, src + k, nsegs - k + 1))) {
+		fclose(fp);
+		unlink(tmp);
+		goto end;
+	}
+	size = ftell(fp);
+	if (ferror(fp) | fclose(fp) || rename(tmp, seg) < 0) {
+		err = strerror(errno);
+		unlink(tmp);
+		goto end;
+	}
+	free(tmp);
+	tmp = NULL;
+
+	/* list the segments left and the new one */
+	if (!(fp = tmpopen(path, &tmp))) {
+		err = strerror(errno);
+		unlink(seg);
+		goto end;
+	}
+	fprintf(fp, "%s 1\n", ARCHMAGIC);
+	for (i = 0; i < k; ++i)
+		fprintf(fp, "%lu\n", segs[i]);
+	fprintf(fp, "%lu\n", next);
+	if (ferror(fp) | fclose(fp) || rename(tmp, path) < 0) {
+		err = strerror(errno);
+		unlink(tmp);
+		unlink(seg);
+		goto end;
+	}
+	for (i = k; i < nsegs; ++i) {
+		free(seg);
+		seg = segpath(path, segs[i]);
+		unlink(seg);
+	}
+
+	nsynced += npending;
+	nwritten += size;
+	++nmerges;
+end:
+	if (lockfd >= 0)
+		close(lockfd);
+	for (i = 0; src && i <= nsegs; ++i) {
+		archunmap(&src[i].m);
+		free(src[i].newid);
+	}
+	if (err)
+		archoff = 1;
+	pendingfree();
+	free(src);
+	free(pairs);
+	free(segs);
+	free(seg);
+	free(lock);
+	free(tmp);
+	free(path);
+
+	return err;
+}
+
+static const Archterm *
+findterm(const Archmap *m, const char *w)
+{
+	size_t lo = 0, hi = m->hdr->nterms, mid;
+	int r;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (!(r = strncmp(w, m->terms[mid].word, WORDMAX+1)))
+			return &m->terms[mid];
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+/* whether m holds a document of the key of rec */
+static int
+finddoc(const Archmap *m, const char *rec)
+{
+	size_t lo = 0, hi = m->hdr->ndocs, mid, len;
+	const char *r;
+	int c;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (!(r = docrec(m, mid, &len)))
+			return 0;
+		if (!(c = keycmp(rec, r)))
+			return 1;
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return 0;
+}
+
+/* the ascending ids of the documents of m holding all words of query */
+static const char *
+matches(const Archmap *m, const char *query, uint32_t **hits, size_t *nh)
+{
+	const Archterm *t;
+	char w[WORDMAX+1];
+	uint32_t *ids;
+	size_t i, j, k, n, c;
+	int first = 1;
+
+	*hits = NULL;
+	*nh = 0;
+	for (i = 0; query[i]; i += n) {
+		if ((n = pickword(query + i, w)) < 2) {
+			n = n ? n : 1;
+			continue;
+		}
+		if (!(t = findterm(m, w))) {
+			*nh = 0;
+			break;
+		}
+		if (!(ids = postings(m, t))) {
+			clear(hits);
+			*nh = 0;
+			return ARCHDAMAGED;
+		}
+		if (first) {
+			*hits = ids;
+			*nh = t->ndocs;
+			first = 0;
+			continue;
+		}
+		for (j = k = c = 0; j < *nh && k < t->ndocs;) {
+			if ((*hits)[j] < ids[k]) {
+				++j;
+			} else if ((*hits)[j] > ids[k]) {
+				++k;
+			} else {
+				(*hits)[c++] = (*hits)[j++];
+				++k;
+			}
+		}
+		*nh = c;
+		free(ids);
+		if (!*nh)
+			break;
+	}
+
+	return NULL;
+}
+
+/* the archived documents matching all words of query, as the lines of
+ * a menu, NULL if none does */
+char *
+archivequery(const char *query, size_t *nhits, const char **err)
+{
+	Archmap *segs = NULL;
+	FILE *fp;
+	const char *rec, *sel, *host, *port, *title;
+	char *path, *lock = NULL, *menu = NULL;
+	unsigned long *nums = NULL;
+	uint32_t *hits = NULL;
+	size_t i, j, k, n, nh, nsegs = 0, len;
+	int lockfd;
+
+	*nhits = 0;
+	if ((*err = archivesync()) || !archive ||
+	    !(path = homepath(archive)))
+		return NULL;
+	if (asprintf(&lock, "%s.lock", path) < 0)
+		die("asprintf: %s", strerror(errno));
+	/* keep a merge from replacing the segments while they are mapped */
+	if ((lockfd = open(lock, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) < 0 ||
+	    flock(lockfd, LOCK_SH) < 0) {
+		*err = strerror(errno);
+		goto end;
+	}
+	if (!(*err = readmanifest(path, &nums, &nsegs))) {
+		segs = xcalloc((nsegs ? nsegs : 1) * sizeof(Archmap));
+		for (i = 0; i < nsegs && !*err; ++i)
+			*err = segmap(&segs[i], path, nums[i]);
+	}
+	close(lockfd);
+	if (*err || !nsegs)
+		goto end;
+
+	if (!(fp = open_memstream(&menu, &len)))
+		die("open_memstream: %s", strerror(errno));
+	/* the newest segments first, skipping the replaced documents */
+	for (i = nsegs; i-- > 0 && !*err;) {
+		if ((*err = matches(&segs[i], query, &hits, &nh)))
+			break;
+		for (j = 0; j < nh; ++j) {
+			if (!(rec = docrec(&segs[i], hits[j], &n))) {
+				*err = ARCHDAMAGED;
+				break;
+			}
+			for (k = i + 1; k < nsegs; ++k) {
+				if (finddoc(&segs[k], rec))
+					break;
+			}
+			if (k < nsegs)
+				continue;
+			sel = rec + 1;
+			host = sel + strlen(sel) + 1;
+			port = host + strlen(host) + 1;
+			title = port + strlen(port) + 1;
+			fprintf(fp, "%c%s\t%s\t%s\t%s\r\n",
+			        rec[0], title, sel, host, port);
+			++*nhits;
+		}
+		clear(&hits);
+	}
+	fclose(fp);
+	if (*err || !*nhits) {
+		clear(&menu);
+		*nhits = 0;
+	}
+end:
+	for (i = 0; i < nsegs && segs; ++i)
+		archunmap(&segs[i]);
+	free(segs);
+	free(nums);
+	free(lock);
+	free(path);
+
+	return menu;
+}
+
+void
+archivestats(FILE *fp)
+{
+	if (!narchived)
+		return;
+	fprintf(fp, "archive: %llu documents, %llu merged, %zu pending, "
+	        "%llu merges writing %llu bytes%s\n", narchived, nsynced,
+	        npending, nmerges, nwritten, archoff ? ", stopped" : "");
+}
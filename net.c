@@ -0,0 +1,1497 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+#include "config.h"
+
+#define DNSFAILTTL	10 /* seconds failed resolutions are kept */
+
+typedef struct bound Bound;
+typedef struct conn Conn;
+typedef struct dns Dns;
+
+struct host {
+	char *name;
+	char *port;
+	int srtt;	/* smoothed connection time in ms, 0 if unknown */
+	int fails;	/* consecutive connection failures */
+	int active;	/* connections open */
+	long long retry; /* no background connection before */
+	Host *next;
+};
+
+/* a connection opened for the user, holding a scheduler slot */
+struct bound {
+	int fd;
+	Host *h;
+	Bound *next;
+};
+
+typedef struct {
+	Host *h;
+	struct addrinfo *addrs, *addr;
+	long long start;
+	size_t idx;
+	int fd;
+} Racer;
+
+/* resolved addresses are packed as a sequence of records */
+typedef struct {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+} Dnsrec;
+
+struct dns {
+	Watch w;	/* socket from the resolver thread */
+	char *host;
+	char *port;
+	int started;	/* resolver thread running */
+	int pending;
+	int err;	/* getaddrinfo() error */
+	Dnsrec *recs;
+	size_t nrecs, len;
+	long long expire;
+	Dns *next;
+};
+
+struct conn {
+	Watch w;
+	Host *h;
+	int connected;
+	Conn *next;
+};
+
+static const struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_protocol = IPPROTO_TCP,
+};
+
+static Dns *dnscache;
+static int ndnsresolving;
+static unsigned long long ndnsahead, ndnshits, ndnsmisses, ndnstimeouts;
+static Host *hosts;
+static Bound *bound;
+static Fetch *queue;
+static size_t nqueued, maxqueued;
+static int nactive;
+static long long conntokens, connstamp;
+static Watch schedtimer;
+static unsigned long long ndemandconns, demandwait, maxdemandwait;
+static unsigned long long nbgconns, bgwait, maxbgwait;
+static Conn *pool;
+static int npool;
+static unsigned long long npreconnects, npoolhits, npoolwasted;
+static Watch *watches;
+static size_t nwatches;
+static unsigned long watchids;
+static unsigned long *dropped;	/* ids of the watches dropped by callbacks */
+static size_t ndropped, maxdropped;
+static int dispatching;
+static long long bgtokens, bgstamp;
+
+long long
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void
+watchadd(Watch *w)
+{
+	w->id = ++watchids;
+	w->next = watches;
+	watches = w;
+	++nwatches;
+}
+
+void
+watchdel(Watch *w)
+{
+	Watch **wp;
+
+	for (wp = &watches; *wp; wp = &(*wp)->next) {
+		if (*wp == w) {
+			*wp = w->next;
+			--nwatches;
+			if (dispatching) {
+				if (ndropped == maxdropped) {
+					maxdropped = maxdropped ? 2*maxdropped : 16;
+					dropped = xreallocarray(dropped, maxdropped,
+					                        sizeof(*dropped));
+				}
+				dropped[ndropped++] = w->id;
+			}
+			w->id = 0;
+			return;
+		}
+	}
+}
+
+/* whether an earlier callback of this dispatch dropped the watch */
+static int
+wasdropped(unsigned long id)
+{
+	size_t i;
+
+	for (i = 0; i < ndropped; ++i) {
+		if (dropped[i] == id)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* wait at most `timeout' ms (-1 for ever) for `fd' to be readable, running
+ * the callbacks of the watches ready in the meantime */
+int
+netwait(int fd, int timeout)
+{
+	struct pollfd *pfd;
+	Watch *w, **v;
+	unsigned long *ids;
+	long long t = now();
+	size_t i, n = 0;
+	int r, ready;
+
+	pfd = xreallocarray(NULL, nwatches + 1, sizeof(*pfd));
+	v = xreallocarray(NULL, nwatches + 1, sizeof(*v));
+	ids = xreallocarray(NULL, nwatches + 1, sizeof(*ids));
+
+	for (w = watches; w; w = w->next, ++n) {
+		if (w->deadline &&
+		    (timeout < 0 || w->deadline - t < timeout))
+			timeout = (w->deadline > t) ? w->deadline - t : 0;
+		pfd[n].fd = w->events ? w->fd : -1;
+		pfd[n].events = w->events;
+		pfd[n].revents = 0;
+		v[n] = w;
+		ids[n] = w->id;
+	}
+	pfd[n].fd = fd;
+	pfd[n].events = POLLIN;
+	pfd[n].revents = 0;
+
+	if ((r = poll(pfd, n+1, timeout)) < 0 && errno != EINTR)
+		die("poll: %s", strerror(errno));
+	ready = (r > 0 && pfd[n].revents);
+
+	t = now();
+	++dispatching;
+	for (i = 0; i < n; ++i) {
+		if (wasdropped(ids[i]))
+			continue;
+		if (r > 0 && pfd[i].revents)
+			v[i]->cb(v[i], pfd[i].revents);
+		else if (v[i]->deadline && v[i]->deadline <= t)
+			v[i]->cb(v[i], 0);
+	}
+	if (!--dispatching)
+		ndropped = 0;
+
+	free(pfd);
+	free(v);
+	free(ids);
+
+	return ready;
+}
+
+static int
+sockerror(int fd)
+{
+	socklen_t sl = sizeof(int);
+	int err;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &sl) < 0)
+		return errno;
+
+	return err;
+}
+
+static int
+nbconnect(const struct addrinfo *addr)
+{
+	int fd;
+
+	if ((fd = socket(addr->ai_family, addr->ai_socktype,
+	                 addr->ai_protocol)) < 0)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0 ||
+	    errno == EINPROGRESS)
+		return fd;
+	close(fd);
+
+	return -1;
+}
+
+/* ms left until deadline, -1 if there is none */
+static int
+remaining(long long deadline)
+{
+	long long t;
+
+	if (!deadline)
+		return -1;
+
+	return ((t = deadline - now()) > 0) ? t : 0;
+}
+
+/* deadline ms from now, none if ms isn't positive */
+static long long
+expiry(int ms)
+{
+	return (ms > 0) ? now() + ms : 0;
+}
+
+/* wait for events on fd until deadline, failing with ETIMEDOUT */
+static int
+fdwait(int fd, short events, long long deadline)
+{
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	while ((r = poll(&pfd, 1, remaining(deadline))) < 0 &&
+	       errno == EINTR)
+		;
+	if (r == 0)
+		errno = ETIMEDOUT;
+
+	return r;
+}
+
+/* make a connected socket blocking, writes giving up after idletimeout */
+static void
+blocking(int fd)
+{
+	struct timeval tv;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	if (idletimeout > 0) {
+		tv.tv_sec = idletimeout / 1000;
+		tv.tv_usec = idletimeout % 1000 * 1000;
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+}
+
+/* connect to addr, giving up with ETIMEDOUT after connecttimeout */
+int
+netconnect(const struct addrinfo *addr)
+{
+	int fd, err;
+
+	if ((fd = nbconnect(addr)) < 0)
+		return -1;
+	if (fdwait(fd, POLLOUT, expiry(connecttimeout)) <= 0)
+		goto err;
+	if ((err = sockerror(fd))) {
+		errno = err;
+		goto err;
+	}
+	blocking(fd);
+
+	return fd;
+err:
+	err = errno;
+	close(fd);
+	errno = err;
+
+	return -1;
+}
+
+/* read from a blocking socket, failing with ETIMEDOUT when nothing
+ * came for timeout ms */
+ssize_t
+netread(int fd, void *buf, size_t n, int timeout)
+{
+	if (timeout > 0 && !tlspending(fd) &&
+	    fdwait(fd, POLLIN, now() + timeout) <= 0)
+		return -1;
+
+	return tlsread(fd, buf, n);
+}
+
+/* speak TLS over a connected blocking socket, *err telling why it
+ * couldn't after connecttimeout */
+int
+nettls(int fd, const char *host, const char *port, const char **err)
+{
+	long long deadline = expiry(connecttimeout);
+	int r;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	while ((r = tlsconnect(fd, host, port, err)) > 0) {
+		if (fdwait(fd, r, deadline) <= 0) {
+			*err = strerror(errno);
+			return -1;
+		}
+	}
+	blocking(fd);
+
+	return r;
+}
+
+static void
+dnsstore(Dns *d, int err, struct addrinfo *addrs)
+{
+	struct addrinfo *ai;
+	Dnsrec *r;
+
+	d->pending = 0;
+	d->err = err;
+	d->expire = now() + (err ? DNSFAILTTL : dnsttl) * 1000LL;
+	if (err)
+		return;
+	for (ai = addrs; ai; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(r->addr))
+			continue;
+		d->recs = xreallocarray(d->recs, ++d->nrecs, sizeof(*r));
+		r = &d->recs[d->nrecs-1];
+		r->family = ai->ai_family;
+		r->socktype = ai->ai_socktype;
+		r->protocol = ai->ai_protocol;
+		r->addrlen = ai->ai_addrlen;
+		memcpy(&r->addr, ai->ai_addr, ai->ai_addrlen);
+	}
+}
+
+/* rebuild an addrinfo list in a single allocation to be free()d */
+static struct addrinfo *
+dnsaddrs(Dns *d)
+{
+	struct addrinfo *ai;
+	Dnsrec *r;
+	size_t i;
+
+	if (!d->nrecs)
+		return NULL;
+
+	ai = xreallocarray(NULL, d->nrecs, sizeof(*ai) + sizeof(*r));
+	r = (Dnsrec *)(ai + d->nrecs);
+	memcpy(r, d->recs, d->nrecs * sizeof(*r));
+	memset(ai, 0, d->nrecs * sizeof(*ai));
+	for (i = 0; i < d->nrecs; ++i) {
+		ai[i].ai_family = r[i].family;
+		ai[i].ai_socktype = r[i].socktype;
+		ai[i].ai_protocol = r[i].protocol;
+		ai[i].ai_addrlen = r[i].addrlen;
+		ai[i].ai_addr = (struct sockaddr *)&r[i].addr;
+		ai[i].ai_next = (i+1 < d->nrecs) ? &ai[i+1] : NULL;
+	}
+
+	return ai;
+}
+
+static void dnsstart(void);
+static void schedkick(void);
+
+static void
+dnscb(Watch *w, short revents)
+{
+	Dns *d = (Dns *)w;
+	char buf[BUFSIZ];
+	ssize_t n;
+	int err;
+
+	if (!revents) {
+		/* the resolver hangs, leave it to finish on its own */
+		n = -1;
+		++ndnstimeouts;
+	} else if ((n = read(w->fd, buf, sizeof(buf))) < 0 &&
+	           (errno == EAGAIN || errno == EINTR)) {
+		return;
+	} else if (n > 0) {
+		d->recs = xreallocarray(d->recs, d->len + n, 1);
+		memcpy((char *)d->recs + d->len, buf, n);
+		d->len += n;
+		return;
+	}
+
+	watchdel(w);
+	close(w->fd);
+	w->fd = -1;
+	--ndnsresolving;
+
+	if (n < 0 || d->len < sizeof(err)) {
+		err = revents ? EAI_FAIL : EAI_AGAIN;
+		d->nrecs = 0;
+	} else {
+		memcpy(&err, d->recs, sizeof(err));
+		d->nrecs = (d->len - sizeof(err)) / sizeof(Dnsrec);
+		memmove(d->recs, (char *)d->recs + sizeof(err),
+		        d->nrecs * sizeof(Dnsrec));
+	}
+	d->pending = 0;
+	d->err = err ? err : d->nrecs ? 0 : EAI_NONAME;
+	d->expire = now() + (d->err ? DNSFAILTTL : dnsttl) * 1000LL;
+
+	dnsstart();
+	schedkick();
+}
+
+/* a resolution running in its own thread, which sends the error and
+ * the records to fd */
+typedef struct {
+	char *host;
+	char *port;
+	int fd;
+} Dnsjob;
+
+static void *
+dnsthread(void *arg)
+{
+	Dnsjob *j = arg;
+	struct addrinfo *addrs;
+	Dns d = { 0 };
+	char *p, *q;
+	size_t len;
+	ssize_t n;
+	int err;
+
+	err = getaddrinfo(j->host, j->port, &hints, &addrs);
+	dnsstore(&d, err, addrs);
+	if (!err)
+		freeaddrinfo(addrs);
+
+	len = sizeof(err) + d.nrecs * sizeof(Dnsrec);
+	p = xmalloc(len);
+	memcpy(p, &err, sizeof(err));
+	memcpy(p + sizeof(err), d.recs, d.nrecs * sizeof(Dnsrec));
+	/* the other end is gone if we took too long */
+	for (q = p; len; len -= n, q += n) {
+		if ((n = send(j->fd, q, len, MSG_NOSIGNAL)) < 0)
+			break;
+	}
+
+	free(p);
+	free(d.recs);
+	close(j->fd);
+	free(j->host);
+	free(j->port);
+	free(j);
+
+	return NULL;
+}
+
+static void
+dnsresolve(Dns *d)
+{
+	struct addrinfo *addrs;
+	pthread_attr_t attr;
+	pthread_t t;
+	sigset_t set, oset;
+	Dnsjob *j;
+	int fds[2], err;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, fds) < 0)
+		goto sync;
+
+	j = xmalloc(sizeof(Dnsjob));
+	j->host = xstrdup(d->host);
+	j->port = xstrdup(d->port);
+	j->fd = fds[1];
+
+	/* signals are for the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&t, &attr, dnsthread, j);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (err) {
+		close(fds[0]);
+		close(fds[1]);
+		free(j->host);
+		free(j->port);
+		free(j);
+		goto sync;
+	}
+
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	d->started = 1;
+	d->w.fd = fds[0];
+	d->w.events = POLLIN;
+	d->w.deadline = now() + dnstimeout;
+	d->w.cb = dnscb;
+	watchadd(&d->w);
+	++ndnsresolving;
+	return;
+
+sync:
+	err = getaddrinfo(d->host, d->port, &hints, &addrs);
+	dnsstore(d, err, addrs);
+	if (!err)
+		freeaddrinfo(addrs);
+}
+
+/* start the queued resolutions within the parallelism budget */
+static void
+dnsstart(void)
+{
+	Dns *d;
+
+	for (d = dnscache; d && ndnsresolving < dnsmax; d = d->next) {
+		if (d->pending && !d->started)
+			dnsresolve(d);
+	}
+}
+
+static Dns *
+dnsfind(const char *host, const char *port)
+{
+	Dns **dp, *d;
+
+	for (dp = &dnscache; (d = *dp); dp = &d->next) {
+		if (strcmp(d->host, host) || strcmp(d->port, port))
+			continue;
+		if (d->pending || d->expire > now())
+			return d;
+		/* expired */
+		*dp = d->next;
+		free(d->host);
+		free(d->port);
+		free(d->recs);
+		free(d);
+		break;
+	}
+
+	return NULL;
+}
+
+static Dns *
+dnsnew(const char *host, const char *port)
+{
+	Dns *d;
+
+	d = xcalloc(sizeof(Dns));
+	d->host = xstrdup(host);
+	d->port = xstrdup(port);
+	d->w.fd = -1;
+	d->next = dnscache;
+	dnscache = d;
+
+	return d;
+}
+
+/* a new resolution of host:port, done at once for an address, else
+ * pending */
+static Dns *
+dnslookup(const char *host, const char *port)
+{
+	static const struct addrinfo numeric = {
+	    .ai_flags = AI_NUMERICHOST,
+	    .ai_family = AF_UNSPEC,
+	    .ai_socktype = SOCK_STREAM,
+	    .ai_protocol = IPPROTO_TCP,
+	};
+	struct addrinfo *addrs;
+	Dns *d;
+
+	d = dnsnew(host, port);
+	if (!getaddrinfo(host, port, &numeric, &addrs)) {
+		dnsstore(d, 0, addrs);
+		freeaddrinfo(addrs);
+	} else {
+		d->pending = 1;
+	}
+
+	return d;
+}
+
+/* resolve host:port in the background ahead of its use */
+void
+dnsprefetch(const char *host, const char *port)
+{
+	if (!dnsmax || !*host || dnsfind(host, port))
+		return;
+
+	if (dnslookup(host, port)->pending) {
+		++ndnsahead;
+		dnsstart();
+	}
+}
+
+/* like getaddrinfo(), using the resolutions done ahead, waiting at
+ * most dnstimeout ms for a pending one; the list is to be free()d */
+int
+resolve(const char *host, const char *port, struct addrinfo **addrs)
+{
+	Dns *d;
+
+	if ((d = dnsfind(host, port))) {
+		++ndnshits;
+	} else {
+		++ndnsmisses;
+		d = dnslookup(host, port);
+	}
+	if (d->pending && !d->started)
+		dnsresolve(d);
+	while (d->pending)
+		netwait(-1, -1);
+	if (d->err)
+		return d->err;
+
+	return (*addrs = dnsaddrs(d)) ? 0 : EAI_NONAME;
+}
+
+static Host *
+hostget(const char *name, const char *port)
+{
+	Host *h;
+
+	for (h = hosts; h; h = h->next) {
+		if (!strcmp(h->name, name) && !strcmp(h->port, port))
+			return h;
+	}
+
+	h = xcalloc(sizeof(Host));
+	h->name = xstrdup(name);
+	h->port = xstrdup(port);
+	h->next = hosts;
+	hosts = h;
+
+	return h;
+}
+
+/* refill the connection rate bucket, return the ms until a token */
+static long long
+ratewait(void)
+{
+	long long t;
+
+	if (!netrate)
+		return 0;
+
+	t = now();
+	conntokens += (t - connstamp) * netrate;
+	if (conntokens > netrate * 1000LL)
+		conntokens = netrate * 1000LL;
+	connstamp = t;
+
+	return (conntokens >= 1000) ? 0 : (1000 - conntokens) / netrate + 1;
+}
+
+/* ms until a connection to h may be opened, -1 until one is closed;
+ * background work leaves a slot for the user and respects backoffs */
+static long long
+schedwhen(Host *h, int demand)
+{
+	long long t;
+	int keep = !demand;
+
+	if (nactive >= netmax - (netmax > 1 && keep) ||
+	    h->active >= hostmax - (hostmax > 1 && keep))
+		return -1;
+	if (!demand && (t = h->retry - now()) > 0)
+		return t;
+
+	return ratewait();
+}
+
+static void
+schedtake(Host *h)
+{
+	++h->active;
+	++nactive;
+	if (netrate)
+		conntokens -= 1000;
+}
+
+void
+schedput(Host *h)
+{
+	--h->active;
+	--nactive;
+	schedkick();
+}
+
+static void
+hostok(Host *h)
+{
+	h->fails = 0;
+	h->retry = 0;
+}
+
+/* back off exponentially from a failing server */
+void
+hostfailed(Host *h)
+{
+	int n = (h->fails < 20) ? h->fails++ : 20;
+
+	h->retry = now() + ((1000LL << n) < backoffmax * 1000LL ?
+	                    (1000LL << n) : backoffmax * 1000LL);
+}
+
+static int
+dnsready(Host *h)
+{
+	Dns *d;
+
+	if (!(d = dnsfind(h->name, h->port))) {
+		dnsprefetch(h->name, h->port);
+		d = dnsfind(h->name, h->port);
+	}
+
+	return !d || !d->pending;
+}
+
+static void
+poolfree(Conn *c)
+{
+	Conn **cp;
+
+	for (cp = &pool; *cp; cp = &(*cp)->next) {
+		if (*cp == c) {
+			*cp = c->next;
+			break;
+		}
+	}
+	watchdel(&c->w);
+	--npool;
+	free(c);
+}
+
+/* drop a pooled connection that was never used */
+static void
+pooldrop(Conn *c, int failed)
+{
+	Host *h = c->h;
+
+	++npoolwasted;
+	watchdel(&c->w);
+	close(c->w.fd);
+	poolfree(c);
+	if (failed)
+		hostfailed(h);
+	schedput(h);
+}
+
+static void
+poolcb(Watch *w, short revents)
+{
+	Conn *c = (Conn *)w;
+
+	if (!c->connected && (revents & POLLOUT)) {
+		if (sockerror(w->fd)) {
+			pooldrop(c, 1);
+			return;
+		}
+		hostok(c->h);
+		c->connected = 1;
+		w->events = POLLIN;
+		return;
+	}
+
+	/* expired or closed by the server */
+	pooldrop(c, 0);
+}
+
+static Conn *
+poolfind(Host *h)
+{
+	Conn *c;
+
+	for (c = pool; c; c = c->next) {
+		if (c->h == h)
+			return c;
+	}
+
+	return NULL;
+}
+
+/* open a connection to host:port ahead of its use */
+void
+preconnect(const char *host, const char *port)
+{
+	struct addrinfo *addrs;
+	Host *h = hostget(host, port);
+	Conn *c;
+	int fd;
+
+	if (npool >= poolmax || poolfind(h) || schedwhen(h, 0) ||
+	    !dnsready(h) || resolve(host, port, &addrs))
+		return;
+	fd = nbconnect(addrs);
+	free(addrs);
+	if (fd < 0)
+		return;
+	schedtake(h);
+
+	c = xcalloc(sizeof(Conn));
+	c->h = h;
+	c->w.fd = fd;
+	c->w.events = POLLOUT;
+	c->w.deadline = now() + poolidle;
+	c->w.cb = poolcb;
+	c->next = pool;
+	pool = c;
+	++npool;
+	++npreconnects;
+	watchadd(&c->w);
+}
+
+/* take the pooled connection to h, possibly still connecting, along
+ * with its slot */
+static int
+poolget(Host *h)
+{
+	Conn *c;
+	int fd;
+
+	if (!(c = poolfind(h)))
+		return -1;
+	fd = c->w.fd;
+	poolfree(c);
+	++npoolhits;
+
+	return fd;
+}
+
+/* the connection fd to h was opened for the user */
+void
+schedbind(Host *h, int fd)
+{
+	Bound *b;
+
+	hostok(h);
+	b = xmalloc(sizeof(Bound));
+	b->fd = fd;
+	b->h = h;
+	b->next = bound;
+	bound = b;
+}
+
+/* close fd, giving back its slot if it is a connection */
+void
+netclose(int fd)
+{
+	Bound **bp, *b;
+
+	tlsclose(fd);
+	close(fd);
+	for (bp = &bound; (b = *bp); bp = &b->next) {
+		if (b->fd == fd) {
+			*bp = b->next;
+			schedput(b->h);
+			free(b);
+			return;
+		}
+	}
+}
+
+/* take a pooled connection to host:port as a blocking socket */
+int
+pooltake(const char *host, const char *port)
+{
+	Host *h = hostget(host, port);
+	int fd;
+
+	if ((fd = poolget(h)) < 0)
+		return -1;
+
+	if (fdwait(fd, POLLOUT, expiry(connecttimeout)) <= 0 ||
+	    sockerror(fd)) {
+		--npoolhits;
+		++npoolwasted;
+		close(fd);
+		hostfailed(h);
+		schedput(h);
+		return -1;
+	}
+	blocking(fd);
+	schedbind(h, fd);
+
+	return fd;
+}
+
+static Host *
+schedhost(Host *h)
+{
+	long long t, start = now();
+
+	while ((t = schedwhen(h, 1))) {
+		if (t > 0) {
+			netwait(-1, t);
+		} else if (pool) {
+			/* idle connections make room for the user */
+			pooldrop(pool, 0);
+		} else {
+			/* only the user's own connections are left */
+			break;
+		}
+	}
+	schedtake(h);
+
+	t = now() - start;
+	++ndemandconns;
+	demandwait += t;
+	if (t > maxdemandwait)
+		maxdemandwait = t;
+
+	return h;
+}
+
+/* wait for the scheduler to let the user connect to host:port */
+Host *
+schedwait(const char *name, const char *port)
+{
+	return schedhost(hostget(name, port));
+}
+
+static int
+racercmp(const void *a, const void *b)
+{
+	const Racer *r = a, *s = b;
+
+	if (r->h->fails != s->h->fails)
+		return r->h->fails - s->h->fails;
+	if (!r->h->srtt != !s->h->srtt)
+		return !r->h->srtt - !s->h->srtt;
+	if (r->h->srtt != s->h->srtt)
+		return r->h->srtt - s->h->srtt;
+
+	return (r->idx > s->idx) - (r->idx < s->idx);
+}
+
+static int
+racerstart(Racer *r)
+{
+	for (; r->addr; r->addr = r->addr->ai_next) {
+		if ((r->fd = nbconnect(r->addr)) >= 0) {
+			r->start = now();
+			return 1;
+		}
+	}
+	hostfailed(r->h);
+	schedput(r->h);
+
+	return 0;
+}
+
+/* connect to whichever of the n servers answers first, the fastest
+ * known one getting a head start, and return its index in *won;
+ * all of them get connecttimeout ms to answer */
+int
+connectrace(char **name, char **port, size_t n, size_t *won)
+{
+	struct pollfd *pfd;
+	Racer *rs, *r, **v;
+	long long deadline, stagger = 0;
+	size_t i, next, nv;
+	int fd = -1, running = 0, blocked, rtt, t, left, err = ECONNREFUSED;
+
+	rs = xreallocarray(NULL, n, sizeof(*rs));
+	pfd = xreallocarray(NULL, n, sizeof(*pfd));
+	v = xreallocarray(NULL, n, sizeof(*v));
+	for (i = 0; i < n; ++i) {
+		rs[i].h = hostget(name[i], port[i]);
+		rs[i].addrs = NULL;
+		rs[i].idx = i;
+		rs[i].fd = -1;
+	}
+	qsort(rs, n, sizeof(*rs), racercmp);
+	if (rs[0].h->srtt && !rs[0].h->fails)
+		stagger = now() + 2 * rs[0].h->srtt + 100;
+	deadline = expiry(connecttimeout);
+
+	for (next = 0; fd < 0;) {
+		blocked = 0;
+		while (next < n &&
+		       (!running || !stagger || now() >= stagger)) {
+			r = &rs[next];
+			/* only the first one may wait for the scheduler */
+			if (running && schedwhen(r->h, 1)) {
+				blocked = 1;
+				break;
+			}
+			++next;
+			if (running)
+				schedtake(r->h);
+			else
+				schedhost(r->h);
+			if (resolve(r->h->name, r->h->port, &r->addrs)) {
+				schedput(r->h);
+				continue;
+			}
+			r->addr = r->addrs;
+			running += racerstart(r);
+		}
+		if (!running)
+			break;
+
+		for (i = nv = 0; i < next; ++i) {
+			if (rs[i].fd < 0)
+				continue;
+			pfd[nv].fd = rs[i].fd;
+			pfd[nv].events = POLLOUT;
+			v[nv++] = &rs[i];
+		}
+		t = blocked ? 100 : (next < n && stagger) ?
+		    remaining(stagger) : -1;
+		if ((left = remaining(deadline)) == 0) {
+			err = ETIMEDOUT;
+			break;
+		}
+		if (left > 0 && (t < 0 || left < t))
+			t = left;
+		if (poll(pfd, nv, t) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (i = 0; i < nv && fd < 0; ++i) {
+			if (!pfd[i].revents)
+				continue;
+			r = v[i];
+			if (sockerror(r->fd)) {
+				close(r->fd);
+				r->fd = -1;
+				r->addr = r->addr->ai_next;
+				if (!racerstart(r))
+					--running;
+				continue;
+			}
+			rtt = now() - r->start;
+			r->h->srtt = r->h->srtt ?
+			             (7 * r->h->srtt + rtt) / 8 : rtt ? rtt : 1;
+			fd = r->fd;
+			r->fd = -1;
+			*won = r->idx;
+			schedbind(r->h, fd);
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (rs[i].fd >= 0) {
+			close(rs[i].fd);
+			schedput(rs[i].h);
+		}
+		free(rs[i].addrs);
+	}
+	free(rs);
+	free(pfd);
+	free(v);
+
+	if (fd >= 0)
+		blocking(fd);
+	else
+		errno = err;
+
+	return fd;
+}
+
+void
+netstats(FILE *fp)
+{
+	fprintf(fp, "preconnect: %llu, %llu used, %llu wasted\n",
+	        npreconnects, npoolhits, npoolwasted);
+	fprintf(fp, "resolve ahead: %llu, %llu hits, %llu misses, "
+	        "%llu timed out\n", ndnsahead, ndnshits, ndnsmisses,
+	        ndnstimeouts);
+	fprintf(fp, "connections: %d open, %zu queued (%zu at most)\n",
+	        nactive, nqueued, maxqueued);
+	fprintf(fp, "demand connections: %llu, waited %llu ms (%llu ms at most)\n",
+	        ndemandconns, demandwait, maxdemandwait);
+	fprintf(fp, "background connections: %llu, waited %llu ms "
+	        "(%llu ms at most)\n",
+	        nbgconns, bgwait, maxbgwait);
+}
+
+/* take at most `n' bytes out of the background bandwidth budget */
+static size_t
+bgbudget(size_t n)
+{
+	long long t;
+
+	if (!prefetchrate)
+		return n;
+
+	t = now();
+	bgtokens += (t - bgstamp) * (long long)prefetchrate / 1000;
+	if (bgtokens > (long long)prefetchrate)
+		bgtokens = prefetchrate;
+	bgstamp = t;
+
+	if (bgtokens <= 0)
+		return 0;
+	if (n > bgtokens)
+		n = bgtokens;
+	bgtokens -= n;
+
+	return n;
+}
+
+static void
+dequeue(Fetch *f)
+{
+	Fetch **fp;
+
+	for (fp = &queue; *fp; fp = &(*fp)->qnext) {
+		if (*fp == f) {
+			*fp = f->qnext;
+			--nqueued;
+			return;
+		}
+	}
+}
+
+static void
+fetchfree(Fetch *f)
+{
+	watchdel(&f->w);
+	if (f->state == FetchQueued)
+		dequeue(f);
+	if (f->w.fd >= 0) {
+		tlsclose(f->w.fd);
+		close(f->w.fd);
+	}
+	free(f->addrs);
+	free(f->buf);
+	free(f->msg);
+	if (f->slot)
+		schedput(f->host);
+	free(f);
+}
+
+static void
+fetchend(Fetch *f, int ok)
+{
+	if (f->finished)
+		*f->finished = 1;
+
+	f->ok = ok;
+	if (f->buf)
+		f->buf[f->len] = '\0';
+	if (ok && f->buf) {
+		/* the selector, without its \r\n */
+		f->msg[f->msglen - 2] = '\0';
+		traceput(f->host->name, f->host->port, f->msg, f->buf, f->len);
+	}
+	f->done(f);
+
+	fetchfree(f);
+}
+
+static int
+fetchconnect(Fetch *f)
+{
+	int fd;
+
+	for (; f->addr; f->addr = f->addr->ai_next) {
+		if ((fd = nbconnect(f->addr)) >= 0) {
+			f->w.fd = fd;
+			f->w.events = POLLOUT;
+			f->w.deadline = expiry(connecttimeout);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* connect a fetch leaving the queue, failures show up from netwait() */
+static void
+fetchbegin(Fetch *f)
+{
+	Host *h = f->host;
+	long long t = now() - f->queued;
+
+	++nbgconns;
+	bgwait += t;
+	if (t > maxbgwait)
+		maxbgwait = t;
+
+	f->state = FetchConnect;
+	f->slot = 1;
+	if ((f->w.fd = poolget(h)) >= 0) {
+		f->w.events = POLLOUT;
+		f->w.deadline = expiry(connecttimeout);
+	} else {
+		schedtake(h);
+		if (!resolve(h->name, h->port, &f->addrs)) {
+			f->addr = f->addrs;
+			if (fetchconnect(f))
+				goto watch;
+		}
+		f->w.events = 0;
+		f->w.deadline = now();
+	}
+watch:
+	watchadd(&f->w);
+}
+
+static void
+schedtimercb(Watch *w, short revents)
+{
+	schedkick();
+}
+
+/* start the queued fetches the scheduler allows, in order */
+static void
+schedkick(void)
+{
+	Fetch **fp, *f;
+	long long t, next = 0;
+
+	for (fp = &queue; (f = *fp);) {
+		if (!poolfind(f->host) &&
+		    ((t = schedwhen(f->host, !f->background)) ||
+		     !dnsready(f->host))) {
+			if (t > 0 && (!next || t < next))
+				next = t;
+			fp = &f->qnext;
+			continue;
+		}
+		*fp = f->qnext;
+		--nqueued;
+		fetchbegin(f);
+	}
+
+	if (next) {
+		schedtimer.cb = schedtimercb;
+		schedtimer.fd = -1;
+		schedtimer.deadline = now() + next;
+		if (!schedtimer.id)
+			watchadd(&schedtimer);
+	} else if (schedtimer.id) {
+		watchdel(&schedtimer);
+	}
+}
+
+static void
+fetchrecv(Fetch *f)
+{
+	size_t want;
+	ssize_t n;
+	int r;
+
+	if (f->size - f->len < BUFSIZ) {
+		f->size = f->size ? f->size * 2 : 4 * BUFSIZ;
+		f->buf = xreallocarray(f->buf, f->size, 1);
+	}
+	want = f->size - f->len - 1;
+	if (f->background && !(want = bgbudget(want))) {
+		/* over budget, come back later */
+		f->w.events = 0;
+		f->w.deadline = now() + 100;
+		return;
+	}
+
+	if ((n = tlsread(f->w.fd, f->buf + f->len, want)) < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			fetchend(f, 0);
+		return;
+	}
+	if (f->background && n < want)
+		bgtokens += want - n;
+	if (n == 0) {
+		fetchend(f, 1);
+		return;
+	}
+	f->len += n;
+	f->w.deadline = expiry(idletimeout);
+	if (f->more && (f->passed || (f->maxsize && f->len > f->maxsize))) {
+		/* too big to keep, hand it over as it comes */
+		r = f->more(f);
+		f->passed += f->len;
+		f->len = 0;
+		if (r < 0) {
+			fetchend(f, 0);
+		} else if (!r) {
+			f->w.events = 0;
+			f->w.deadline = now() + 100;
+		}
+		return;
+	}
+	if (f->maxsize && f->len > f->maxsize)
+		fetchend(f, 0);
+}
+
+static void
+fetchcb(Watch *w, short revents)
+{
+	Fetch *f = (Fetch *)w;
+	const char *err;
+	ssize_t n;
+
+	/* without events, the deadline of the current phase passed */
+	switch (f->state) {
+	case FetchConnect:
+		if (w->fd < 0 || !revents || sockerror(w->fd)) {
+			/* the next socket may reuse the fd number */
+			watchdel(w);
+			if (w->fd >= 0)
+				close(w->fd);
+			w->fd = -1;
+			if (f->addr)
+				f->addr = f->addr->ai_next;
+			if (!fetchconnect(f)) {
+				hostfailed(f->host);
+				fetchend(f, 0);
+				return;
+			}
+			watchadd(w);
+			return;
+		}
+		hostok(f->host);
+		if (tlswanted(f->host->name, f->host->port)) {
+			f->state = FetchHandshake;
+			w->deadline = expiry(connecttimeout);
+		} else {
+			f->state = FetchSend;
+			w->deadline = expiry(firstbytetimeout);
+		}
+		/* FALLTHROUGH */
+	case FetchHandshake:
+		if (f->state == FetchHandshake) {
+			if (!revents || (n = tlsconnect(w->fd, f->host->name,
+			                                f->host->port, &err)) < 0) {
+				fetchend(f, 0);
+				return;
+			}
+			if (n > 0) {
+				w->events = n;
+				return;
+			}
+			f->state = FetchSend;
+			w->events = POLLOUT;
+			w->deadline = expiry(firstbytetimeout);
+		}
+		/* FALLTHROUGH */
+	case FetchSend:
+		if (!revents) {
+			fetchend(f, 0);
+			return;
+		}
+		if ((n = tlswrite(w->fd, f->msg + f->sent,
+		                  f->msglen - f->sent)) < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				fetchend(f, 0);
+			return;
+		}
+		if ((f->sent += n) < f->msglen)
+			return;
+		f->state = FetchRecv;
+		w->events = POLLIN;
+		return;
+	case FetchRecv:
+		if (!revents) {
+			if (w->events) {
+				fetchend(f, 0);
+				return;
+			}
+			/* back from a pause over budget */
+			w->events = POLLIN;
+			w->deadline = expiry(idletimeout);
+		}
+		fetchrecv(f);
+		return;
+	}
+}
+
+/* answer a fetch of a replay from the trace */
+static void
+replaycb(Watch *w, short revents)
+{
+	Fetch *f = (Fetch *)w;
+
+	f->msg[f->msglen - 2] = '\0';
+	f->buf = traceget(f->host->name, f->host->port, f->msg, &f->len);
+	fetchend(f, f->buf && (!f->maxsize || f->len <= f->maxsize));
+}
+
+/* queue the fetch of `selector' in the background, `done' is called
+ * with the result from netwait(); it can't fail, failures to resolve or
+ * connect reach `done' */
+Fetch *
+fetchstart(const char *host, const char *port, const char *selector,
+           size_t maxsize, void (*done)(Fetch *), void *arg)
+{
+	Fetch *f, **fp;
+	int n;
+
+	f = xcalloc(sizeof(Fetch));
+	if ((n = asprintf(&f->msg, "%s\r\n", selector)) < 0)
+		die("asprintf: %s", strerror(errno));
+	f->msglen = n;
+	f->host = hostget(host, port);
+	f->w.fd = -1;
+	f->w.cb = fetchcb;
+	f->state = FetchQueued;
+	f->queued = now();
+	f->maxsize = maxsize;
+	f->background = 1;
+	f->done = done;
+	f->arg = arg;
+
+	if (tracereplaying()) {
+		f->state = FetchSend;
+		f->w.cb = replaycb;
+		f->w.deadline = now();
+		watchadd(&f->w);
+		return f;
+	}
+
+	for (fp = &queue; *fp; fp = &(*fp)->qnext)
+		;
+	*fp = f;
+	if (++nqueued > maxqueued)
+		maxqueued = nqueued;
+
+	/* started from netwait(), never under the caller's feet */
+	schedtimer.cb = schedtimercb;
+	schedtimer.fd = -1;
+	schedtimer.deadline = now();
+	if (!schedtimer.id)
+		watchadd(&schedtimer);
+
+	return f;
+}
+
+void
+fetchcancel(Fetch *f)
+{
+	fetchfree(f);
+}
+
+/* wait for a background fetch, it is not rate limited anymore */
+void
+fetchfinish(Fetch *f)
+{
+	int finished = 0;
+
+	f->finished = &finished;
+	f->background = 0;
+	if (f->state == FetchRecv && !f->w.events) {
+		f->w.events = POLLIN;
+		f->w.deadline = expiry(idletimeout);
+	}
+	while (!finished)
+		netwait(-1, -1);
+}
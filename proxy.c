@@ -0,0 +1,774 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+#include "config.h"
+
+#define REQMAX	1024 /* longest selector accepted from a client */
+#define BACKLOG	(1024 * 1024) /* unsent bytes of a stream before pausing */
+
+typedef struct cached Cached;
+typedef struct client Client;
+typedef struct pending Pending;
+
+/* a response served from the cache, menus already rewritten */
+struct cached {
+	char *key;	/* upstream URL */
+	char *data;
+	size_t len;
+	long long fetched;
+	int users;	/* clients being sent it */
+	int dead;	/* out of the cache, freed by its last user */
+	Cached *prev, *next; /* most recently used first */
+};
+
+/* an upstream fetch and the clients waiting for it */
+struct pending {
+	char *key;
+	char type;
+	long long start;
+	int streaming;	/* too big to cache, passed on as it comes */
+	char *part;	/* unfinished last line of a streamed menu */
+	size_t partlen;
+	Client *waiting;
+	Pending *next;
+};
+
+struct client {
+	Watch w;	/* first, the watch callback gets the client */
+	char req[REQMAX];
+	size_t reqlen;
+	Cached *c;	/* response being sent */
+	char *own;	/* or one of our own */
+	const char *data;
+	size_t len, sent;
+	long long start;
+	int hit;
+	int streaming;	/* more of the response to come */
+	Pending *p;	/* fetch waited for */
+	Client *next;
+};
+
+static char *proxyhost, *proxyport;
+static char *roothost, *rootport;
+static char *rootkey;
+static Watch listener;
+static Cached *cache, *lru;
+static size_t cachebytes, ncached;
+static Pending *pendings;
+static unsigned long long nrequests, nhits, nmisses, ncoalesced, nerrors;
+static unsigned long long nrefused, nstreamed, ncut;
+static unsigned long long nservedhits, hitwait, maxhitwait;
+static unsigned long long nservedmisses, misswait, maxmisswait;
+static unsigned long long nfetched, fetchwait, maxfetchwait;
+
+static long long
+idledeadline(void)
+{
+	return (idletimeout > 0) ? now() + idletimeout : 0;
+}
+
+static void
+cachedfree(Cached *c)
+{
+	free(c->key);
+	free(c->data);
+	free(c);
+}
+
+static void
+uncache(Cached *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		cache = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	else
+		lru = c->prev;
+	cachebytes -= c->len;
+	--ncached;
+
+	if (c->users)
+		c->dead = 1;
+	else
+		cachedfree(c);
+}
+
+static void
+cachefront(Cached *c)
+{
+	if (c == cache)
+		return;
+	c->prev->next = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	else
+		lru = c->prev;
+	c->prev = NULL;
+	c->next = cache;
+	cache->prev = c;
+	cache = c;
+}
+
+static Cached *
+cachefind(const char *key)
+{
+	Cached *c;
+
+	for (c = cache; c; c = c->next) {
+		if (!strcmp(c->key, key))
+			return c;
+	}
+
+	return NULL;
+}
+
+static Cached *
+cacheadd(char *key, char *data, size_t len)
+{
+	Cached *c;
+
+	if ((c = cachefind(key)))
+		uncache(c);
+
+	c = xcalloc(sizeof(Cached));
+	c->key = xstrdup(key);
+	c->data = data;
+	c->len = len;
+	c->fetched = now();
+	if ((c->next = cache))
+		cache->prev = c;
+	else
+		lru = c;
+	cache = c;
+	cachebytes += len;
+	++ncached;
+
+	while (cachebytes > proxycache && lru != c)
+		uncache(lru);
+
+	return c;
+}
+
+static void
+clientclose(Client *cl)
+{
+	Client **cp;
+	long long t = now() - cl->start;
+
+	if (cl->data && cl->sent == cl->len) {
+		if (cl->hit) {
+			++nservedhits;
+			hitwait += t;
+			if (t > maxhitwait)
+				maxhitwait = t;
+		} else {
+			++nservedmisses;
+			misswait += t;
+			if (t > maxmisswait)
+				maxmisswait = t;
+		}
+	}
+
+	if (cl->p) {
+		for (cp = &cl->p->waiting; *cp != cl; cp = &(*cp)->next)
+			;
+		*cp = cl->next;
+	}
+	watchdel(&cl->w);
+	close(cl->w.fd);
+	if (cl->c && !--cl->c->users && cl->c->dead)
+		cachedfree(cl->c);
+	free(cl->own);
+	free(cl);
+}
+
+/* send data to the client, then hang up */
+static void
+clientsend(Client *cl, Cached *c, char *own, size_t len)
+{
+	if ((cl->c = c)) {
+		++c->users;
+		cl->data = c->data;
+		cl->len = c->len;
+	} else {
+		cl->own = own;
+		cl->data = own;
+		cl->len = len;
+	}
+	cl->w.events = POLLOUT;
+	cl->w.deadline = idledeadline();
+}
+
+/* queue more of a streamed response, compacting what was sent */
+static void
+clientappend(Client *cl, const char *buf, size_t len)
+{
+	if (cl->sent) {
+		memmove(cl->own, cl->own + cl->sent, cl->len - cl->sent);
+		cl->len -= cl->sent;
+		cl->sent = 0;
+	}
+	cl->own = xreallocarray(cl->own, cl->len + len + 1, 1);
+	memcpy(cl->own + cl->len, buf, len);
+	cl->data = cl->own;
+	cl->len += len;
+	cl->w.events = POLLOUT;
+	cl->w.deadline = idledeadline();
+}
+
+/* an error item ending a menu */
+static char *
+errorline(const char *fmt, const char *arg, size_t *len)
+{
+	char *own;
+	int n;
+
+	if ((n = asprintf(&own, "3%s%s\tErr\tErr\t0\r\n.\r\n", fmt, arg)) < 0)
+		die("asprintf: %s", strerror(errno));
+	*len = n;
+
+	return own;
+}
+
+static void
+clienterror(Client *cl, const char *fmt, const char *arg)
+{
+	char *own;
+	size_t len;
+
+	own = errorline(fmt, arg, &len);
+	clientsend(cl, NULL, own, len);
+}
+
+static int
+same(const char *s, size_t n, const char *t)
+{
+	return n == strlen(t) && !strncmp(s, t, n);
+}
+
+/* whether the proxy fetches from host:port: the one of the root or
+ * one of proxyhosts */
+static int
+allowed(const char *host, size_t hostlen, const char *port, size_t portlen)
+{
+	const char *h, *p;
+	size_t i, n;
+
+	if (same(host, hostlen, roothost) && same(port, portlen, rootport))
+		return 1;
+	for (i = 0; proxyhosts[i]; ++i) {
+		h = proxyhosts[i];
+		if (!(p = strrchr(h, ':')))
+			continue;
+		n = p - h;
+		if (*h == '[' && n > 1 && p[-1] == ']') {
+			++h;
+			n -= 2;
+		}
+		if (n == hostlen && !strncmp(h, host, n) &&
+		    same(port, portlen, p + 1))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* menu links go back through the proxy, as the URL of their target,
+ * but the ones to hosts it doesn't fetch from; the n bytes at p are a
+ * line ending with its newline or the NUL-terminated last one */
+static void
+rewriteline(FILE *fp, const char *p, size_t n)
+{
+	const char *nl = p + n, *f[4];
+	size_t i;
+
+	if (!strncmp(p, ".\r\n", n) || !strncmp(p, ".\n", n) ||
+	    strchr("i38T", *p)) {
+		fwrite(p, 1, n, fp);
+		return;
+	}
+
+	f[0] = p;
+	for (i = 1; i < 4; ++i) {
+		if (!(f[i] = memchr(f[i-1], '\t', nl - f[i-1])))
+			break;
+		++f[i];
+	}
+	if (i < 4 || (*p == 'h' && !strncmp(f[1], "URL:", 4)) ||
+	    !allowed(f[2], f[3] - f[2] - 1,
+	             f[3], strcspn(f[3], "\t\r\n"))) {
+		fwrite(p, 1, n, fp);
+		return;
+	}
+
+	/* type and name, target URL, proxy and the rest */
+	fwrite(p, 1, f[1] - p, fp);
+	fprintf(fp, memchr(f[2], ':', f[3] - f[2]) ?
+	        "gopher://[%.*s]:%.*s/%c%.*s" :
+	        "gopher://%.*s:%.*s/%c%.*s",
+	        (int)(f[3] - f[2] - 1), f[2],
+	        (int)strcspn(f[3], "\t\r\n"), f[3],
+	        *p, (int)(f[2] - f[1] - 1), f[1]);
+	fprintf(fp, "\t%s\t%s", proxyhost, proxyport);
+	p = f[3] + strcspn(f[3], "\t\r\n");
+	fwrite(p, 1, nl - p, fp);
+}
+
+static char *
+rewritemenu(const char *raw, size_t *len)
+{
+	FILE *fp;
+	const char *p, *nl;
+	char *out = NULL;
+
+	if (!(fp = open_memstream(&out, len)))
+		die("open_memstream: %s", strerror(errno));
+	for (p = raw; *p; p = nl) {
+		if (!(nl = strchr(p, '\n')))
+			nl = p + strlen(p);
+		else
+			++nl;
+		rewriteline(fp, p, nl - p);
+	}
+	fclose(fp);
+
+	return out;
+}
+
+/* rewrite the lines of a streamed menu completed by the n bytes of buf,
+ * keeping the unfinished last one for later unless this is the end */
+static char *
+rewritepart(Pending *p, const char *buf, size_t n, int end, size_t *len)
+{
+	FILE *fp;
+	const char *s, *nl, *e;
+	char *out = NULL;
+
+	p->part = xreallocarray(p->part, p->partlen + n + 1, 1);
+	memcpy(p->part + p->partlen, buf, n);
+	p->partlen += n;
+	p->part[p->partlen] = '\0';
+	e = p->part + p->partlen;
+
+	if (!(fp = open_memstream(&out, len)))
+		die("open_memstream: %s", strerror(errno));
+	for (s = p->part; (nl = memchr(s, '\n', e - s)); s = nl + 1)
+		rewriteline(fp, s, nl + 1 - s);
+	if (end && s < e)
+		rewriteline(fp, s, e - s);
+	fclose(fp);
+	p->partlen = end ? 0 : e - s;
+	memmove(p->part, s, p->partlen);
+
+	return out;
+}
+
+static void
+unpend(Pending *p)
+{
+	Pending **pp;
+
+	for (pp = &pendings; *pp != p; pp = &(*pp)->next)
+		;
+	*pp = p->next;
+}
+
+/* pass on a response too big for the cache as it comes, menus line
+ * by line, the clients asking for it later fetch it again */
+static int
+stream(Fetch *f)
+{
+	Pending *p = f->arg;
+	Client *cl;
+	char *data = f->buf;
+	size_t len = f->len;
+	int behind = 0;
+
+	if (!p->streaming) {
+		p->streaming = 1;
+		++nstreamed;
+		unpend(p);
+	}
+	if (!p->waiting)
+		return -1;
+	if (p->type == '1' || p->type == '7')
+		data = rewritepart(p, f->buf, f->len, 0, &len);
+	for (cl = p->waiting; cl; cl = cl->next) {
+		cl->streaming = 1;
+		if (len)
+			clientappend(cl, data, len);
+		if (cl->len - cl->sent > BACKLOG)
+			behind = 1;
+	}
+	if (data != f->buf)
+		free(data);
+
+	return !behind;
+}
+
+static void
+fetched(Fetch *f)
+{
+	Pending *p = f->arg;
+	Client *cl, *next;
+	Cached *c = NULL;
+	char *data;
+	long long t = now() - p->start;
+	size_t len;
+	int menu = p->type == '1' || p->type == '7';
+
+	if (!p->streaming)
+		unpend(p);
+
+	++nfetched;
+	fetchwait += t;
+	if (t > maxfetchwait)
+		maxfetchwait = t;
+
+	if (p->streaming) {
+		data = f->buf;
+		len = f->ok ? f->len : 0;
+		if (!f->ok)
+			++nerrors;
+		if (!f->ok && p->waiting) {
+			/* menus end with an error item, the rest is cut */
+			++ncut;
+			fprintf(stderr, "Couldn't fetch the rest of %s\n",
+			        p->key);
+			if (menu)
+				data = errorline("Couldn't fetch the rest of ",
+				                 p->key, &len);
+		} else if (f->ok && menu) {
+			data = rewritepart(p, f->buf, f->len, 1, &len);
+		}
+		/* the clients hang up once sent what came */
+		for (cl = p->waiting; cl; cl = next) {
+			next = cl->next;
+			cl->p = NULL;
+			cl->streaming = 0;
+			if (len)
+				clientappend(cl, data, len);
+			else if (cl->sent == cl->len)
+				clientclose(cl);
+		}
+		if (data != f->buf)
+			free(data);
+		free(p->part);
+		free(p->key);
+		free(p);
+		return;
+	}
+
+	if (f->ok && f->len) {
+		if (menu) {
+			data = rewritemenu(f->buf, &len);
+		} else {
+			data = f->buf;
+			len = f->len;
+			f->buf = NULL;
+		}
+		c = cacheadd(p->key, data, len);
+	} else {
+		++nerrors;
+	}
+
+	for (cl = p->waiting; cl; cl = next) {
+		next = cl->next;
+		cl->p = NULL;
+		if (c)
+			clientsend(cl, c, NULL, 0);
+		else
+			clienterror(cl, "Couldn't fetch ", p->key);
+	}
+	free(p->key);
+	free(p);
+}
+
+/* split gopher://host[:port]/Tselector in place */
+static int
+parsekey(char *url, char **host, char **port, char *type, char **sel)
+{
+	char *p;
+
+	if (strncmp(url, "gopher://", 9))
+		return 0;
+	*host = url + 9;
+	*port = "70";
+	if (**host == '[') {
+		if (!(p = strchr(++*host, ']')))
+			return 0;
+		*p++ = '\0';
+	} else {
+		p = *host + strcspn(*host, ":/");
+	}
+	if (*p == ':') {
+		*p++ = '\0';
+		*port = p;
+		p += strcspn(p, "/");
+	}
+	if (*p != '/' || !p[1])
+		return 0;
+	*p++ = '\0';
+	*type = *p++;
+	*sel = p;
+
+	return **host && **port;
+}
+
+static void
+proxystats(Client *cl)
+{
+	FILE *fp;
+	char *out = NULL;
+	size_t len;
+
+	if (!(fp = open_memstream(&out, &len)))
+		die("open_memstream: %s", strerror(errno));
+	fprintf(fp, "sacc proxy on %s:%s for %s\n\n",
+	        proxyhost, proxyport, rootkey);
+	fprintf(fp, "requests: %llu, %llu hits, %llu misses, "
+	        "%llu coalesced, %llu failed, %llu refused\n",
+	        nrequests, nhits, nmisses, ncoalesced, nerrors, nrefused);
+	fprintf(fp, "streamed uncached: %llu, %llu cut short\n",
+	        nstreamed, ncut);
+	fprintf(fp, "cache: %zu items, %zu bytes\n", ncached, cachebytes);
+	fprintf(fp, "hits served: %llu, %llu ms on average "
+	        "(%llu ms at most)\n", nservedhits,
+	        nservedhits ? hitwait / nservedhits : 0, maxhitwait);
+	fprintf(fp, "misses served: %llu, %llu ms on average "
+	        "(%llu ms at most)\n", nservedmisses,
+	        nservedmisses ? misswait / nservedmisses : 0, maxmisswait);
+	fprintf(fp, "upstream fetches: %llu, %llu ms on average "
+	        "(%llu ms at most)\n", nfetched,
+	        nfetched ? fetchwait / nfetched : 0, maxfetchwait);
+	netstats(fp);
+	fclose(fp);
+
+	clientsend(cl, NULL, out, len);
+}
+
+static void
+serve(Client *cl, const char *sel)
+{
+	Pending *p;
+	Cached *c;
+	Fetch *f;
+	char *key, *host, *port, *upsel, type;
+
+	++nrequests;
+	key = *sel ? (char *)sel : rootkey;
+
+	if (!strcmp(sel, "stats")) {
+		proxystats(cl);
+		return;
+	}
+	if ((c = cachefind(key))) {
+		if (now() - c->fetched < proxyttl * 1000LL) {
+			++nhits;
+			cl->hit = 1;
+			cachefront(c);
+			clientsend(cl, c, NULL, 0);
+			return;
+		}
+		uncache(c);
+	}
+	for (p = pendings; p; p = p->next) {
+		if (!strcmp(p->key, key)) {
+			++ncoalesced;
+			cl->p = p;
+			cl->next = p->waiting;
+			p->waiting = cl;
+			return;
+		}
+	}
+
+	key = xstrdup(key);
+	if (!parsekey(key, &host, &port, &type, &upsel)) {
+		clienterror(cl, "Not a proxied selector: ", sel);
+		free(key);
+		return;
+	}
+	if (!allowed(host, strlen(host), port, strlen(port))) {
+		++nrefused;
+		clienterror(cl, "Not a proxied host: ", sel);
+		free(key);
+		return;
+	}
+
+	++nmisses;
+	p = xcalloc(sizeof(Pending));
+	p->key = xstrdup(*sel ? sel : rootkey);
+	p->type = type;
+	p->start = now();
+	p->waiting = cl;
+	p->next = pendings;
+	pendings = p;
+	cl->p = p;
+
+	f = fetchstart(host, port, upsel, proxysize, fetched, p);
+	f->more = stream;
+	f->background = 0;
+	free(key);
+}
+
+static void
+clientcb(Watch *w, short revents)
+{
+	Client *cl = (Client *)w;
+	char *nl;
+	ssize_t n;
+
+	if (!revents) {
+		clientclose(cl);
+		return;
+	}
+
+	if (w->events & POLLOUT) {
+		n = send(w->fd, cl->data + cl->sent, cl->len - cl->sent,
+		         MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (n < 0) {
+			clientclose(cl);
+		} else if ((cl->sent += n) < cl->len) {
+			w->deadline = idledeadline();
+		} else if (cl->streaming) {
+			/* wait for more of the response */
+			w->events = 0;
+			w->deadline = 0;
+		} else {
+			clientclose(cl);
+		}
+		return;
+	}
+
+	n = read(w->fd, cl->req + cl->reqlen, sizeof(cl->req)-1 - cl->reqlen);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		clientclose(cl);
+		return;
+	}
+	cl->reqlen += n;
+	cl->req[cl->reqlen] = '\0';
+	if (!(nl = strchr(cl->req, '\n'))) {
+		if (cl->reqlen == sizeof(cl->req)-1)
+			clientclose(cl);
+		return;
+	}
+	if (nl > cl->req && nl[-1] == '\r')
+		--nl;
+	*nl = '\0';
+
+	/* wait for the response without listening to the client */
+	w->events = 0;
+	w->deadline = 0;
+	serve(cl, cl->req);
+}
+
+static void
+acceptcb(Watch *w, short revents)
+{
+	Client *cl;
+	int fd;
+
+	while ((fd = accept(w->fd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		cl = xcalloc(sizeof(Client));
+		cl->w.fd = fd;
+		cl->w.events = POLLIN;
+		cl->w.deadline = idledeadline();
+		cl->w.cb = clientcb;
+		cl->start = now();
+		watchadd(&cl->w);
+	}
+}
+
+static int
+listento(const char *host, const char *port)
+{
+	struct addrinfo hints, *addrs, *addr;
+	int fd = -1, r, on = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	/* only local clients unless told otherwise */
+	if (!host)
+		host = "127.0.0.1";
+	if ((r = getaddrinfo(host, port, &hints, &addrs)))
+		die("Can't resolve %s: %s", host, gai_strerror(r));
+
+	for (addr = addrs; addr; addr = addr->ai_next) {
+		if ((fd = socket(addr->ai_family, addr->ai_socktype,
+		                 addr->ai_protocol)) < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 &&
+		    listen(fd, 64) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0)
+		die("Can't listen on %s:%s: %s", host, port, strerror(errno));
+	freeaddrinfo(addrs);
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	return fd;
+}
+
+/* serve gopher clients on [host:]port from a cache of root and the
+ * items it links to */
+void
+proxy(char *addr, Item *root)
+{
+	char *p;
+
+	if ((p = strrchr(addr, ':'))) {
+		*p = '\0';
+		proxyhost = addr;
+		proxyport = p+1;
+		if (*proxyhost == '[' && p[-1] == ']') {
+			++proxyhost;
+			p[-1] = '\0';
+		}
+	} else {
+		proxyhost = NULL;
+		proxyport = addr;
+	}
+
+	listener.fd = listento(proxyhost, proxyport);
+	listener.events = POLLIN;
+	listener.cb = acceptcb;
+	watchadd(&listener);
+	if (!proxyhost)
+		proxyhost = "localhost";
+
+	roothost = root->host;
+	rootport = root->port;
+	if (asprintf(&rootkey, strchr(root->host, ':') ?
+	             "gopher://[%s]:%s/%c%s" : "gopher://%s:%s/%c%s",
+	             root->host, root->port, root->type,
+	             root->tag ? root->tag : root->selector) < 0)
+		die("asprintf: %s", strerror(errno));
+
+	for (;;)
+		netwait(-1, -1);
+}
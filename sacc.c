@@ -1,18 +1,24 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <locale.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <wchar.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -22,11 +28,103 @@
 
 #include "config.h"
 
+#define LAZYCHUNK	4096 /* items materialized at once in lazy dirs */
+#define RETRYDELAY	500 /* ms before retrying a failed fetch, doubling */
+#define FIFOWAIT	5000 /* ms the plumber gets to open a FIFO */
+#define PLUSMAX	(4 * 1024 * 1024) /* largest Gopher+ attributes listing */
+
+typedef struct map Map;
+typedef struct searched Searched;
+
+/* Gopher+ attributes of a menu line, from its first view */
+struct plus {
+	size_t size;	/* approximate, 0 when unknown */
+	char mime[32];
+};
+
+struct map {
+	char *addr;
+	size_t len;
+	char *path; /* spill file, NULL for a snapshot or a local file */
+	int shared; /* holds the raws of several items */
+	Map *next;
+};
+
+/* results of an earlier query of a search item, set aside */
+struct searched {
+	Item *item;
+	Item result;	/* its tag, raw and dat */
+	Searched *next;	/* most recently used first */
+};
+
+#define SNAPMAGIC	"SACCSNAP"
+#define SNAPVERSION	1
+#define SNAPNONE	((uint64_t)-1)
+
+/* Snapshot layout: a header, a table of nodes, then a data area holding
+ * the NUL-terminated strings and bodies the nodes point into. Nodes are
+ * stored parents first, the first one being the main entry. */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t nnodes;
+	uint32_t current;	/* node of the page shown at exit */
+	uint32_t pad;
+	uint64_t url;		/* main entry url */
+	uint64_t size;		/* size of the whole snapshot */
+} Snaphdr;
+
+typedef struct {
+	uint32_t parent;	/* node of the menu holding the item */
+	uint32_t entry;		/* node of item->entry */
+	uint64_t slot;		/* position in the parent menu */
+	uint64_t raw;
+	uint64_t tag;
+	uint64_t curline;
+	uint64_t printoff;
+	uint8_t isdir;
+	uint8_t pad[7];
+} Snapnode;
+
+typedef struct {
+	Item *item;
+	uint32_t parent;
+	size_t slot;
+} Snapitem;
+
+extern char **environ;
+
 static char *mainurl;
 static Item *mainentry;
 static int devnullfd;
-static int parent = 1;
 static int interactive;
+static Item searchresults;
+static Item statsitem;
+static Item *curpage;
+static Map *maps;
+static char *snapfile;
+static Fetch **prefetches;
+static Fetch *refetch;
+static Searched *searched;
+static Item *liveitem;	/* search item being typed into */
+static char *livepexp;	/* its former query expression */
+static char *livetag;	/* its query once typing pauses */
+static Fetch *livefetch;
+static Watch livetimer;
+static pid_t *plumbers;
+static size_t nplumbers;
+static unsigned long long ndemand, demandbytes;
+static unsigned long long nprefetch, prefetchbytes, nprefetchused;
+static unsigned long long nraces, nmirrorwins;
+static unsigned long long nretries;
+static unsigned long long nsearchhits, nlivequeries, nlivestale;
+static double demandrate;	/* bytes per ms of demand transfers */
+static char lastdiag[BUFSIZ];
+static int transient;
+static char filehost[] = "";	/* host of the local tree opened */
+static char *localtop;	/* the file or directory opened */
+static size_t toplen;	/* length of the top directory in localtop */
+static unsigned long long nlocalmaps, nlocallists, localbytes;
 
 static void (*diag)(char *fmt, ...);
 
@@ -41,6 +139,22 @@ stddiag(char *fmt, ...)
 	fputc('\n', stderr);
 }
 
+static void
+quietdiag(char *fmt, ...)
+{
+}
+
+/* keep the message for later, while a fetch may still be retried */
+static void
+keepdiag(char *fmt, ...)
+{
+	va_list arg;
+
+	va_start(arg, fmt);
+	vsnprintf(lastdiag, sizeof(lastdiag), fmt, arg);
+	va_end(arg);
+}
+
 void
 die(const char *fmt, ...)
 {
@@ -135,7 +249,7 @@ mbsprint(const char *s, size_t len)
 	return col;
 }
 
-static void *
+void *
 xreallocarray(void *m, const size_t n, const size_t s)
 {
 	void *nm;
@@ -152,7 +266,7 @@ xreallocarray(void *m, const size_t n, const size_t s)
 	return nm;
 }
 
-static void *
+void *
 xmalloc(const size_t n)
 {
 	void *m = malloc(n);
@@ -163,7 +277,7 @@ xmalloc(const size_t n)
 	return m;
 }
 
-static void *
+void *
 xcalloc(size_t n)
 {
 	char *m = calloc(1, n);
@@ -174,7 +288,7 @@ xcalloc(size_t n)
 	return m;
 }
 
-static char *
+char *
 xstrdup(const char *str)
 {
 	char *s;
@@ -185,37 +299,163 @@ xstrdup(const char *str)
 	return s;
 }
 
+/* path relative to $HOME unless absolute, NULL without a $HOME */
+char *
+homepath(const char *path)
+{
+	const char *home;
+	char *p;
+
+	if (*path == '/')
+		return xstrdup(path);
+	if (!(home = getenv("HOME")))
+		return NULL;
+	if (asprintf(&p, "%s/%s", home, path) < 0)
+		die("asprintf: %s", strerror(errno));
+
+	return p;
+}
+
 static void
 usage(void)
 {
-	die("usage: sacc URL");
+	die("usage: sacc [-p [host:]port] [-r snapshot] [-w snapshot] "
+	    "[-t trace] [-f query | -T trace | URL]");
+}
+
+static Fetch **
+prefetching(Item *item)
+{
+	int i;
+
+	for (i = 0; i < prefetchmax; ++i) {
+		if (prefetches[i] && prefetches[i]->arg == item)
+			return &prefetches[i];
+	}
+
+	return NULL;
+}
+
+/* wait for or cancel a pending prefetch of item, a transfer that
+ * hasn't connected yet isn't worth waiting for */
+static void
+prefetchcancel(Item *item, int wait)
+{
+	Fetch **fp;
+
+	if (!prefetches || !(fp = prefetching(item)))
+		return;
+	if (wait && (*fp)->state >= FetchHandshake) {
+		fetchfinish(*fp);
+	} else {
+		fetchcancel(*fp);
+		*fp = NULL;
+	}
+}
+
+static void
+freeraw(Item *item)
+{
+	Map **mp, *m;
+
+	for (mp = &maps; (m = *mp); mp = &m->next) {
+		if (m->shared && item->raw >= m->addr &&
+		    item->raw < m->addr + m->len) {
+			item->raw = NULL;
+			return;
+		}
+		if (m->addr != item->raw)
+			continue;
+		munmap(m->addr, m->len);
+		if (m->path) {
+			unlink(m->path);
+			free(m->path);
+		}
+		*mp = m->next;
+		free(m);
+		item->raw = NULL;
+		return;
+	}
+
+	clear(&item->raw);
+}
+
+static void
+freedir(Dir *dir)
+{
+	if (dir->plusfetch)
+		fetchcancel(dir->plusfetch);
+	free(dir->plus);
+	if (dir->linestart) {
+		munmap(dir->items, dir->nitems * sizeof(Item));
+		free(dir->linestart);
+		free(dir->parsed);
+		free(dir->chunks);
+	} else {
+		free(dir->items);
+	}
+	free(dir);
+}
+
+/* forget the raw of item in the session index and its results */
+static void
+unindex(Item *item)
+{
+	Dir *dir;
+	size_t i;
+
+	idxdrop(item);
+	if ((dir = searchresults.dat)) {
+		for (i = 0; i < dir->nitems; ++i) {
+			if (dir->items[i].link == item)
+				dir->items[i].link = NULL;
+		}
+	}
 }
 
 static void
 clearitem(Item *item)
 {
+	Searched **sp, *s;
 	Dir *dir;
-	Item *items;
 	char *tag;
 	size_t i;
 
 	if (!item)
 		return;
 
+	prefetchcancel(item, 0);
+	item->flags = 0;
+
+	if (item->raw)
+		unindex(item);
+
+	for (sp = &searched; (s = *sp);) {
+		if (s->item != item) {
+			sp = &s->next;
+			continue;
+		}
+		*sp = s->next;
+		clearitem(&s->result);
+		free(s);
+	}
+
 	if (dir = item->dat) {
-		items = dir->items;
-		for (i = 0; i < dir->nitems; ++i)
-			clearitem(&items[i]);
-		free(items);
-		clear(&item->dat);
+		for (i = 0; i < dir->nitems; ++i) {
+			if (dir->linestart && !dir->chunks[i / LAZYCHUNK])
+				i += LAZYCHUNK-1;
+			else
+				clearitem(&dir->items[i]);
+		}
+		freedir(dir);
+		item->dat = NULL;
 	}
 
-	if (parent && (tag = item->tag) &&
-	    !strncmp(tag, tmpdir, strlen(tmpdir)))
+	if ((tag = item->tag) && !strncmp(tag, tmpdir, strlen(tmpdir)))
 		unlink(tag);
 
 	clear(&item->tag);
-	clear(&item->raw);
+	freeraw(item);
 }
 
 const char *
@@ -267,42 +507,112 @@ static void
 printdir(Item *item)
 {
 	Dir *dir;
-	Item *items;
+	Item *it;
 	size_t i, nitems;
 
 	if (!item || !(dir = item->dat))
 		return;
 
-	items = dir->items;
 	nitems = dir->nitems;
 
 	for (i = 0; i < nitems; ++i) {
-		printf("%s%s\n",
-		       typedisplay(items[i].type), items[i].username);
+		it = diritem(dir, i);
+		printf("%s%s\n", typedisplay(it->type), it->username);
+	}
+}
+
+static int
+writeall(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	for (; len; len -= n, buf += n) {
+		if ((n = write(fd, buf, len)) < 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* spawn argv[0], looked up in PATH, with its standard input on fd in
+ * and its standard and error outputs on fd out (-1 to keep them) */
+static pid_t
+spawn(char *const argv[], int in, int out)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t set;
+	pid_t pid;
+	int err;
+
+	posix_spawn_file_actions_init(&fa);
+	if (in >= 0)
+		posix_spawn_file_actions_adddup2(&fa, in, 0);
+	if (out >= 0) {
+		posix_spawn_file_actions_adddup2(&fa, out, 1);
+		posix_spawn_file_actions_adddup2(&fa, out, 2);
+	}
+
+	posix_spawnattr_init(&attr);
+	sigemptyset(&set);
+	posix_spawnattr_setsigmask(&attr, &set);
+	sigaddset(&set, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &set);
+	posix_spawnattr_setflags(&attr,
+	                         POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF);
+
+	err = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (err) {
+		errno = err;
+		return -1;
 	}
+
+	return pid;
 }
 
 static void
 displaytextitem(Item *item)
 {
-	FILE *pagerin;
-	int pid, wpid;
+	char *argv[] = { "sh", "-c", "exec $PAGER", NULL };
+	struct sigaction sa, osa;
+	pid_t pid;
+	int fds[2];
+
+	if (uiviewtext(item))
+		return;
 
 	uicleanup();
-	switch (pid = fork()) {
-	case -1:
-		diag("Couldn't fork.");
+	if (pipe(fds) < 0) {
+		uisetup();
+		diag("Can't create pipe: %s", strerror(errno));
+		return;
+	}
+	/* the pager only gets the reading end, as its standard input */
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	pid = spawn(argv, fds[0], -1);
+	close(fds[0]);
+	if (pid < 0) {
+		close(fds[1]);
+		uisetup();
+		diag("Can't run $PAGER: %s", strerror(errno));
 		return;
-	case 0:
-		parent = 0;
-		if (!(pagerin = popen("$PAGER", "we")))
-			_exit(1);
-		fputs(item->raw, pagerin);
-		exit(pclose(pagerin));
-	default:
-		while ((wpid = wait(NULL)) >= 0 && wpid != pid)
-			;
 	}
+
+	/* the pager may quit before reading everything */
+	sa.sa_handler = SIG_IGN;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPIPE, &sa, &osa);
+	writeall(fds[1], item->raw, strlen(item->raw));
+	close(fds[1]);
+	sigaction(SIGPIPE, &osa, NULL);
+
+	waitpid(pid, NULL, 0);
 	uisetup();
 }
 
@@ -360,11 +670,212 @@ molditem(Item *item, char **raw)
 	item->selector = pickfield(raw, "\t");
 	item->host = pickfield(raw, "\t");
 	item->port = pickfield(raw, "\t\r");
+	if (*raw[0] == '+' || *raw[0] == '?')
+		item->flags |= ITEMPLUS;
 	while (*raw[0] != '\n')
 		++*raw;
 	*raw[0]++ = '\0';
 }
 
+/* type of line n of a lazy dir, without parsing it */
+static char
+linetype(Dir *dir, size_t n)
+{
+	char *p = dir->linestart[n];
+	int tabs;
+
+	switch (dir->parsed[n]) {
+	case 1:
+		return *p;
+	case 2:
+		return 0;
+	}
+	for (tabs = 0; *p && *p != '\n'; ++p) {
+		if (*p == '\t')
+			++tabs;
+	}
+
+	return (tabs < 3) ? 0 : *dir->linestart[n];
+}
+
+static void
+dropchunk(Dir *dir, size_t c)
+{
+	size_t pg = sysconf(_SC_PAGESIZE), n = c * LAZYCHUNK;
+	char *start, *end, *a, *b;
+
+	start = (char *)&dir->items[n];
+	n = (dir->nitems - n < LAZYCHUNK) ? dir->nitems : n + LAZYCHUNK;
+	end = (char *)&dir->items[n];
+	a = (char *)(((uintptr_t)start + pg-1) & ~(uintptr_t)(pg-1));
+	b = (char *)((uintptr_t)end & ~(uintptr_t)(pg-1));
+
+	/* give whole pages back to the system, zero the edges */
+	if (a < b) {
+		memset(start, 0, a - start);
+		memset(b, 0, end - b);
+		if (mmap(a, b - a, PROT_READ|PROT_WRITE,
+		         MAP_PRIVATE|MAP_ANON|MAP_FIXED, -1, 0) == MAP_FAILED)
+			die("mmap: %s", strerror(errno));
+	} else {
+		memset(start, 0, end - start);
+	}
+	dir->chunks[c] = 0;
+	--dir->nresident;
+}
+
+static int
+droppable(Dir *dir, size_t c)
+{
+	Item *item;
+	size_t i, n = c * LAZYCHUNK;
+
+	for (i = n; i < dir->nitems && i < n + LAZYCHUNK; ++i) {
+		item = &dir->items[i];
+		if (item->raw || item->dat || item->tag || item->entry ||
+		    item->link)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* drop the chunk farthest from the cursor, if there are too many */
+static void
+trimdir(Dir *dir, size_t keep)
+{
+	size_t c, cur = dir->curline / LAZYCHUNK, far = 0, best = 0, d;
+
+	if (dir->nresident <= lazychunks)
+		return;
+
+	for (c = 0; c * LAZYCHUNK < dir->nitems; ++c) {
+		if (!dir->chunks[c] || c == keep)
+			continue;
+		d = (c > cur) ? c - cur : cur - c;
+		if (d > 1 && d > best && droppable(dir, c)) {
+			best = d;
+			far = c;
+		}
+	}
+	if (best)
+		dropchunk(dir, far);
+}
+
+Item *
+diritem(Dir *dir, size_t i)
+{
+	Item *item = &dir->items[i];
+	char *p;
+	size_t n;
+
+	if (!dir->linestart || item->username)
+		return item;
+
+	if (!dir->chunks[n = i / LAZYCHUNK]) {
+		dir->chunks[n] = 1;
+		++dir->nresident;
+		trimdir(dir, n);
+	}
+
+	p = dir->linestart[i];
+	switch (dir->parsed[i]) {
+	case 0:
+		molditem(item, &p);
+		dir->parsed[i] = item->type ? 1 : 2;
+		break;
+	case 1: /* already split in place, fields are consecutive */
+		item->type = *p++;
+		item->username = p;
+		item->selector = p += strlen(p) + 1;
+		item->host = p += strlen(p) + 1;
+		item->port = p += strlen(p) + 1;
+		break;
+	case 2:
+		item->username = p;
+		break;
+	}
+
+	if (item->type == '+') {
+		for (n = i - 1; n < (size_t)-1; --n) {
+			if (linetype(dir, n) != '+') {
+				item->redtype = linetype(dir, n);
+				break;
+			}
+		}
+	}
+
+	return item;
+}
+
+/* the text shown for line i of dir and its length, read from the raw
+ * line of a lazy dir rather than parsing it */
+const char *
+dirtext(Dir *dir, size_t i, size_t *len)
+{
+	Item *item = &dir->items[i];
+	char *p, *e;
+
+	if (!dir->linestart || item->username) {
+		*len = item->username ? strlen(item->username) : 0;
+		return item->username;
+	}
+
+	p = dir->linestart[i];
+	switch (dir->parsed[i]) {
+	case 1:
+		++p;
+		/* FALLTHROUGH */
+	case 2:
+		*len = strlen(p);
+		return p;
+	}
+	if (linetype(dir, i))
+		e = strchr(++p, '\t');
+	else
+		e = strchr(p, '\n');
+	*len = e - p;
+
+	return p;
+}
+
+/* only index the lines, items are parsed when first looked at */
+static Dir *
+moldlazydir(char *raw, size_t nitems)
+{
+	Dir *dir;
+	size_t i;
+
+	dir = xcalloc(sizeof(Dir));
+	dir->linestart = xreallocarray(NULL, nitems, sizeof(char *));
+	for (i = 0; i < nitems; ++i) {
+		dir->linestart[i] = raw;
+		raw = strchr(raw, '\n') + 1;
+	}
+	dir->parsed = xcalloc(nitems);
+	dir->chunks = xcalloc(nitems / LAZYCHUNK + 1);
+
+	dir->items = mmap(NULL, nitems * sizeof(Item), PROT_READ|PROT_WRITE,
+	                  MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (dir->items == MAP_FAILED)
+		die("mmap: %s", strerror(errno));
+	dir->nitems = nitems;
+
+	return dir;
+}
+
+/* a hash of a raw menu, to tell whether a refetch changed it */
+static unsigned long long
+rawsum(const char *raw)
+{
+	unsigned long long h = 14695981039346656037ULL;
+
+	for (; *raw; ++raw)
+		h = (h ^ (unsigned char)*raw) * 1099511628211ULL;
+
+	return h;
+}
+
 static Dir *
 molddiritem(char *raw)
 {
@@ -372,6 +883,7 @@ molddiritem(char *raw)
 	char *s, *nl, *p;
 	Dir *dir;
 	size_t i, n, nitems;
+	unsigned long long sum;
 
 	for (s = nl = raw, nitems = 0; p = strchr(nl, '\n'); ++nitems) {
 		s = nl;
@@ -383,8 +895,14 @@ molddiritem(char *raw)
 		diag("Couldn't parse dir item");
 		return NULL;
 	}
+	sum = rawsum(raw);
+	if (lazylines && nitems > lazylines) {
+		dir = moldlazydir(raw, nitems);
+		dir->sum = sum;
+		return dir;
+	}
 
-	dir = xmalloc(sizeof(Dir));
+	dir = xcalloc(sizeof(Dir));
 	items = xreallocarray(items, nitems, sizeof(Item));
 	memset(items, 0, nitems * sizeof(Item));
 
@@ -404,12 +922,147 @@ molddiritem(char *raw)
 	dir->items = items;
 	dir->nitems = nitems;
 	dir->printoff = dir->curline = 0;
+	dir->sum = sum;
 
 	return dir;
 }
 
+/* Gopher+ attributes of an item, if its menu has them */
+static Plus *
+itemplus(Item *item)
+{
+	Item *entry = item->entry ? item->entry : curpage;
+	Dir *dir;
+
+	if (!entry || !(dir = entry->dat) || !dir->plus ||
+	    item < dir->items || item >= dir->items + dir->nitems)
+		return NULL;
+
+	return &dir->plus[item - dir->items];
+}
+
+/* keep track of the transfer rate, for download time estimates */
+static void
+measurerate(size_t bytes, long long start)
+{
+	long long t = now() - start;
+	double r;
+
+	if (bytes < BUFSIZ || t <= 0)
+		return;
+	r = (double)bytes / t;
+	demandrate = demandrate ? (3 * demandrate + r) / 4 : r;
+}
+
+/* type, size and estimated download time of an item, from its Gopher+
+ * attributes */
+const char *
+plusdescribe(Item *item)
+{
+	static char buf[96];
+	Plus *p;
+	size_t n;
+	long long eta;
+
+	if (!(p = itemplus(item)) || (!p->size && !p->mime[0]))
+		return NULL;
+
+	n = snprintf(buf, sizeof(buf), "%s%s", p->mime,
+	             p->mime[0] && p->size ? ", " : "");
+	if (!p->size)
+		return buf;
+	if (p->size < 1024)
+		n += snprintf(buf+n, sizeof(buf)-n, "%zu B", p->size);
+	else if (p->size < 1024 * 1024)
+		n += snprintf(buf+n, sizeof(buf)-n, "%.1f KB",
+		              p->size / 1024.0);
+	else
+		n += snprintf(buf+n, sizeof(buf)-n, "%.1f MB",
+		              p->size / (1024.0 * 1024));
+	if (demandrate > 0) {
+		eta = p->size / demandrate / 1000 + 1;
+		snprintf(buf+n, sizeof(buf)-n, ", ~%lld s", eta);
+	}
+
+	return buf;
+}
+
+static void
+readfailed(int answered)
+{
+	if (errno == ETIMEDOUT && answered)
+		diag("Server stalled for %d ms", idletimeout);
+	else if (errno == ETIMEDOUT)
+		diag("Server didn't answer in %d ms", firstbytetimeout);
+	else
+		diag("Can't read socket: %s", strerror(errno));
+	transient = 1;
+}
+
+/* stream the rest of a response to a file in tmpdir and map it */
+static char *
+spillrawitem(int sock, char *raw, size_t len)
+{
+	char buf[BUFSIZ], *path, *addr;
+	ssize_t n;
+	int fd;
+	Map *m;
+
+	if (asprintf(&path, "%s/raw-XXXXXX", tmpdir) < 0)
+		die("Can't generate tmpdir path: %s: %s",
+		    tmpdir, strerror(errno));
+
+	if ((fd = mkstemp(path)) < 0) {
+		diag("Can't create spill file %s: %s", path, strerror(errno));
+		goto err;
+	}
+	if (!writeall(fd, raw, len))
+		goto errwrite;
+	clear(&raw);
+
+	while ((n = netread(sock, buf, sizeof(buf), idletimeout)) > 0) {
+		if (!writeall(fd, buf, n))
+			goto errwrite;
+		len += n;
+	}
+	if (n < 0) {
+		readfailed(1);
+		goto err;
+	}
+	if (!writeall(fd, "", 1))
+		goto errwrite;
+
+	addr = mmap(NULL, len+1, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		diag("Can't map spill file %s: %s", path, strerror(errno));
+		goto err;
+	}
+	close(fd);
+
+	m = xmalloc(sizeof(Map));
+	m->addr = addr;
+	m->len = len+1;
+	m->path = path;
+	m->shared = 0;
+	m->next = maps;
+	maps = m;
+
+	return addr;
+errwrite:
+	diag("Can't write spill file %s: %s", path, strerror(errno));
+err:
+	if (fd >= 0) {
+		close(fd);
+		unlink(path);
+	}
+	free(path);
+	free(raw);
+	return NULL;
+}
+
+/* read a response, hint being its expected size (0 if unknown) */
 static char *
-getrawitem(int sock)
+getrawitem(int sock, size_t hint)
 {
 	char *raw, *buf;
 	size_t bn, bs;
@@ -418,21 +1071,35 @@ getrawitem(int sock)
 	raw = buf = NULL;
 	bn = bs = n = 0;
 
+	if (spillsize && hint >= spillsize)
+		return spillrawitem(sock, NULL, 0);
+	/* the hint is approximate, leave room for a bit more */
+	if (hint) {
+		bn = hint / BUFSIZ + 2;
+		raw = buf = xreallocarray(NULL, bn, BUFSIZ);
+		bs = bn * BUFSIZ;
+	}
+
 	do {
 		bs -= n;
 		buf += n;
 		if (bs < 1) {
+			if (spillsize && bn * BUFSIZ >= spillsize)
+				return spillrawitem(sock, raw, bn * BUFSIZ);
 			raw = xreallocarray(raw, ++bn, BUFSIZ);
 			buf = raw + (bn-1) * BUFSIZ;
 			bs = BUFSIZ;
 		}
-	} while ((n = read(sock, buf, bs)) > 0);
+	} while ((n = netread(sock, buf, bs, (buf == raw) ?
+	                      firstbytetimeout : idletimeout)) > 0);
 
 	*buf = '\0';
 
 	if (n < 0) {
-		diag("Can't read socket: %s", strerror(errno));
+		readfailed(buf != raw);
 		clear(&raw);
+	} else {
+		demandbytes += buf - raw;
 	}
 
 	return raw;
@@ -449,82 +1116,249 @@ sendselector(int sock, const char *selector)
 	msg = p = xmalloc(ln);
 	snprintf(msg, ln--, "%s\r\n", selector);
 
-	while ((n = write(sock, p, ln)) > 0) {
+	while ((n = tlswrite(sock, p, ln)) > 0) {
 		ln -= n;
 		p += n;
 	}
 
 	free(msg);
-	if (n == -1)
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		diag("Server didn't take the request in %d ms", idletimeout);
+	else if (n == -1)
 		diag("Can't send message: %s", strerror(errno));
+	transient = (n == -1);
 
 	return n;
 }
 
+/* speak TLS on sock if host:port wants it */
 static int
+securesock(int sock, const char *host, const char *port)
+{
+	const char *err;
+
+	if (!tlswanted(host, port) || nettls(sock, host, port, &err) == 0)
+		return sock;
+
+	diag("Can't speak TLS with %s:%s: %s", host, port, err);
+	transient = (errno == ETIMEDOUT);
+	netclose(sock);
+
+	return -1;
+}
+
+int
 connectto(const char *host, const char *port)
 {
 	sigset_t set, oset;
-	static const struct addrinfo hints = {
-	    .ai_family = AF_UNSPEC,
-	    .ai_socktype = SOCK_STREAM,
-	    .ai_protocol = IPPROTO_TCP,
-	};
 	struct addrinfo *addrs, *addr;
-	int r, sock = -1;
+	Host *h;
+	int r, err = EHOSTUNREACH, sock = -1;
+
+	if (tracereplaying()) {
+		diag("Can't connect to %s:%s replaying a trace", host, port);
+		return -1;
+	}
 
 	sigemptyset(&set);
 	sigaddset(&set, SIGWINCH);
 	sigprocmask(SIG_BLOCK, &set, &oset);
 
-	if (r = getaddrinfo(host, port, &hints, &addrs)) {
-		diag("Can't resolve hostname \"%s\": %s",
+	if ((sock = pooltake(host, port)) >= 0) {
+		sigprocmask(SIG_SETMASK, &oset, NULL);
+		return securesock(sock, host, port);
+	}
+
+	h = schedwait(host, port);
+	if (r = resolve(host, port, &addrs)) {
+		diag("Can't resolve hostname \"%s\": %s",
 		     host, gai_strerror(r));
 		goto err;
 	}
 
 	for (addr = addrs; addr; addr = addr->ai_next) {
-		if ((sock = socket(addr->ai_family, addr->ai_socktype,
-		                   addr->ai_protocol)) < 0)
-			continue;
-		if ((r = connect(sock, addr->ai_addr, addr->ai_addrlen)) < 0) {
-			close(sock);
-			continue;
-		}
-		break;
+		if ((sock = netconnect(addr)) >= 0)
+			break;
+		err = errno;
 	}
 
-	freeaddrinfo(addrs);
+	free(addrs);
 
 	if (sock < 0) {
-		diag("Can't open socket: %s", strerror(errno));
-		goto err;
-	}
-	if (r < 0) {
-		diag("Can't connect to: %s:%s: %s",
-		     host, port, strerror(errno));
+		if (err == ETIMEDOUT)
+			diag("Timed out connecting to %s:%s after %d ms",
+			     host, port, connecttimeout);
+		else
+			diag("Can't connect to: %s:%s: %s",
+			     host, port, strerror(err));
+		transient = 1;
+		hostfailed(h);
 		goto err;
 	}
 
+	schedbind(h, sock);
 	sigprocmask(SIG_SETMASK, &oset, NULL);
-	return sock;
+	return securesock(sock, host, port);
 
 err:
+	schedput(h);
 	sigprocmask(SIG_SETMASK, &oset, NULL);
 	return -1;
 }
 
+static char
+dirlinetype(Dir *dir, size_t n)
+{
+	return dir->linestart ? linetype(dir, n) : dir->items[n].type;
+}
+
+/* connect to the item or to one of the '+' mirrors in its group,
+ * whichever answers first, setting *via to the item to request */
+static int
+connectitem(Item *item, Item **via)
+{
+	sigset_t set, oset;
+	Item *entry = item->entry;
+	Dir *dir;
+	char **hosts, **ports;
+	size_t i, first, n, won;
+	int sock;
+
+	*via = item;
+	if (!racemirrors || tracereplaying() || !entry || !(dir = entry->dat) ||
+	    item < dir->items || item >= dir->items + dir->nitems ||
+	    (item->redtype ? item->redtype : item->type) == '7')
+		return connectto(item->host, item->port);
+
+	i = item - dir->items;
+	for (first = i; first > 0 && dirlinetype(dir, first) == '+'; --first)
+		;
+	for (n = i+1; n < dir->nitems && dirlinetype(dir, n) == '+'; ++n)
+		;
+	if ((n -= first) < 2)
+		return connectto(item->host, item->port);
+
+	hosts = xreallocarray(NULL, n, sizeof(*hosts));
+	ports = xreallocarray(NULL, n, sizeof(*ports));
+	for (i = 0; i < n; ++i) {
+		hosts[i] = diritem(dir, first + i)->host;
+		ports[i] = diritem(dir, first + i)->port;
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &set, &oset);
+	sock = connectrace(hosts, ports, n, &won);
+	sigprocmask(SIG_SETMASK, &oset, NULL);
+
+	free(hosts);
+	free(ports);
+	++nraces;
+
+	if (sock < 0) {
+		if (errno == ETIMEDOUT)
+			diag("Timed out connecting to %s:%s or its mirrors",
+			     item->host, item->port);
+		else
+			diag("Can't connect to %s:%s or its mirrors",
+			     item->host, item->port);
+		transient = 1;
+		return -1;
+	}
+	if ((*via = diritem(dir, first + won)) != item)
+		++nmirrorwins;
+
+	return securesock(sock, (*via)->host, (*via)->port);
+}
+
+static void
+plumb(const char *url)
+{
+	char *argv[] = { plumber, (char *)url, NULL };
+	size_t i;
+	pid_t pid;
+
+	if (tracereplaying()) {
+		diag("Plumbed \"%s\"", url);
+		return;
+	}
+
+	/* reap the plumbers done since the last time */
+	for (i = 0; i < nplumbers;) {
+		if (waitpid(plumbers[i], NULL, WNOHANG))
+			plumbers[i] = plumbers[--nplumbers];
+		else
+			++i;
+	}
+
+	if ((pid = spawn(argv, -1, devnullfd)) < 0) {
+		diag("Can't run %s: %s", plumber, strerror(errno));
+		errno = 0;
+		return;
+	}
+	plumbers = xreallocarray(plumbers, ++nplumbers, sizeof(*plumbers));
+	plumbers[nplumbers-1] = pid;
+
+	diag("Plumbed \"%s\"", url);
+}
+
+/* plumb while downloading, keeping the message for after it, as the
+ * UI may wait for a key to go on */
+static void
+plumbstreamed(const char *path)
+{
+	void (*d)(char *, ...) = diag;
+
+	diag = keepdiag;
+	plumb(path);
+	diag = d;
+}
+
+/* open the writing end of a FIFO once the plumber opened the other */
+static int
+openfifo(const char *path)
+{
+	long long t = now() + FIFOWAIT;
+	int fd;
+
+	while ((fd = open(path, O_WRONLY|O_NONBLOCK)) < 0 && errno == ENXIO &&
+	       now() < t)
+		netwait(-1, 50);
+	if (fd < 0) {
+		diag("The plumber didn't open %s", path);
+		errno = 0;
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	return fd;
+}
+
+/* download an item to dest; with a stream path, the plumber is handed
+ * the item while it downloads, as set by plumbstream */
 static int
-download(Item *item, int dest)
+download(Item *item, int dest, const char *stream)
 {
-	char buf[BUFSIZ];
+	char buf[BUFSIZ], *fifopath = NULL, *done;
+	const char *err;
+	struct sigaction sa, osa;
+	Decoder *dec = NULL;
+	Item *via;
 	ssize_t r, w;
-	int src;
+	size_t got;
+	long long start = now();
+	int src, fifo = -1, plumbed = !stream;
+
+	lastdiag[0] = '\0';
 
 	if (!item->tag) {
-		if ((src = connectto(item->host, item->port)) < 0 ||
-		    sendselector(src, item->selector) < 0)
+		if ((src = connectitem(item, &via)) < 0 ||
+		    sendselector(src, via->selector) < 0)
 			return 0;
+		/* the tag of a decoded item is the decoded file */
+		if (decodedownloads)
+			dec = decodeopen(item->redtype ? item->redtype :
+			                 item->type, dest);
 	} else if ((src = open(item->tag, O_RDONLY)) < 0) {
 		printf("Can't open source file %s: %s",
 		       item->tag, strerror(errno));
@@ -532,23 +1366,109 @@ download(Item *item, int dest)
 		return 0;
 	}
 
-	w = 0;
-	while ((r = read(src, buf, BUFSIZ)) > 0) {
+	if (stream && plumbstream == 2) {
+		if (asprintf(&fifopath, "%s/fifo-%s", tmpdir,
+		             strrchr(stream, '/') + 1) < 0)
+			die("Can't generate tmpdir path: %s: %s",
+			    tmpdir, strerror(errno));
+		if (mkfifo(fifopath, S_IRUSR|S_IWUSR) < 0) {
+			diag("Can't create FIFO %s: %s",
+			     fifopath, strerror(errno));
+			errno = 0;
+			clear(&fifopath);
+		} else {
+			plumbstreamed(fifopath);
+			fifo = openfifo(fifopath);
+		}
+		plumbed = 1;
+		/* a viewer closing early only ends the streaming */
+		sa.sa_handler = SIG_IGN;
+		sa.sa_flags = 0;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGPIPE, &sa, &osa);
+	}
+
+	w = got = 0;
+	while ((r = netread(src, buf, BUFSIZ, got ?
+	                    idletimeout : firstbytetimeout)) > 0) {
+		got += r;
+		if (dec) {
+			if (!decode(dec, buf, r)) {
+				w = -1;
+				break;
+			}
+			continue;
+		}
+		if (fifo >= 0 && !writeall(fifo, buf, r)) {
+			close(fifo);
+			fifo = -1;
+		}
 		while ((w = write(dest, buf, r)) > 0)
 			r -= w;
+		/* plumbers may look at the first bytes of growing files */
+		if (!plumbed && w == 0) {
+			plumbstreamed(stream);
+			plumbed = 1;
+		}
 	}
 
-	if (r < 0 || w < 0) {
+	if (r < 0 && errno == ETIMEDOUT) {
+		printf("Error downloading file %s: %s", item->selector,
+		       got ? "server stalled" : "server didn't answer");
+		errno = 0;
+	} else if (r < 0 || (w < 0 && !dec)) {
 		printf("Error downloading file %s: %s",
 		       item->selector, strerror(errno));
 		errno = 0;
 	}
 
-	close(src);
+	if (dec && (err = decodeclose(dec))) {
+		if (r >= 0)
+			printf("Error decoding file %s: %s",
+			       item->selector, err);
+		w = -1;
+	}
+
+	netclose(src);
+	if (!item->tag && r == 0)
+		measurerate(got, start);
+
+	if (fifopath) {
+		if (fifo >= 0)
+			close(fifo);
+		unlink(fifopath);
+		free(fifopath);
+	}
+	if (stream && plumbstream == 2)
+		sigaction(SIGPIPE, &osa, NULL);
+	if (stream && plumbstream == 1 && r == 0 && w == 0) {
+		if (asprintf(&done, "%s.done", stream) < 0)
+			die("asprintf: %s", strerror(errno));
+		if ((src = open(done, O_WRONLY|O_CREAT|O_TRUNC,
+		                S_IRUSR|S_IWUSR)) >= 0)
+			close(src);
+		free(done);
+	}
+	if (stream && plumbed && lastdiag[0])
+		diag("%s", lastdiag);
 
 	return (r == 0 && w == 0);
 }
 
+/* what is known of an item to download, for the prompts */
+static const char *
+downloadnote(Item *item)
+{
+	static char buf[128];
+	const char *desc;
+
+	if (!(desc = plusdescribe(item)))
+		return "";
+	snprintf(buf, sizeof(buf), " (%s)", desc);
+
+	return buf;
+}
+
 static void
 downloaditem(Item *item)
 {
@@ -561,7 +1481,8 @@ downloaditem(Item *item)
 	else
 		file = item->selector;
 
-	if (!(path = uiprompt("Download to [%s] (^D cancel): ", file)))
+	if (!(path = uiprompt("Download%s to [%s] (^D cancel): ",
+	                      downloadnote(item), file)))
 		return;
 
 	if (!path[0])
@@ -582,7 +1503,7 @@ downloaditem(Item *item)
 		goto cleanup;
 	}
 
-	if (!download(item, dest))
+	if (!download(item, dest, NULL))
 		goto cleanup;
 
 	if (item->tag)
@@ -596,204 +1517,1383 @@ cleanup:
 	return;
 }
 
+/* key of an item in the shared cache */
+static char *
+sharedkey(Item *item, const char *selector)
+{
+	char *key;
+
+	if (asprintf(&key, "%s:%s/%c%s", item->host, item->port,
+	             item->type, selector) < 0)
+		die("asprintf: %s", strerror(errno));
+
+	return key;
+}
+
+/* the file of a local item, NULL for the items of the network: those of
+ * a local menu without a host, their selector relative to the directory
+ * of the menu or, starting with '/', to the top of the tree opened */
+char *
+localpath(Item *item)
+{
+	struct stat st;
+	Item *entry;
+	char *base;
+	size_t n;
+	int r;
+
+	if (item->host == filehost)
+		return item->selector;
+	/* links out of the tree keep going out */
+	if (!item->host || *item->host ||
+	    strchr("i38T", item->redtype ? item->redtype : item->type) ||
+	    !strncmp(item->selector, "URL:", 4) ||
+	    !(entry = item->entry ? item->entry : curpage) || entry == item ||
+	    !(base = localpath(entry)))
+		return NULL;
+	if (item->tag)
+		return item->tag;
+
+	if (item->selector[0] == '/') {
+		r = asprintf(&item->tag, "%.*s%s", (int)toplen, localtop,
+		             item->selector);
+	} else {
+		n = strlen(base);
+		if (stat(base, &st) < 0 || !S_ISDIR(st.st_mode))
+			n = strrchr(base, '/') - base;
+		r = asprintf(&item->tag, "%.*s/%s", (int)n, base,
+		             item->selector);
+	}
+	if (r < 0)
+		die("asprintf: %s", strerror(errno));
+
+	return item->tag;
+}
+
+/* map a local file, private and writable for menus to be split in
+ * place, with a NUL after its end */
+static char *
+mapfile(const char *path, size_t *len)
+{
+	struct stat st;
+	char *addr;
+	int fd;
+	Map *m;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		diag("Can't open %s: %s", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		diag("Can't open %s: Not a regular file", path);
+		close(fd);
+		return NULL;
+	}
+	*len = st.st_size;
+
+	/* the file goes over zeroed pages a byte longer than it, so that
+	 * the NUL is there even when it ends on a page boundary */
+	addr = mmap(NULL, *len+1, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON,
+	            -1, 0);
+	if (addr != MAP_FAILED && *len &&
+	    mmap(addr, *len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED,
+	         fd, 0) == MAP_FAILED) {
+		munmap(addr, *len+1);
+		addr = MAP_FAILED;
+	}
+	if (addr == MAP_FAILED) {
+		diag("Can't map %s: %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	m = xmalloc(sizeof(Map));
+	m->addr = addr;
+	m->len = *len+1;
+	m->path = NULL;
+	m->shared = 0;
+	m->next = maps;
+	maps = m;
+
+	++nlocalmaps;
+	localbytes += *len;
+
+	return addr;
+}
+
+/* type of a local file from its name, as servers list them */
+static char
+localtype(const char *name, int isdir)
+{
+	static const struct {
+		char *ext;
+		char type;
+	} exts[] = {
+		{ "txt", '0' }, { "text", '0' }, { "md", '0' }, { "asc", '0' },
+		{ "gophermap", '1' }, { "html", 'h' }, { "htm", 'h' },
+		{ "hqx", '4' }, { "uue", '6' }, { "gif", 'g' }, { "jpg", 'I' },
+		{ "jpeg", 'I' }, { "png", 'I' }, { "bmp", 'I' },
+	};
+	const char *ext;
+	size_t i;
+
+	if (isdir)
+		return '1';
+	if ((ext = strrchr(name, '/')))
+		name = ext + 1;
+	if (!strcmp(name, "gophermap"))
+		return '1';
+	if (!(ext = strrchr(name, '.')) || ext == name)
+		return '0';
+	for (i = 0; i < sizeof(exts) / sizeof(*exts); ++i) {
+		if (!strcasecmp(ext + 1, exts[i].ext))
+			return exts[i].type;
+	}
+
+	return '9';
+}
+
 static int
-fetchitem(Item *item)
+listable(const struct dirent *d)
+{
+	return d->d_name[0] != '.' && !strpbrk(d->d_name, "\t\r\n");
+}
+
+/* a menu of a local directory without a gophermap */
+static char *
+listdir(const char *path, size_t *len)
+{
+	struct dirent **ents;
+	struct stat st;
+	FILE *fp;
+	char *raw = NULL, *file;
+	int i, n, isdir;
+
+	if ((n = scandir(path, &ents, listable, alphasort)) < 0) {
+		diag("Can't list %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	if (!(fp = open_memstream(&raw, len)))
+		die("open_memstream: %s", strerror(errno));
+
+	for (i = 0; i < n; ++i) {
+		switch (ents[i]->d_type) {
+		case DT_DIR:
+			isdir = 1;
+			break;
+		case DT_UNKNOWN:
+		case DT_LNK:
+			if (asprintf(&file, "%s/%s", path, ents[i]->d_name) < 0)
+				die("asprintf: %s", strerror(errno));
+			isdir = stat(file, &st) == 0 && S_ISDIR(st.st_mode);
+			free(file);
+			break;
+		default:
+			isdir = 0;
+		}
+		fprintf(fp, "%c%s\t%s\t\t\r\n",
+		        localtype(ents[i]->d_name, isdir),
+		        ents[i]->d_name, ents[i]->d_name);
+		free(ents[i]);
+	}
+	free(ents);
+	if (!n)
+		fputs("i(empty directory)\t\t\t\r\n", fp);
+	fclose(fp);
+	++nlocallists;
+
+	return raw;
+}
+
+/* the raw of a local file, or of the gophermap or listing of a
+ * directory */
+static char *
+loadlocal(const char *path, size_t *len)
+{
+	struct stat st;
+	char *map, *raw;
+
+	if (stat(path, &st) < 0) {
+		diag("Can't open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	if (!S_ISDIR(st.st_mode))
+		return mapfile(path, len);
+
+	if (asprintf(&map, "%s/gophermap", path) < 0)
+		die("asprintf: %s", strerror(errno));
+	raw = access(map, R_OK) == 0 ? mapfile(map, len) : listdir(path, len);
+	free(map);
+
+	return raw;
+}
+
+static int
+fetchonce(Item *item)
 {
+	Plus *p = itemplus(item);
+	Item *via;
+	unsigned long long bytes = demandbytes;
+	long long start = now();
 	int sock;
 
-	if ((sock = connectto(item->host, item->port)) < 0 ||
-	    sendselector(sock, item->selector) < 0)
-		return 0;
-	item->raw = getrawitem(sock);
-	close(sock);
+	if ((sock = connectitem(item, &via)) < 0 ||
+	    sendselector(sock, via->selector) < 0)
+		return 0;
+	++ndemand;
+	item->raw = getrawitem(sock, p ? p->size : 0);
+	netclose(sock);
+	measurerate(demandbytes - bytes, start);
+
+	if (item->raw && !*item->raw) {
+		diag("Empty response from server");
+		clear(&item->raw);
+	}
+
+	return (item->raw != NULL);
+}
+
+/* fetch an item, retrying after network failures with a growing and
+ * jittered delay until fetchdeadline ms passed */
+static int
+fetchitem(Item *item)
+{
+	void (*d)(char *, ...) = diag;
+	long long start = now(), t, delay;
+	char *key = NULL, *path;
+	size_t len;
+	int r, tries;
+
+	if ((path = localpath(item)))
+		return (item->raw = loadlocal(path, &len)) != NULL;
+	if (tracereplaying()) {
+		if (!(item->raw = traceget(item->host, item->port,
+		                           item->selector, &len)))
+			diag("No answer to %s in the trace", item->selector);
+		return item->raw != NULL;
+	}
+	if (sharedcache) {
+		key = sharedkey(item, item->selector);
+		if ((item->raw = sharedget(key, &len))) {
+			traceput(item->host, item->port, item->selector,
+			         item->raw, len);
+			free(key);
+			return 1;
+		}
+	}
+
+	for (tries = 0;; ++tries) {
+		lastdiag[0] = '\0';
+		transient = 0;
+		diag = keepdiag;
+		r = fetchonce(item);
+		diag = d;
+		if (r || !transient || !fetchdeadline)
+			break;
+		delay = RETRYDELAY << (tries < 5 ? tries : 5);
+		delay = delay / 2 + random() % delay;
+		if (now() + delay - start >= fetchdeadline)
+			break;
+		++nretries;
+		for (t = now() + delay; now() < t;)
+			netwait(-1, t - now());
+	}
+	if (!r && lastdiag[0])
+		diag("%s", lastdiag);
+	if (r)
+		traceput(item->host, item->port, item->selector,
+		         item->raw, strlen(item->raw));
+	if (r && key)
+		sharedput(key, item->raw, strlen(item->raw));
+	free(key);
+
+	return r;
+}
+
+/* query the CSO server of a type 2 item, the query following the
+ * selector after a tab */
+static int
+csoitem(Item *item)
+{
+	const char *query, *err;
+
+	if (!(query = strchr(item->selector, '\t')) || !*++query) {
+		diag("No CSO query given");
+		return 0;
+	}
+	if (!(item->raw = csoquery(item->host, item->port, query, &err))) {
+		if (err)
+			diag("Can't query CSO server %s:%s: %s",
+			     item->host, item->port, err);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+plumbitem(Item *item)
+{
+	char *file, *path, *tag;
+	mode_t mode = S_IRUSR|S_IWUSR|S_IRGRP;
+	int dest, plumbitem, streamed = 0;
+
+	if (file = strrchr(item->selector, '/'))
+		++file;
+	else
+		file = item->selector;
+
+	path = uiprompt("Download %s%s to (^D cancel, <empty> plumb): ",
+	                file, downloadnote(item));
+	if (!path)
+		return;
+
+	if ((tag = item->tag) && access(tag, R_OK) < 0) {
+		clear(&item->tag);
+		tag = NULL;
+	}
+
+	plumbitem = path[0] ? 0 : 1;
+
+	if (!path[0]) {
+		clear(&path);
+		if (!tag) {
+			if (asprintf(&path, "%s/%s", tmpdir, file) < 0)
+				die("Can't generate tmpdir path: %s/%s: %s",
+				    tmpdir, file, strerror(errno));
+		}
+	}
+
+	if (path && (!tag || strcmp(tag, path))) {
+		if ((dest = open(path, O_WRONLY|O_CREAT|O_EXCL, mode)) < 0) {
+			diag("Can't open destination file %s: %s",
+			     path, strerror(errno));
+			errno = 0;
+			goto cleanup;
+		}
+		streamed = plumbitem && plumbstream;
+		if (!download(item, dest, streamed ? path : NULL) || tag)
+			goto cleanup;
+	}
+
+	if (!tag)
+		item->tag = path;
+
+	if (plumbitem && !streamed)
+		plumb(item->tag);
+
+	return;
+cleanup:
+	free(path);
+	return;
+}
+
+/* find the line of dir listed in a +INFO attribute, looking from the
+ * line after the last one found */
+static Plus *
+plusmatch(Dir *dir, char *info, size_t *last)
+{
+	char *sel, *host, *port;
+	Item *item;
+	size_t i, k;
+
+	info += strspn(info, " ");
+	if (!*info || !(sel = strchr(info, '\t')) ||
+	    !(host = strchr(++sel, '\t')))
+		return NULL;
+	*host++ = '\0';
+	if (!(port = strchr(host, '\t')))
+		return NULL;
+	*port++ = '\0';
+	port[strcspn(port, "\t")] = '\0';
+
+	for (k = 0; k < dir->nitems; ++k) {
+		i = (*last + k) % dir->nitems;
+		item = &dir->items[i];
+		if (item->type != 'i' && item->selector && item->host &&
+		    item->port && !strcmp(item->selector, sel) &&
+		    !strcmp(item->host, host) && !strcmp(item->port, port)) {
+			*last = i + 1;
+			return &dir->plus[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* keep the type and size of the first view of each item */
+static void
+plusfetched(Fetch *f)
+{
+	Dir *dir = f->arg;
+	Plus *p = NULL;
+	char *line, *next, *e;
+	size_t last = 0, n;
+	double size;
+	int views = 0;
+
+	dir->plusfetch = NULL;
+	if (!f->ok || !f->buf || f->buf[0] != '+')
+		return;
+
+	dir->plus = xcalloc(dir->nitems * sizeof(Plus));
+	for (line = f->buf; line; line = next) {
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
+		line[strcspn(line, "\r")] = '\0';
+		if (!strncmp(line, "+INFO:", 6)) {
+			p = plusmatch(dir, line + 6, &last);
+			views = 0;
+		} else if (line[0] == '+') {
+			views = !strncmp(line, "+VIEWS:", 7);
+		} else if (views && p && !p->mime[0] && line[0] == ' ') {
+			/* " type[ language]: <size>" */
+			line += strspn(line, " ");
+			n = strcspn(line, " :");
+			if (n >= sizeof(p->mime))
+				n = sizeof(p->mime) - 1;
+			memcpy(p->mime, line, n);
+			if (!(line = strchr(line, '<')))
+				continue;
+			size = strtod(line + 1, &e);
+			switch (*e) {
+			case 'k':
+			case 'K':
+				size *= 1024;
+				break;
+			case 'm':
+			case 'M':
+				size *= 1024 * 1024;
+				break;
+			case 'g':
+			case 'G':
+				size *= 1024 * 1024 * 1024;
+				break;
+			}
+			if (size > 0)
+				p->size = size;
+		}
+	}
+}
+
+/* fetch the Gopher+ attributes of all the items of a menu at once */
+static void
+plusfetch(Item *entry)
+{
+	Dir *dir = entry->dat;
+	char *sel;
+	size_t i;
+
+	if (!gopherplus || !dir || dir->linestart || dir->plus ||
+	    dir->plusfetch || !*entry->host)
+		return;
+	for (i = 0; i < dir->nitems; ++i) {
+		if (dir->items[i].flags & ITEMPLUS)
+			break;
+	}
+	if (i == dir->nitems)
+		return;
+
+	if (asprintf(&sel, "%s\t$", entry->selector) < 0)
+		die("asprintf: %s", strerror(errno));
+	dir->plusfetch = fetchstart(entry->host, entry->port, sel, PLUSMAX,
+	                            plusfetched, dir);
+	free(sel);
+}
+
+/* resolve the hosts of the menu links ahead of their selection */
+static void
+resolveahead(Dir *dir)
+{
+	Item *item;
+	size_t i, n;
+
+	if (tracereplaying())
+		return;
+	n = dir->nitems;
+	if (dir->linestart && n > LAZYCHUNK)
+		n = LAZYCHUNK;
+
+	for (i = 0; i < n; ++i) {
+		item = diritem(dir, i);
+		switch (item->redtype ? item->redtype : item->type) {
+		case '\0': /* malformed line */
+		case 'i':
+		case '3':
+		case '8':
+		case 'T':
+			continue;
+		case 'h':
+			if (!strncmp(item->selector, "URL:", 4))
+				continue;
+		}
+		if (*item->host)
+			dnsprefetch(item->host, item->port);
+	}
+}
+
+/* a failing archive is reported once, it isn't used any further */
+static void
+archiveitem(Item *item)
+{
+	const char *err;
+
+	if ((err = archiveadd(item)))
+		diag("Can't archive: %s", err);
+}
+
+static int
+dig(Item *entry, Item *item)
+{
+	char *plumburi = NULL, *path;
+	int t;
+
+	if (!item->raw)
+		prefetchcancel(item, 1);
+	if (item->raw) { /* already in cache */
+		if (item->flags & ITEMPREFETCHED) {
+			item->flags &= ~ITEMPREFETCHED;
+			++nprefetchused;
+		}
+		return item->type;
+	}
+	if (!item->entry)
+		item->entry = entry ? entry : item;
+
+	t = item->redtype ? item->redtype : item->type;
+	if ((path = localpath(item))) {
+		if (t == '2' || t == '7') {
+			diag("Type %c (%s) not supported in local trees",
+			     t, typedisplay(t));
+			return 0;
+		}
+		if (access(path, R_OK) < 0) {
+			diag("Can't open %s: %s", path, strerror(errno));
+			errno = 0;
+			return 0;
+		}
+	}
+
+	switch (t) {
+	case 'h': /* fallthrough */
+		if (!strncmp(item->selector, "URL:", 4)) {
+			plumb(item->selector+4);
+			return 0;
+		}
+	case '0':
+		if (!fetchitem(item))
+			return 0;
+		break;
+	case '1':
+	case '7':
+		if (!fetchitem(item) || !(item->dat = molddiritem(item->raw)))
+			return 0;
+		if (interactive) {
+			resolveahead(item->dat);
+			if (t == '1')
+				plusfetch(item);
+		}
+		break;
+	case '2':
+		if (!csoitem(item) || !(item->dat = molddiritem(item->raw)))
+			return 0;
+		break;
+	case '4':
+	case '5':
+	case '6':
+	case '9':
+		downloaditem(item);
+		return 0;
+	case '8':
+		if (asprintf(&plumburi, "telnet://%s%s%s:%s",
+		             item->selector, item->selector ? "@" : "",
+		             item->host, item->port) < 0)
+			return 0;
+		plumb(plumburi);
+		free(plumburi);
+		return 0;
+	case 'T':
+		if (asprintf(&plumburi, "tn3270://%s%s%s:%s",
+		             item->selector, item->selector ? "@" : "",
+		             item->host, item->port) < 0)
+			return 0;
+		plumb(plumburi);
+		free(plumburi);
+		return 0;
+	default:
+		if (t >= '0' && t <= 'Z') {
+			diag("Type %c (%s) not supported", t, typedisplay(t));
+			return 0;
+		}
+	case 'g':
+	case 'I':
+		plumbitem(item);
+	case 'i':
+		return 0;
+	}
+
+	if (interactive)
+		idxadd(item);
+	if (!path)
+		archiveitem(item);
+
+	return item->type;
+}
+
+/* set the results of the current query of a search item aside, the
+ * item keeping those of its last searchcache queries */
+static void
+searchstash(Item *item)
+{
+	Searched **sp, *s;
+	int n;
+
+	if (!item->tag)
+		return;
+
+	prefetchcancel(item, 0);
+	if (item->raw)
+		unindex(item);
+	s = xcalloc(sizeof(Searched));
+	s->item = item;
+	s->result.type = item->type;
+	s->result.tag = item->tag;
+	s->result.raw = item->raw;
+	s->result.dat = item->dat;
+	s->next = searched;
+	searched = s;
+	item->tag = item->raw = NULL;
+	item->dat = NULL;
+	item->flags = 0;
+
+	for (n = 0, sp = &searched; (s = *sp);) {
+		if (s->item == item && (!s->result.dat || ++n > searchcache)) {
+			*sp = s->next;
+			clearitem(&s->result);
+			free(s);
+		} else {
+			sp = &s->next;
+		}
+	}
+}
+
+static Searched **
+searchfind(Item *item, const char *tag)
+{
+	Searched **sp;
+
+	for (sp = &searched; *sp; sp = &(*sp)->next) {
+		if ((*sp)->item == item && !strcmp((*sp)->result.tag, tag))
+			return sp;
+	}
+
+	return NULL;
+}
+
+/* bring back the results of an earlier query of a search item whose
+ * current ones were set aside */
+static int
+searchrestore(Item *item, const char *tag)
+{
+	Searched **sp, *s;
+
+	if (!(sp = searchfind(item, tag)))
+		return 0;
+
+	s = *sp;
+	*sp = s->next;
+	item->tag = s->result.tag;
+	item->raw = s->result.raw;
+	item->dat = s->result.dat;
+	free(s);
+	++nsearchhits;
+	if (interactive)
+		idxadd(item);
+
+	return 1;
+}
+
+/* the query expression exp of a search item, NULL if empty */
+static char *
+searchtag(Item *item, const char *exp)
+{
+	char *tag;
+
+	if (!*exp)
+		return NULL;
+	if (asprintf(&tag, "%s\t%s", item->selector, exp) < 0)
+		die("asprintf: %s", strerror(errno));
+
+	return tag;
+}
+
+/* drop the query on its way, its answer would be stale */
+static void
+searchstop(void)
+{
+	if (livetimer.id)
+		watchdel(&livetimer);
+	if (livefetch) {
+		fetchcancel(livefetch);
+		livefetch = NULL;
+		++nlivestale;
+	}
+	clear(&livetag);
+}
+
+static void
+searchfetched(Fetch *f)
+{
+	Item *item = f->arg;
+	void (*d)(char *, ...) = diag;
+	char *raw;
+	Dir *dir;
+
+	livefetch = NULL;
+	if (!f->ok || !f->len)
+		return;
+
+	raw = f->buf;
+	f->buf = NULL;
+	diag = quietdiag;
+	dir = molddiritem(raw);
+	diag = d;
+	if (!dir) {
+		free(raw);
+		return;
+	}
+
+	searchstash(item);
+	item->tag = livetag;
+	livetag = NULL;
+	item->raw = raw;
+	item->dat = dir;
+	resolveahead(dir);
+	idxadd(item);
+	uidisplay(item);
+}
+
+static void
+searchtimercb(Watch *w, short revents)
+{
+	watchdel(w);
+	livefetch = fetchstart(liveitem->host, liveitem->port, livetag, 0,
+	                       searchfetched, liveitem);
+	livefetch->background = 0;
+	++nlivequeries;
+}
+
+/* show the results of the query typed so far, from the earlier ones or
+ * from the server once typing pauses for searchdelay ms */
+static void
+searchtyped(const char *exp)
+{
+	Item *item = liveitem;
+	char *tag;
+
+	searchstop();
+	if (!(tag = searchtag(item, *exp ? exp : livepexp)) ||
+	    (item->tag && !strcmp(tag, item->tag))) {
+		free(tag);
+		return;
+	}
+
+	if (searchfind(item, tag)) {
+		searchstash(item);
+		searchrestore(item, tag);
+		free(tag);
+		uidisplay(item);
+		return;
+	}
+
+	livetag = tag;
+	livetimer.cb = searchtimercb;
+	livetimer.fd = -1;
+	livetimer.deadline = now() + searchdelay;
+	watchadd(&livetimer);
+}
+
+/* ask for the query of a search item, returning its tag */
+static char *
+searchselector(Item *item)
+{
+	char *pexp, *exp, *orig, *tag;
+	size_t n = strlen(item->selector);
+
+	if ((orig = item->tag) && !strncmp(orig, item->selector, n))
+		orig = xstrdup(orig);
+	else
+		orig = NULL;
+	pexp = orig ? orig + n+1 : "";
+
+	if (searchlive && interactive &&
+	    (item->redtype ? item->redtype : item->type) == '7') {
+		liveitem = item;
+		livepexp = pexp;
+		exp = uiliveprompt(searchtyped,
+		                   "Enter search string (^D cancel) [%s]: ",
+		                   pexp);
+		liveitem = NULL;
+		/* back to the former results */
+		if (!exp) {
+			searchstop();
+			if (orig && (!item->tag || strcmp(item->tag, orig))) {
+				searchstash(item);
+				searchrestore(item, orig);
+			}
+		}
+	} else {
+		exp = uiprompt("Enter search string (^D cancel) [%s]: ",
+		               pexp);
+	}
+	if (!exp) {
+		free(orig);
+		return NULL;
+	}
+
+	tag = searchtag(item, *exp ? exp : pexp);
+	free(exp);
+	free(orig);
+
+	return tag;
+}
+
+static int
+searchitem(Item *entry, Item *item)
+{
+	char *sel, *selector;
+
+	if (!item->entry)
+		item->entry = entry ? entry : item;
+	if (!(sel = searchselector(item)))
+		return 0;
+
+	/* the answer may be on its way already */
+	if (livefetch && !strcmp(livetag, sel))
+		fetchfinish(livefetch);
+	searchstop();
+
+	if (!item->tag || strcmp(item->tag, sel)) {
+		searchstash(item);
+		searchrestore(item, sel);
+	}
+	if (item->tag)
+		free(sel);
+	else
+		item->tag = sel;
+	if (!item->dat) {
+		selector = item->selector;
+		item->selector = item->tag;
+		dig(entry, item);
+		item->selector = selector;
+	}
+	return (item->dat != NULL);
+}
+
+Item *
+searchsession(const char *query, Item *entry)
+{
+	Item **hits, *item;
+	Dir *dir;
+	FILE *fp;
+	char *raw = NULL;
+	size_t i, n, len;
+
+	if (!(n = idxquery(query, &hits))) {
+		diag("No match for \"%s\" in fetched pages", query);
+		return NULL;
+	}
+
+	if (!(fp = open_memstream(&raw, &len)))
+		die("open_memstream: %s", strerror(errno));
+	fprintf(fp, "i%zu match%s for \"%s\"\tErr\tsearch\t0\r\n",
+	        n, n > 1 ? "es" : "", query);
+	for (i = 0; i < n; ++i) {
+		item = hits[i];
+		fprintf(fp, "%c%s\t%s\t%s\t%s\r\n", item->type,
+		        (item->username && *item->username) ?
+		        item->username : item->selector,
+		        item->selector, item->host, item->port);
+	}
+	fclose(fp);
+
+	if (entry == &searchresults)
+		entry = searchresults.entry;
+	clearitem(&searchresults);
+
+	if (!(dir = molddiritem(raw))) {
+		free(raw);
+		free(hits);
+		return NULL;
+	}
+	for (i = 0; i < n; ++i)
+		diritem(dir, i+1)->link = hits[i];
+	free(hits);
+
+	searchresults.type = '1';
+	searchresults.username = searchresults.selector =
+	searchresults.tag = xstrdup(query);
+	searchresults.host = "search";
+	searchresults.port = "70";
+	searchresults.raw = raw;
+	searchresults.dat = dir;
+	searchresults.entry = entry;
+
+	return &searchresults;
+}
+
+/* a menu of the archived documents matching query */
+static Item *
+archivesearch(const char *query)
+{
+	Item *entry;
+	FILE *fp;
+	const char *err;
+	char *hits, *raw = NULL;
+	size_t n, len;
+
+	if (!archive)
+		die("No archive set in config.h");
+	if (!(hits = archivequery(query, &n, &err)) && err)
+		die("Can't search archive %s: %s", archive, err);
+	if (!hits)
+		die("No match for \"%s\" in the archive", query);
+
+	if (!(fp = open_memstream(&raw, &len)))
+		die("open_memstream: %s", strerror(errno));
+	fprintf(fp, "i%zu match%s for \"%s\" in the archive"
+	        "\tErr\tarchive\t0\r\n", n, n > 1 ? "es" : "", query);
+	fputs(hits, fp);
+	fclose(fp);
+	free(hits);
+
+	entry = xcalloc(sizeof(Item));
+	entry->type = '1';
+	entry->username = entry->selector = mainurl;
+	entry->host = "archive";
+	entry->port = "70";
+	entry->raw = raw;
+	entry->entry = entry;
+	if (!(entry->dat = molddiritem(raw)))
+		die("Can't list the matches for \"%s\"", query);
+
+	return entry;
+}
+
+Item *
+sessionstats(Item *entry)
+{
+	FILE *fp;
+	size_t len;
+
+	clear(&statsitem.raw);
+	if (!(fp = open_memstream(&statsitem.raw, &len)))
+		die("open_memstream: %s", strerror(errno));
+	fprintf(fp, "Fetches:\n"
+	        "demand: %llu (%llu bytes), %llu retries\n"
+	        "prefetch: %llu (%llu bytes), %llu viewed\n",
+	        ndemand, demandbytes, nretries,
+	        nprefetch, prefetchbytes, nprefetchused);
+	fprintf(fp, "mirror races: %llu, %llu won by a mirror\n",
+	        nraces, nmirrorwins);
+	fprintf(fp, "local: %llu files mapped (%llu bytes), "
+	        "%llu directories listed\n",
+	        nlocalmaps, localbytes, nlocallists);
+	fprintf(fp, "searches: %llu from earlier results, %llu live queries, "
+	        "%llu dropped stale\n", nsearchhits, nlivequeries, nlivestale);
+	netstats(fp);
+	tlsstats(fp);
+	tracestats(fp);
+	archivestats(fp);
+	sharedstats(fp);
+	csostats(fp);
+	fclose(fp);
+
+	statsitem.type = '0';
+	statsitem.username = statsitem.selector = "stats";
+	statsitem.host = "sacc";
+	statsitem.port = "70";
+	statsitem.entry = entry;
+
+	return &statsitem;
+}
+
+static void
+prefetched(Fetch *f)
+{
+	Item *item = f->arg;
+	void (*d)(char *, ...) = diag;
+	char *key;
+
+	*prefetching(item) = NULL;
+
+	if (!f->ok || !f->len) {
+		item->flags |= ITEMNOPREFETCH;
+		return;
+	}
+
+	item->raw = f->buf;
+	f->buf = NULL;
+	if (sharedcache) {
+		key = sharedkey(item, item->selector);
+		sharedput(key, item->raw, f->len);
+		free(key);
+	}
+	if ((item->redtype ? item->redtype : item->type) == '1') {
+		diag = quietdiag;
+		item->dat = molddiritem(item->raw);
+		diag = d;
+		if (!item->dat) {
+			clear(&item->raw);
+			item->flags |= ITEMNOPREFETCH;
+			return;
+		}
+		resolveahead(item->dat);
+	}
+
+	item->flags |= ITEMPREFETCHED;
+	++nprefetch;
+	prefetchbytes += f->len;
+	idxadd(item);
+	archiveitem(item);
+}
+
+/* connect ahead to the hosts of the highlighted item and the following
+ * links that are neither cached nor being prefetched */
+static void
+preconnectnearby(void)
+{
+	Item *item;
+	Dir *dir;
+	size_t i, n;
+	char t;
+
+	if (!poolmax || tracereplaying() || !curpage ||
+	    curpage == &searchresults || !(dir = curpage->dat))
+		return;
+
+	for (i = dir->curline, n = 0;
+	     i < dir->nitems && n <= poollinks; ++i) {
+		item = diritem(dir, i);
+		switch (t = item->redtype ? item->redtype : item->type) {
+		case '\0': /* malformed line */
+		case 'i':
+			continue;
+		case '3':
+		case '8':
+		case 'T':
+			break;
+		case 'h':
+			if (!strncmp(item->selector, "URL:", 4))
+				break;
+			/* FALLTHROUGH */
+		default:
+			if (!item->raw && !item->link && *item->host &&
+			    !(prefetches && prefetching(item)))
+				preconnect(item->host, item->port);
+		}
+		++n;
+	}
+}
+
+/* prefetch the highlighted item and the following links */
+static void
+prefetchidle(void)
+{
+	Item *item;
+	Dir *dir;
+	Fetch **fp;
+	Plus *p;
+	size_t i, n;
+	char t;
+
+	if (!prefetchmax || !curpage || curpage == &searchresults ||
+	    !(dir = curpage->dat))
+		return;
+	if (!prefetches)
+		prefetches = xcalloc(prefetchmax * sizeof(*prefetches));
+
+	for (i = dir->curline, n = 0;
+	     i < dir->nitems && n <= prefetchlinks; ++i) {
+		item = diritem(dir, i);
+		if ((t = item->redtype ? item->redtype : item->type) == 'i')
+			continue;
+		++n;
+		if ((t != '0' && t != '1') || item->raw || item->link ||
+		    !*item->host || (item->flags & ITEMNOPREFETCH) ||
+		    prefetching(item))
+			continue;
+		/* known to be too large, don't even start */
+		if ((p = itemplus(item)) && p->size > prefetchsize)
+			continue;
+		for (fp = prefetches; fp < prefetches + prefetchmax && *fp; ++fp)
+			;
+		if (fp == prefetches + prefetchmax)
+			return;
+		*fp = fetchstart(item->host, item->port, item->selector,
+		                 prefetchsize, prefetched, item);
+		/* keeps lazy dirs from dropping the item */
+		if (!item->entry)
+			item->entry = curpage;
+	}
+}
+
+static int
+sameitem(Item *a, Item *b)
+{
+	/* malformed lines only have their text */
+	return a->type == b->type && !strcmp(a->username, b->username) &&
+	       (!a->type || (!strcmp(a->selector, b->selector) &&
+	       !strcmp(a->host, b->host) && !strcmp(a->port, b->port)));
+}
+
+/* line of dir showing item, searching at most far lines around n */
+static size_t
+findline(Dir *dir, Item *item, size_t n, size_t far)
+{
+	size_t i;
+
+	for (i = 0; i < far; ++i) {
+		if (n + i < dir->nitems && sameitem(item, diritem(dir, n + i)))
+			return n + i;
+		if (i && i <= n && n - i < dir->nitems &&
+		    sameitem(item, diritem(dir, n - i)))
+			return n - i;
+	}
+
+	return dir->nitems;
+}
+
+/* line of dir showing the item at line n of old, searching around n */
+static size_t
+anchorline(Dir *old, Dir *dir, size_t n)
+{
+	size_t i, far;
+
+	if (n < old->nitems) {
+		far = (old->nitems > dir->nitems) ? old->nitems : dir->nitems;
+		if ((i = findline(dir, diritem(old, n), n, far)) < dir->nitems)
+			return i;
+	}
+
+	return (n < dir->nitems) ? n : dir->nitems ? dir->nitems - 1 : 0;
+}
+
+/* point what referred to item from at to */
+static void
+reentry(Dir *dir, Item *from, Item *to)
+{
+	size_t i;
+
+	for (i = 0; dir && i < dir->nitems; ++i) {
+		if (dir->linestart && !dir->chunks[i / LAZYCHUNK])
+			i += LAZYCHUNK-1;
+		else if (dir->items[i].entry == from)
+			dir->items[i].entry = to;
+		else if (dir->items[i].link == from)
+			dir->items[i].link = to;
+	}
+}
+
+/* hand what was fetched from the lines of odir over to the same lines
+ * of dir, so a refreshed page keeps the pages, downloads and searches
+ * below it rather than fetching and indexing them again */
+static void
+carryover(Dir *odir, Dir *dir)
+{
+	Item **moves = NULL, *a, *b;
+	Searched *s;
+	size_t i, j, n = 0;
+	long shift = (long)dir->curline - (long)odir->curline;
+
+	for (i = 0; i < odir->nitems; ++i) {
+		if (odir->linestart && !odir->chunks[i / LAZYCHUNK]) {
+			i += LAZYCHUNK-1;
+			continue;
+		}
+		a = &odir->items[i];
+		if (!a->raw && !a->tag)
+			continue;
+		j = ((long)i + shift < 0) ? 0 : i + shift;
+		if ((j = findline(dir, a, j, LAZYCHUNK)) == dir->nitems ||
+		    (b = &dir->items[j])->raw || b->tag)
+			continue;
 
-	if (item->raw && !*item->raw) {
-		diag("Empty response from server");
-		clear(&item->raw);
+		prefetchcancel(a, 0);
+		b->raw = a->raw;
+		b->tag = a->tag;
+		b->dat = a->dat;
+		b->entry = a->entry;
+		b->flags |= a->flags & ITEMPREFETCHED;
+		a->raw = a->tag = NULL;
+		a->dat = NULL;
+
+		reentry(b->dat, a, b);
+		reentry(searchresults.dat, a, b);
+		for (s = searched; s; s = s->next) {
+			if (s->item == a) {
+				s->item = b;
+				reentry(s->result.dat, a, b);
+			}
+		}
+		if (searchresults.entry == a)
+			searchresults.entry = b;
+		if (statsitem.entry == a)
+			statsitem.entry = b;
+
+		moves = xreallocarray(moves, n+1, 2 * sizeof(Item *));
+		moves[2*n] = a;
+		moves[2*n+1] = b;
+		++n;
 	}
 
-	return (item->raw != NULL);
+	/* the old lines are in order, so are the moves */
+	idxmove(moves, n);
+	free(moves);
 }
 
+/* swap the refetched raw of a page in for its cached copy */
 static void
-plumb(char *url)
+swapin(Item *item, char *raw)
 {
-	switch (fork()) {
-	case -1:
-		diag("Couldn't fork.");
+	Item old;
+	Dir *dir, *odir = item->dat;
+	void (*d)(char *, ...) = diag;
+	size_t off;
+
+	diag = quietdiag;
+	dir = molddiritem(raw);
+	diag = d;
+	if (!dir) {
+		old.raw = raw;
+		freeraw(&old);
+		uirefresh(item, NULL);
 		return;
-	case 0:
-		parent = 0;
-		dup2(devnullfd, 1);
-		dup2(devnullfd, 2);
-		if (execlp(plumber, plumber, url, NULL) < 0)
-			_exit(1);
 	}
 
-	diag("Plumbed \"%s\"", url);
+	dir->curline = anchorline(odir, dir, odir->curline);
+	if (odir->curline >= odir->printoff) {
+		off = odir->curline - odir->printoff;
+		dir->printoff = (dir->curline > off) ? dir->curline - off : 0;
+	} else {
+		dir->printoff = anchorline(odir, dir, odir->printoff);
+	}
+	carryover(odir, dir);
+
+	idxdrop(item);
+	old = *item;
+	item->raw = raw;
+	item->dat = dir;
+	uirefresh(item, odir);
+
+	old.tag = NULL;
+	clearitem(&old);
+	idxadd(item);
+	if (*item->host)
+		archiveitem(item);
+	resolveahead(dir);
+	if (item->type != '7')
+		plusfetch(item);
 }
 
 static void
-plumbitem(Item *item)
+revalidated(Fetch *f)
 {
-	char *file, *path, *tag;
-	mode_t mode = S_IRUSR|S_IWUSR|S_IRGRP;
-	int dest, plumbitem;
-
-	if (file = strrchr(item->selector, '/'))
-		++file;
-	else
-		file = item->selector;
-
-	path = uiprompt("Download %s to (^D cancel, <empty> plumb): ",
-	                file);
-	if (!path)
+	Item *item = f->arg;
+	char *key;
+
+	refetch = NULL;
+	if (!f->ok || !f->len) {
+		uirefresh(item, NULL);
+		diag("Couldn't refresh %s:%s/%c%s", item->host, item->port,
+		     item->type, item->selector);
 		return;
-
-	if ((tag = item->tag) && access(tag, R_OK) < 0) {
-		clear(&item->tag);
-		tag = NULL;
 	}
-
-	plumbitem = path[0] ? 0 : 1;
-
-	if (!path[0]) {
-		clear(&path);
-		if (!tag) {
-			if (asprintf(&path, "%s/%s", tmpdir, file) < 0)
-				die("Can't generate tmpdir path: %s/%s: %s",
-				    tmpdir, file, strerror(errno));
-		}
+	if (sharedcache) {
+		key = sharedkey(item, (item->type == '7' && item->tag) ?
+		                      item->tag : item->selector);
+		sharedput(key, f->buf, f->len);
+		free(key);
 	}
 
-	if (path && (!tag || strcmp(tag, path))) {
-		if ((dest = open(path, O_WRONLY|O_CREAT|O_EXCL, mode)) < 0) {
-			diag("Can't open destination file %s: %s",
-			     path, strerror(errno));
-			errno = 0;
-			goto cleanup;
-		}
-		if (!download(item, dest) || tag)
-			goto cleanup;
+	/* unchanged, keep the page and all that was fetched from it */
+	if (rawsum(f->buf) == ((Dir *)item->dat)->sum) {
+		uirefresh(item, NULL);
+		return;
 	}
 
-	if (!tag)
-		item->tag = path;
-
-	if (plumbitem)
-		plumb(item->tag);
-
-	return;
-cleanup:
-	free(path);
-	return;
+	swapin(item, f->buf);
+	f->buf = NULL;
 }
 
-static int
-dig(Item *entry, Item *item)
+/* a refetch is only swapped in while its page is viewed */
+static void
+revalidatecancel(void)
 {
-	char *plumburi = NULL;
-	int t;
-
-	if (item->raw) /* already in cache */
-		return item->type;
-	if (!item->entry)
-		item->entry = entry ? entry : item;
-
-	t = item->redtype ? item->redtype : item->type;
-	switch (t) {
-	case 'h': /* fallthrough */
-		if (!strncmp(item->selector, "URL:", 4)) {
-			plumb(item->selector+4);
-			return 0;
-		}
-	case '0':
-		if (!fetchitem(item))
-			return 0;
-		break;
-	case '1':
-	case '7':
-		if (!fetchitem(item) || !(item->dat = molddiritem(item->raw)))
-			return 0;
-		break;
-	case '4':
-	case '5':
-	case '6':
-	case '9':
-		downloaditem(item);
-		return 0;
-	case '8':
-		if (asprintf(&plumburi, "telnet://%s%s%s:%s",
-		             item->selector, item->selector ? "@" : "",
-		             item->host, item->port) < 0)
-			return 0;
-		plumb(plumburi);
-		free(plumburi);
-		return 0;
-	case 'T':
-		if (asprintf(&plumburi, "tn3270://%s%s%s:%s",
-		             item->selector, item->selector ? "@" : "",
-		             item->host, item->port) < 0)
-			return 0;
-		plumb(plumburi);
-		free(plumburi);
-		return 0;
-	default:
-		if (t >= '0' && t <= 'Z') {
-			diag("Type %c (%s) not supported", t, typedisplay(t));
-			return 0;
-		}
-	case 'g':
-	case 'I':
-		plumbitem(item);
-	case 'i':
-		return 0;
+	if (refetch) {
+		fetchcancel(refetch);
+		refetch = NULL;
 	}
-
-	return item->type;
 }
 
-static char *
-searchselector(Item *item)
+/* refetch a page in the background, its cached copy staying in view
+ * until the new one is swapped in */
+void
+revalidate(Item *entry)
 {
-	char *pexp, *exp, *tag, *selector = item->selector;
-	size_t n = strlen(selector);
-
-	if ((tag = item->tag) && !strncmp(tag, selector, n))
-		pexp = tag + n+1;
-	else
-		pexp = "";
+	const char *sel;
+	char *path, *raw;
+	size_t len;
 
-	if (!(exp = uiprompt("Enter search string (^D cancel) [%s]: ", pexp)))
-		return NULL;
+	if (entry == &searchresults || entry == &statsitem ||
+	    entry->type == '2' || !entry->raw || !entry->dat)
+		return;
 
-	if (exp[0] && strcmp(exp, pexp)) {
-		n += strlen(exp) + 2;
-		tag = xmalloc(n);
-		snprintf(tag, n, "%s\t%s", selector, exp);
+	revalidatecancel();
+	/* local pages are read again at once */
+	if ((path = localpath(entry))) {
+		if ((raw = loadlocal(path, &len)))
+			swapin(entry, raw);
+		return;
 	}
-
-	free(exp);
-	return tag;
+	sel = (entry->type == '7' && entry->tag) ?
+	      entry->tag : entry->selector;
+	refetch = fetchstart(entry->host, entry->port, sel, 0,
+	                     revalidated, entry);
+	refetch->background = 0;
 }
 
-static int
-searchitem(Item *entry, Item *item)
+int
+revalidating(Item *entry)
 {
-	char *sel, *selector;
-
-	if (!(sel = searchselector(item)))
-		return 0;
+	return refetch && refetch->arg == entry;
+}
 
-	if (sel != item->tag)
-		clearitem(item);
-	if (!item->dat) {
-		selector = item->selector;
-		item->selector = item->tag = sel;
-		dig(entry, item);
-		item->selector = selector;
+void
+waitinput(void)
+{
+	long long rest = now() + prefetchdelay;
+	int busy, t, due, connected = 0;
+
+	for (;;) {
+		busy = idxstep() | uiidle();
+		if ((t = rest - now()) <= 0) {
+			prefetchidle();
+			if (!connected++)
+				preconnectnearby();
+		}
+		/* replaying, the keys come from the trace instead */
+		if ((due = tracedue()) >= 0) {
+			if (!due)
+				return;
+			netwait(-1, busy ? 0 : (t > 0 && t < due) ? t : due);
+		} else if (netwait(0, busy ? 0 : (t > 0) ? t : -1)) {
+			return;
+		}
 	}
-	return (item->dat != NULL);
 }
 
 static void
@@ -810,6 +2910,7 @@ printout(Item *hole)
 			fputs(hole->raw, stdout);
 		return;
 	case '1':
+	case '2':
 	case '7':
 		if (dig(hole, hole))
 			printdir(hole);
@@ -825,8 +2926,7 @@ printout(Item *hole)
 	case '9':
 	case 'g':
 	case 'I':
-		download(hole, 1);
-	case '2':
+		download(hole, 1, NULL);
 	case '3':
 	case '8':
 	case 'T':
@@ -840,6 +2940,9 @@ delve(Item *hole)
 	Item *entry = NULL;
 
 	while (hole) {
+		if (hole->link)
+			hole = hole->link;
+
 		switch (hole->redtype ? hole->redtype : hole->type) {
 		case 'h':
 		case '0':
@@ -851,6 +2954,7 @@ delve(Item *hole)
 			if (dig(entry, hole) && hole->dat)
 				entry = hole;
 			break;
+		case '2':
 		case '7':
 			if (searchitem(entry, hole))
 				entry = hole;
@@ -861,7 +2965,7 @@ delve(Item *hole)
 			break;
 		case '4':
 		case '5':
-		case '6': /* TODO decode? */
+		case '6':
 		case '8':
 		case '9':
 		case 'g':
@@ -876,21 +2980,49 @@ delve(Item *hole)
 			return;
 
 		do {
+			curpage = entry;
 			uidisplay(entry);
 			hole = uiselectitem(entry);
+			revalidatecancel();
 		} while (hole == entry);
 	}
 }
 
+/* the entry of a local file or directory tree */
+static Item *
+moldlocal(const char *path)
+{
+	struct stat st;
+	Item *entry;
+
+	if (!(localtop = realpath(path, NULL)) || stat(localtop, &st) < 0)
+		die("Can't open %s: %s", path, strerror(errno));
+	toplen = strlen(localtop);
+	if (!S_ISDIR(st.st_mode))
+		toplen = strrchr(localtop, '/') - localtop;
+
+	entry = xcalloc(sizeof(Item));
+	entry->type = localtype(localtop, S_ISDIR(st.st_mode));
+	entry->username = entry->selector = localtop;
+	entry->host = entry->port = filehost;
+	entry->entry = entry;
+
+	return entry;
+}
+
 static Item *
 moldentry(char *url)
 {
 	Item *entry;
 	char *p, *host = url, *port = "70", *gopherpath = "1";
-	int parsed, ipv6;
+	int parsed, ipv6, tls = 0;
 
 	if (p = strstr(url, "://")) {
-		if (strncmp(url, "gopher", p - url))
+		if (p - url == 4 && !strncmp(url, "file", 4))
+			return moldlocal(p + 3);
+		if (p - url == 7 && !strncmp(url, "gophers", 7))
+			tls = 1;
+		else if (strncmp(url, "gopher", p - url))
 			die("Protocol not supported: %.*s", p - url, url);
 		host = p + 3;
 	}
@@ -932,7 +3064,7 @@ moldentry(char *url)
 	entry = xcalloc(sizeof(Item));
 	entry->type = gopherpath[0];
 	entry->username = entry->selector = ++gopherpath;
-	if (entry->type == '7') {
+	if (entry->type == '7' || entry->type == '2') {
 		if (p = strstr(gopherpath, "%09")) {
 			memmove(p+1, p+3, strlen(p+3)+1);
 			*p = '\t';
@@ -945,36 +3077,307 @@ moldentry(char *url)
 	entry->host = host;
 	entry->port = port;
 	entry->entry = entry;
+	if (tls)
+		tlsuse(host, port);
 
 	return entry;
 }
 
+static void
+collectsnap(Snapitem **v, size_t *n, Item *item, uint32_t parent, size_t slot)
+{
+	Dir *dir;
+	Item *it;
+	uint32_t self = *n;
+	size_t i;
+
+	*v = xreallocarray(*v, *n + 1, sizeof(Snapitem));
+	(*v)[*n].item = item;
+	(*v)[*n].parent = parent;
+	(*v)[(*n)++].slot = slot;
+
+	if (!(dir = item->dat))
+		return;
+	for (i = 0; i < dir->nitems; ++i) {
+		if (dir->linestart && !dir->chunks[i / LAZYCHUNK]) {
+			i += LAZYCHUNK-1;
+			continue;
+		}
+		it = &dir->items[i];
+		if (it->dat || (it->raw && snapshotbodies))
+			collectsnap(v, n, it, self, i);
+	}
+}
+
+/* write the menu back in its wire format, its raw buffer being split */
+static void
+writesnapdir(FILE *fp, Dir *dir)
+{
+	Item *item;
+	char *p;
+	size_t i;
+
+	for (i = 0; i < dir->nitems; ++i) {
+		if (dir->linestart && !dir->parsed[i]) {
+			p = dir->linestart[i];
+			fwrite(p, 1, strchr(p, '\n') + 1 - p, fp);
+			continue;
+		}
+		item = diritem(dir, i);
+		if (!item->type)
+			fprintf(fp, "%s\n", item->username);
+		else
+			fprintf(fp, "%c%s\t%s\t%s\t%s\r\n", item->type,
+			        item->username, item->selector, item->host,
+			        item->port);
+	}
+	fputc('\0', fp);
+}
+
+static uint64_t
+writesnapstr(FILE *fp, const char *s, uint64_t *off)
+{
+	uint64_t o = *off;
+	size_t n = strlen(s) + 1;
+
+	fwrite(s, 1, n, fp);
+	*off += n;
+
+	return o;
+}
+
+static void
+savesnapshot(const char *file)
+{
+	Snaphdr hdr;
+	Snapnode *nodes;
+	Snapitem *v = NULL;
+	Item *item, *cur;
+	FILE *fp;
+	char *tmp, *url;
+	uint64_t off = 0;
+	size_t i, j, n = 0;
+	long start;
+
+	if (!mainentry)
+		return;
+	if (asprintf(&tmp, "%s.tmp", file) < 0)
+		die("asprintf: %s", strerror(errno));
+	if (!(fp = fopen(tmp, "w"))) {
+		fprintf(stderr, "Can't write snapshot %s: %s\n",
+		        tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+
+	collectsnap(&v, &n, mainentry, -1, 0);
+	nodes = xcalloc(n * sizeof(Snapnode));
+	start = sizeof(hdr) + n * sizeof(Snapnode);
+	fseek(fp, start, SEEK_SET);
+
+	cur = curpage;
+	if (cur == &searchresults)
+		cur = searchresults.entry;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPMAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPVERSION;
+	hdr.nnodes = n;
+	item = mainentry;
+	if (item->host == filehost) {
+		if (asprintf(&url, "file://%s", item->selector) < 0)
+			die("asprintf: %s", strerror(errno));
+	} else if (asprintf(&url, strchr(item->host, ':') ?
+	             "gopher%s://[%s]:%s/%c%s" : "gopher%s://%s:%s/%c%s",
+	             tlswanted(item->host, item->port) ? "s" : "",
+	             item->host, item->port, item->type, item->selector) < 0)
+		die("asprintf: %s", strerror(errno));
+	hdr.url = writesnapstr(fp, url, &off);
+	free(url);
+
+	for (i = 0; i < n; ++i) {
+		item = v[i].item;
+		nodes[i].parent = v[i].parent;
+		nodes[i].slot = v[i].slot;
+		nodes[i].entry = v[i].parent;
+		for (j = 0; j < n; ++j) {
+			if (v[j].item == item->entry)
+				nodes[i].entry = j;
+			if (v[j].item == cur)
+				hdr.current = j;
+		}
+		nodes[i].tag = item->tag &&
+		               (item->type == '7' || item->type == '2') ?
+		               writesnapstr(fp, item->tag, &off) : SNAPNONE;
+		nodes[i].raw = SNAPNONE;
+		if (item->dat) {
+			nodes[i].isdir = 1;
+			nodes[i].curline = ((Dir *)item->dat)->curline;
+			nodes[i].printoff = ((Dir *)item->dat)->printoff;
+			nodes[i].raw = off;
+			writesnapdir(fp, item->dat);
+			off = ftell(fp) - start;
+		} else if (item->raw) {
+			nodes[i].raw = writesnapstr(fp, item->raw, &off);
+		}
+	}
+
+	hdr.size = start + off;
+	rewind(fp);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(nodes, sizeof(Snapnode), n, fp);
+	if (ferror(fp) | fclose(fp) || rename(tmp, file) < 0) {
+		fprintf(stderr, "Can't write snapshot %s: %s\n",
+		        file, strerror(errno));
+		unlink(tmp);
+	}
+
+	free(tmp);
+	free(nodes);
+	free(v);
+}
+
+/* map a snapshot back, return the page to open or NULL */
+static Item *
+loadsnapshot(const char *file)
+{
+	struct stat st;
+	Snaphdr *hdr;
+	Snapnode *nodes, *node;
+	Item **items, *item, *parentitem, *cur = NULL;
+	Dir *dir;
+	Map *m;
+	char *addr, *data;
+	size_t i, datasize;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	if (st.st_size < sizeof(Snaphdr)) {
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	m = xmalloc(sizeof(Map));
+	m->addr = addr;
+	m->len = st.st_size;
+	m->path = NULL;
+	m->shared = 1;
+	m->next = maps;
+	maps = m;
+
+	hdr = (Snaphdr *)addr;
+	nodes = (Snapnode *)(addr + sizeof(Snaphdr));
+	if (memcmp(hdr->magic, SNAPMAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != SNAPVERSION || hdr->size != st.st_size ||
+	    !hdr->nnodes || hdr->current >= hdr->nnodes ||
+	    hdr->nnodes > (st.st_size - sizeof(Snaphdr)) / sizeof(Snapnode))
+		return NULL;
+	data = (char *)(nodes + hdr->nnodes);
+	datasize = addr + st.st_size - data;
+	if (hdr->url >= datasize || addr[st.st_size-1] != '\0')
+		return NULL;
+
+	mainurl = xstrdup(data + hdr->url);
+	mainentry = moldentry(mainurl);
+	items = xcalloc(hdr->nnodes * sizeof(Item *));
+
+	for (i = 0; i < hdr->nnodes; ++i) {
+		node = &nodes[i];
+		if (i == 0) {
+			item = mainentry;
+		} else if (node->parent < i &&
+		           (parentitem = items[node->parent]) &&
+		           (dir = parentitem->dat) && node->slot < dir->nitems) {
+			item = diritem(dir, node->slot);
+		} else {
+			continue;
+		}
+		if (node->tag != SNAPNONE && node->tag < datasize)
+			item->tag = xstrdup(data + node->tag);
+		if (node->raw != SNAPNONE && node->raw < datasize)
+			item->raw = data + node->raw;
+		if (node->isdir && item->raw) {
+			if (!(item->dat = molddiritem(item->raw)))
+				continue;
+			dir = item->dat;
+			if (node->curline < dir->nitems)
+				dir->curline = node->curline;
+			if (node->printoff <= dir->curline)
+				dir->printoff = node->printoff;
+		}
+		item->entry = (node->entry < i && items[node->entry]) ?
+		              items[node->entry] : (i ? parentitem : item);
+		items[i] = item;
+	}
+
+	for (i = hdr->current; !cur; i = nodes[i].parent) {
+		if (items[i] && items[i]->dat)
+			cur = items[i];
+		if (i == 0)
+			break;
+	}
+	free(items);
+
+	return cur ? cur : mainentry;
+}
+
 static void
 cleanup(void)
 {
+	Map *m;
+	const char *err;
+
+	if (snapfile)
+		savesnapshot(snapfile);
+	err = archivesync();
+	idxfree();
+	csoclose();
+	tlssave();
+	traceclose();
+	clearitem(&searchresults);
+	clear(&statsitem.raw);
 	clearitem(mainentry);
-	if (parent)
-		rmdir(tmpdir);
+	while ((m = maps)) {
+		maps = m->next;
+		munmap(m->addr, m->len);
+		free(m->path);
+		free(m);
+	}
+	rmdir(tmpdir);
 	free(mainentry);
 	free(mainurl);
+	free(localtop);
 	if (interactive)
 		uicleanup();
+	if (err)
+		fprintf(stderr, "Can't archive: %s\n", err);
 }
 
 static void
 setup(void)
 {
 	struct sigaction sa;
+	const char *tty;
 	int fd;
 
 	setlocale(LC_CTYPE, "");
 	setenv("PAGER", "more", 0);
 	atexit(cleanup);
-	/* reopen stdin in case we're reading from a pipe */
-	if ((fd = open("/dev/tty", O_RDONLY)) < 0)
-		die("open: /dev/tty: %s", strerror(errno));
+	/* reopen stdin in case we're reading from a pipe, a replay
+	 * takes the keys from its trace */
+	tty = tracereplaying() ? "/dev/null" : "/dev/tty";
+	if ((fd = open(tty, O_RDONLY)) < 0)
+		die("open: %s: %s", tty, strerror(errno));
 	if (dup2(fd, 0) < 0)
-		die("dup2: /dev/tty, stdin: %s", strerror(errno));
+		die("dup2: %s, stdin: %s", tty, strerror(errno));
 	close(fd);
 	if ((devnullfd = open("/dev/null", O_WRONLY)) < 0)
 		die("open: /dev/null: %s", strerror(errno));
@@ -986,9 +3389,15 @@ setup(void)
 	sigaction(SIGHUP, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 
+	srandom(now() ^ getpid());
+
 	if (!mkdtemp(tmpdir))
 		die("mkdir: %s: %s", tmpdir, strerror(errno));
-	if(interactive = isatty(1)) {
+	/* a replay paints its frames to a file, measuring them */
+	if (tracereplaying())
+		tracescreen(tmpdir);
+	if(interactive = isatty(1) || tracereplaying()) {
+		setvbuf(stdin, NULL, _IONBF, 0);
 		uisetup();
 		sa.sa_handler = uisigwinch;
 		sigaction(SIGWINCH, &sa, NULL);
@@ -998,21 +3407,81 @@ setup(void)
 int
 main(int argc, char *argv[])
 {
-	if (argc != 2)
+	Item *hole = NULL;
+	char *restorefile = NULL, *proxyaddr = NULL, *query = NULL;
+	char *tracefile = NULL, *replayfile = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:p:r:t:w:T:")) != -1) {
+		switch (c) {
+		case 'f':
+			query = optarg;
+			break;
+		case 'p':
+			proxyaddr = optarg;
+			break;
+		case 'r':
+			restorefile = optarg;
+			break;
+		case 't':
+			tracefile = optarg;
+			break;
+		case 'w':
+			snapfile = optarg;
+			break;
+		case 'T':
+			replayfile = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (replayfile) {
+		if (argc || query || proxyaddr || restorefile || tracefile)
+			usage();
+	} else if (argc > 1 || (query && (argc || proxyaddr || restorefile)) ||
+	    (!argc && !query && (!restorefile || proxyaddr)) ||
+	    (tracefile && (query || proxyaddr || restorefile))) {
 		usage();
+	}
 
-	setup();
-
-	mainurl = xstrdup(argv[1]);
-
-	mainentry = moldentry(mainurl);
-	if (interactive) {
-		diag = uistatus;
-		delve(mainentry);
-	} else {
+	if (proxyaddr) {
 		diag = stddiag;
-		printout(mainentry);
+		mainurl = xstrdup(argv[0]);
+		hole = moldentry(mainurl);
+		if (localtop)
+			die("Can't proxy local files");
+		proxy(proxyaddr, hole);
+	}
+
+	if (replayfile)
+		mainurl = tracereplay(replayfile);
+	else if (tracefile)
+		tracerecord(tracefile, argv[0]);
+	setup();
+	diag = interactive ? uistatus : stddiag;
+	if (sharedcache && sharedopen(sharedcache) < 0)
+		diag("Can't use shared cache %s: %s",
+		     sharedcache, strerror(errno));
+
+	if (restorefile && !(hole = loadsnapshot(restorefile)) && !argc)
+		die("Can't restore snapshot %s", restorefile);
+	if (query) {
+		mainurl = xstrdup(query);
+		hole = mainentry = archivesearch(mainurl);
 	}
+	if (!hole) {
+		if (!mainurl)
+			mainurl = xstrdup(argv[0]);
+		hole = mainentry = moldentry(mainurl);
+	}
+
+	if (interactive)
+		delve(hole);
+	else
+		printout(hole);
 
 	exit(0);
 }
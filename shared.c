@@ -0,0 +1,401 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+#include "config.h"
+
+#define SHMAGIC	"SACCSHM1"
+#define PROBES	16	/* slots searched for a key */
+#define SPINS	1000	/* reads of a slot being written before giving up */
+#define ALIGN(n)	(((n) + 7) & ~(uint64_t)7)
+
+#define LOAD(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/*
+ * The file holds a header, a table of slots and a data region where
+ * records are appended.  Readers don't lock: a slot is written between
+ * two increments of its seq, and compaction, which moves the records,
+ * between two increments of gen, readers retrying or giving up when
+ * either is odd or changed under them.  Writers append under a shared
+ * flock(), compaction takes it exclusively, so a writer dying in the
+ * middle of a record only leaves garbage the next compaction drops.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t nslots;
+	uint32_t pad;
+	uint64_t size;	/* bytes of the data region */
+	uint64_t tail;	/* next record, past size when full */
+	uint64_t gen;	/* odd while compacting */
+} Shmhead;
+
+typedef struct {
+	uint32_t seq;	/* odd while written */
+	uint32_t pad;
+	uint64_t hash;
+	uint64_t off;	/* of the record in the data region */
+	uint64_t len;	/* of the record, 0 for an empty slot */
+	int64_t stamp;	/* time the item was fetched */
+} Shmslot;
+
+typedef struct {
+	uint32_t keylen;
+	uint32_t pad;
+	uint64_t len;
+	/* key, then data */
+} Shmrec;
+
+static int shmfd = -1;
+static Shmhead *head;
+static Shmslot *slots;
+static char *data;
+static size_t maplen;
+static unsigned long long nsharedhits, nsharedstale, nsharedputs;
+static unsigned long long nsharedcompactions;
+
+static uint64_t
+hashkey(const char *key)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; *key; ++key) {
+		h ^= (unsigned char)*key;
+		h *= 1099511628211ULL;
+	}
+
+	return h ? h : 1;
+}
+
+/* read a slot consistently, 0 if it kept being written */
+static int
+slotread(Shmslot *s, Shmslot *copy)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < SPINS; ++i) {
+		if ((seq = LOAD(&s->seq)) & 1)
+			continue;
+		copy->hash = __atomic_load_n(&s->hash, __ATOMIC_RELAXED);
+		copy->off = __atomic_load_n(&s->off, __ATOMIC_RELAXED);
+		copy->len = __atomic_load_n(&s->len, __ATOMIC_RELAXED);
+		copy->stamp = __atomic_load_n(&s->stamp, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (LOAD(&s->seq) == seq)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* write a slot, 0 if another writer kept it */
+static int
+slotwrite(Shmslot *s, uint64_t hash, uint64_t off, uint64_t len,
+          int64_t stamp)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0;; ++i) {
+		if (i == SPINS)
+			return 0;
+		if ((seq = LOAD(&s->seq)) & 1)
+			continue;
+		if (__atomic_compare_exchange_n(&s->seq, &seq, seq+1, 0,
+		    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+
+	__atomic_store_n(&s->hash, hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->off, off, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->len, len, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->stamp, stamp, __ATOMIC_RELAXED);
+	STORE(&s->seq, seq+2);
+
+	return 1;
+}
+
+static Shmrec *
+record(uint64_t off, uint64_t len)
+{
+	Shmrec *r;
+
+	if (off > head->size || len > head->size - off || len < sizeof(*r))
+		return NULL;
+	r = (Shmrec *)(data + off);
+	if (r->keylen > len - sizeof(*r) ||
+	    r->len != len - sizeof(*r) - r->keylen)
+		return NULL;
+
+	return r;
+}
+
+static int
+stampcmp(const void *a, const void *b)
+{
+	const Shmslot *s = a, *t = b;
+
+	return (s->stamp < t->stamp) - (s->stamp > t->stamp);
+}
+
+/* pack the fresh records at the start of the data region, newest first
+ * until half of it is used, and rebuild the table */
+static void
+compact(void)
+{
+	Shmslot *live, *s;
+	char *buf;
+	uint64_t used = 0, i, j, n = 0, gen;
+	int64_t t = time(NULL);
+
+	live = xreallocarray(NULL, head->nslots, sizeof(*live));
+	for (i = 0; i < head->nslots; ++i) {
+		s = &slots[i];
+		/* odd seqs belong to dead writers, we hold the lock */
+		if (!(s->seq & 1) && s->len && t - s->stamp < sharedttl &&
+		    record(s->off, s->len))
+			live[n++] = *s;
+	}
+	qsort(live, n, sizeof(*live), stampcmp);
+
+	buf = xmalloc(head->size / 2);
+	for (i = 0; i < n; ++i) {
+		if (used + ALIGN(live[i].len) > head->size / 2)
+			break;
+		memcpy(buf + used, data + live[i].off, live[i].len);
+		live[i].off = used;
+		used += ALIGN(live[i].len);
+	}
+	n = i;
+
+	/* set rather than bumped, a compaction that died left it odd */
+	gen = LOAD(&head->gen) | 1;
+	STORE(&head->gen, gen);
+	memcpy(data, buf, used);
+	memset(slots, 0, head->nslots * sizeof(*slots));
+	for (i = 0; i < n; ++i) {
+		for (j = 0; j < PROBES; ++j) {
+			s = &slots[(live[i].hash + j) % head->nslots];
+			if (!s->len) {
+				*s = live[i];
+				s->seq = 0;
+				break;
+			}
+		}
+	}
+	head->tail = used;
+	STORE(&head->gen, gen + 1);
+	++nsharedcompactions;
+
+	free(buf);
+	free(live);
+}
+
+/* map the cache file at path, creating it, -1 with errno on failure */
+int
+sharedopen(const char *path)
+{
+	struct stat st;
+	size_t nslots, i;
+	int err, dirty;
+
+	if ((shmfd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) < 0)
+		return -1;
+	flock(shmfd, LOCK_EX);
+
+	nslots = sharedsize / 4096 ? sharedsize / 4096 : 1;
+	maplen = sizeof(Shmhead) + nslots * sizeof(Shmslot) + sharedsize;
+	if (fstat(shmfd, &st) < 0 ||
+	    (!st.st_size && ftruncate(shmfd, maplen) < 0))
+		goto err;
+	if (st.st_size)
+		maplen = st.st_size;
+	if ((head = mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_SHARED,
+	                 shmfd, 0)) == MAP_FAILED) {
+		head = NULL;
+		goto err;
+	}
+
+	if (!st.st_size) {
+		head->nslots = nslots;
+		head->size = sharedsize;
+		memcpy(head->magic, SHMAGIC, sizeof(head->magic));
+	} else if (memcmp(head->magic, SHMAGIC, sizeof(head->magic)) ||
+	           sizeof(Shmhead) + head->nslots * sizeof(Shmslot) +
+	           head->size != maplen) {
+		errno = EINVAL;
+		goto err;
+	}
+	slots = (Shmslot *)(head + 1);
+	data = (char *)(slots + head->nslots);
+
+	/* no one else writes now: a compaction or writer that died on the
+	 * way left gen or slots odd, drop what they were doing and pack
+	 * what is left */
+	for (i = 0, dirty = LOAD(&head->gen) & 1; i < head->nslots; ++i) {
+		if (slots[i].seq & 1) {
+			slots[i].len = 0;
+			STORE(&slots[i].seq, slots[i].seq + 1);
+			dirty = 1;
+		}
+	}
+	if (dirty)
+		compact();
+
+	flock(shmfd, LOCK_UN);
+	return 0;
+err:
+	err = errno;
+	if (head)
+		munmap(head, maplen);
+	head = NULL;
+	close(shmfd);
+	shmfd = -1;
+	errno = err;
+	return -1;
+}
+
+/* a copy of the response cached for key if it is fresh enough */
+char *
+sharedget(const char *key, size_t *len)
+{
+	Shmslot s;
+	Shmrec *r;
+	uint64_t h, gen;
+	size_t i, n, keylen;
+	char *copy;
+
+	if (!head)
+		return NULL;
+
+	h = hashkey(key);
+	keylen = strlen(key);
+	for (i = 0; i < PROBES; ++i) {
+		if (!slotread(&slots[(h + i) % head->nslots], &s))
+			continue;
+		if (!s.len)
+			return NULL;
+		if (s.hash != h)
+			continue;
+
+		if ((gen = LOAD(&head->gen)) & 1 ||
+		    !(r = record(s.off, s.len)) || r->keylen != keylen ||
+		    memcmp(r + 1, key, keylen))
+			continue;
+		/* trust our copy of the slot, the record may be moving */
+		n = s.len - sizeof(*r) - keylen;
+		copy = xmalloc(n + 1);
+		memcpy(copy, (char *)(r + 1) + keylen, n);
+		copy[n] = '\0';
+		*len = n;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (LOAD(&head->gen) != gen) {
+			free(copy);
+			return NULL;
+		}
+		if (time(NULL) - s.stamp >= sharedttl) {
+			++nsharedstale;
+			free(copy);
+			return NULL;
+		}
+		++nsharedhits;
+		return copy;
+	}
+
+	return NULL;
+}
+
+/* reserve len bytes of the data region, under the shared lock */
+static int
+reserve(uint64_t len, uint64_t *off)
+{
+	int tries;
+
+	for (tries = 0; tries < 2; ++tries) {
+		flock(shmfd, LOCK_SH);
+		*off = __atomic_fetch_add(&head->tail, len, __ATOMIC_ACQ_REL);
+		if (*off + len <= head->size)
+			return 1;
+		flock(shmfd, LOCK_UN);
+
+		flock(shmfd, LOCK_EX);
+		if (LOAD(&head->tail) + len > head->size)
+			compact();
+		flock(shmfd, LOCK_UN);
+	}
+
+	return 0;
+}
+
+void
+sharedput(const char *key, const char *buf, size_t len)
+{
+	Shmslot s, *slot, *oldest = NULL;
+	Shmrec *r, *o;
+	int64_t stamp = 0;
+	uint64_t h, off, reclen;
+	size_t i, keylen;
+
+	if (!head)
+		return;
+
+	keylen = strlen(key);
+	reclen = sizeof(Shmrec) + keylen + len;
+	if (reclen > head->size / 4 || !reserve(ALIGN(reclen), &off))
+		return;
+
+	r = (Shmrec *)(data + off);
+	r->keylen = keylen;
+	r->len = len;
+	memcpy(r + 1, key, keylen);
+	memcpy((char *)(r + 1) + keylen, buf, len);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	/* replace the key, or take an empty or the oldest slot */
+	h = hashkey(key);
+	for (i = 0; i < PROBES; ++i) {
+		slot = &slots[(h + i) % head->nslots];
+		if (!slotread(slot, &s))
+			continue;
+		if (!s.len || (s.hash == h && (o = record(s.off, s.len)) &&
+		    o->keylen == keylen && !memcmp(o + 1, key, keylen))) {
+			oldest = slot;
+			break;
+		}
+		if (!oldest || s.stamp < stamp) {
+			oldest = slot;
+			stamp = s.stamp;
+		}
+	}
+	if (oldest && slotwrite(oldest, h, off, reclen, time(NULL)))
+		++nsharedputs;
+
+	flock(shmfd, LOCK_UN);
+}
+
+void
+sharedstats(FILE *fp)
+{
+	if (!head)
+		return;
+	fprintf(fp, "shared cache: %llu hits, %llu stale, %llu stored, "
+	        "%llu compactions, %llu/%llu bytes used\n",
+	        nsharedhits, nsharedstale, nsharedputs, nsharedcompactions,
+	        (unsigned long long)LOAD(&head->tail) < head->size ?
+	        (unsigned long long)LOAD(&head->tail) :
+	        (unsigned long long)head->size,
+	        (unsigned long long)head->size);
+}
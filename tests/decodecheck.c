@@ -0,0 +1,57 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../common.h"
+
+/* decode stdin to stdout as an item of type 4 (BinHex) or 6
+ * (uuencode), in reads of at most size bytes, for make check */
+
+void *
+xcalloc(size_t n)
+{
+	void *m;
+
+	if (!(m = calloc(1, n))) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		exit(2);
+	}
+
+	return m;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char buf[65536];
+	const char *err;
+	Decoder *d;
+	size_t size = sizeof(buf);
+	ssize_t n;
+
+	if (argc == 3)
+		size = strtoul(argv[2], NULL, 10);
+	if (argc < 2 || argc > 3 || !size || size > sizeof(buf) ||
+	    !(d = decodeopen(argv[1][0], 1))) {
+		fprintf(stderr, "usage: %s 4|6 [size]\n", argv[0]);
+		return 2;
+	}
+
+	while ((n = read(0, buf, size)) > 0) {
+		if (!decode(d, buf, n))
+			break;
+	}
+	if (n < 0) {
+		fprintf(stderr, "read: %s\n", strerror(errno));
+		return 2;
+	}
+	if ((err = decodeclose(d))) {
+		fprintf(stderr, "%s\n", err);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,464 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#ifndef NO_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "common.h"
+
+#include "config.h"
+
+#ifndef NO_TLS
+typedef struct tlshost Tlshost;
+
+/* a server sacc speaks or spoke TLS with, and the session to resume */
+struct tlshost {
+	char *host, *port;
+	int tls;	/* speaks TLS this run */
+	SSL_SESSION *session;
+	Tlshost *next;
+};
+
+static SSL_CTX *ctx;
+static SSL **conns;	/* by fd */
+static int nconns;
+static Tlshost *hosts;
+static int loaded, dirty;
+static unsigned long long nhandshakes, nresumed, nfailed;
+
+static Tlshost *
+hostget(const char *host, const char *port, int add)
+{
+	Tlshost *t;
+
+	for (t = hosts; t; t = t->next) {
+		if (!strcmp(t->host, host) && !strcmp(t->port, port))
+			return t;
+	}
+	if (!add)
+		return NULL;
+
+	t = xcalloc(sizeof(Tlshost));
+	t->host = xstrdup(host);
+	t->port = xstrdup(port);
+	t->next = hosts;
+	hosts = t;
+
+	return t;
+}
+
+static int
+expired(SSL_SESSION *s)
+{
+	return SSL_SESSION_get_time(s) + SSL_SESSION_get_timeout(s) <=
+	       time(NULL);
+}
+
+/* read back the sessions of the former runs, a line of host, port and
+ * the hex of the session each */
+static void
+loadcache(void)
+{
+	FILE *fp;
+	SSL_SESSION *s;
+	Tlshost *t;
+	unsigned char *der;
+	const unsigned char *p;
+	char *path, *line = NULL, *port, *hex;
+	size_t sz = 0, i, n;
+	ssize_t len;
+	unsigned int c;
+
+	if (!tlscache || !(path = homepath(tlscache)))
+		return;
+	fp = fopen(path, "r");
+	free(path);
+	if (!fp)
+		return;
+
+	while ((len = getline(&line, &sz, fp)) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!(port = strchr(line, '\t')) ||
+		    !(hex = strchr(++port, '\t')))
+			continue;
+		port[-1] = *hex++ = '\0';
+		n = strlen(hex) / 2;
+		der = xmalloc(n ? n : 1);
+		for (i = 0; i < n && sscanf(hex + 2*i, "%2x", &c) == 1; ++i)
+			der[i] = c;
+		p = der;
+		if (i == n && (s = d2i_SSL_SESSION(NULL, &p, n))) {
+			if (expired(s)) {
+				SSL_SESSION_free(s);
+			} else {
+				t = hostget(line, port, 1);
+				if (t->session)
+					SSL_SESSION_free(t->session);
+				t->session = s;
+			}
+		}
+		free(der);
+	}
+	free(line);
+	fclose(fp);
+}
+
+/* take the tickets the servers hand out, they replace the former ones */
+static int
+newsession(SSL *ssl, SSL_SESSION *s)
+{
+	Tlshost *t = SSL_get_app_data(ssl);
+
+	if (t->session)
+		SSL_SESSION_free(t->session);
+	t->session = s;
+	dirty = 1;
+
+	return 1;
+}
+
+static void
+init(void)
+{
+	struct sigaction sa;
+
+	if (ctx)
+		return;
+
+	if (!(ctx = SSL_CTX_new(TLS_client_method())))
+		die("SSL_CTX_new: %s",
+		    ERR_reason_error_string(ERR_get_error()));
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+	                 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	/* gopher servers close the connection to end the item */
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+	                               SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, newsession);
+	if (tlsverify) {
+		SSL_CTX_set_default_verify_paths(ctx);
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	}
+
+	/* writing to a connection the server dropped would kill us from
+	 * inside OpenSSL, make it fail with EPIPE */
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	if (!loaded) {
+		loadcache();
+		loaded = 1;
+	}
+}
+
+static SSL *
+connget(int fd)
+{
+	return (fd >= 0 && fd < nconns) ? conns[fd] : NULL;
+}
+
+static int
+isaddress(const char *host)
+{
+	unsigned char buf[sizeof(struct in6_addr)];
+
+	return inet_pton(AF_INET, host, buf) == 1 ||
+	       inet_pton(AF_INET6, host, buf) == 1;
+}
+
+static SSL *
+attach(int fd, const char *host, const char *port)
+{
+	Tlshost *t;
+	SSL *ssl;
+	int n;
+
+	init();
+	if (!(ssl = SSL_new(ctx)))
+		return NULL;
+	t = hostget(host, port, 1);
+	SSL_set_app_data(ssl, t);
+	SSL_set_fd(ssl, fd);
+	if (!isaddress(host))
+		SSL_set_tlsext_host_name(ssl, host);
+	if (tlsverify)
+		SSL_set1_host(ssl, host);
+	if (t->session && !expired(t->session))
+		SSL_set_session(ssl, t->session);
+
+	if (fd >= nconns) {
+		n = fd + 16;
+		conns = xreallocarray(conns, n, sizeof(*conns));
+		memset(conns + nconns, 0, (n - nconns) * sizeof(*conns));
+		nconns = n;
+	}
+	conns[fd] = ssl;
+
+	return ssl;
+}
+
+/* errno for a failed read or write */
+static int
+ioerror(SSL *ssl, int r)
+{
+	switch (SSL_get_error(ssl, r)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return EAGAIN;
+	case SSL_ERROR_SYSCALL:
+		return errno ? errno : EPIPE;
+	default:
+		return EPROTO;
+	}
+}
+
+/* speak TLS with host:port from now on */
+void
+tlsuse(const char *host, const char *port)
+{
+	hostget(host, port, 1)->tls = 1;
+}
+
+int
+tlswanted(const char *host, const char *port)
+{
+	Tlshost *t = hostget(host, port, 0);
+
+	return t && t->tls;
+}
+
+/* run the handshake over the connected socket fd, starting it on the
+ * first call: 0 once done, -1 if it failed for *err, else the poll
+ * events to wait for before calling again */
+int
+tlsconnect(int fd, const char *host, const char *port, const char **err)
+{
+	SSL *ssl;
+	long v;
+	int r;
+
+	if (!(ssl = connget(fd)) && !(ssl = attach(fd, host, port))) {
+		*err = "can't allocate the connection";
+		++nfailed;
+		return -1;
+	}
+
+	ERR_clear_error();
+	if ((r = SSL_connect(ssl)) == 1) {
+		if (SSL_session_reused(ssl))
+			++nresumed;
+		else
+			++nhandshakes;
+		return 0;
+	}
+
+	switch (SSL_get_error(ssl, r)) {
+	case SSL_ERROR_WANT_READ:
+		return POLLIN;
+	case SSL_ERROR_WANT_WRITE:
+		return POLLOUT;
+	}
+
+	if ((v = SSL_get_verify_result(ssl)) != X509_V_OK)
+		*err = X509_verify_cert_error_string(v);
+	else if (ERR_peek_last_error())
+		*err = ERR_reason_error_string(ERR_peek_last_error());
+	else
+		*err = "the server doesn't speak TLS";
+	++nfailed;
+
+	return -1;
+}
+
+int
+tlspending(int fd)
+{
+	SSL *ssl = connget(fd);
+
+	return ssl && SSL_pending(ssl) > 0;
+}
+
+/* read(2) going through TLS on the connections set up for it */
+ssize_t
+tlsread(int fd, void *buf, size_t n)
+{
+	SSL *ssl;
+	int r;
+
+	if (!(ssl = connget(fd)) || !n)
+		return read(fd, buf, n);
+
+	ERR_clear_error();
+	errno = 0;
+	if ((r = SSL_read(ssl, buf, n > INT_MAX ? INT_MAX : n)) > 0)
+		return r;
+	switch (SSL_get_error(ssl, r)) {
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_SYSCALL:
+		/* closed without a close_notify */
+		if (!errno)
+			return 0;
+	}
+	errno = ioerror(ssl, r);
+
+	return -1;
+}
+
+/* write(2) going through TLS on the connections set up for it */
+ssize_t
+tlswrite(int fd, const void *buf, size_t n)
+{
+	SSL *ssl;
+	int r;
+
+	if (!(ssl = connget(fd)) || !n)
+		return write(fd, buf, n);
+
+	ERR_clear_error();
+	if ((r = SSL_write(ssl, buf, n > INT_MAX ? INT_MAX : n)) > 0)
+		return r;
+	errno = ioerror(ssl, r);
+
+	return -1;
+}
+
+/* forget the TLS state of fd before it is closed */
+void
+tlsclose(int fd)
+{
+	SSL *ssl;
+
+	if (!(ssl = connget(fd)))
+		return;
+	/* the item ends with the connection, there is nothing left to
+	 * tell and the session stays good for resumption */
+	SSL_set_quiet_shutdown(ssl, 1);
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+	conns[fd] = NULL;
+}
+
+/* write the sessions back for the next runs */
+void
+tlssave(void)
+{
+	FILE *fp;
+	Tlshost *t;
+	unsigned char *der, *p;
+	char *path, *tmp;
+	int fd, i, n;
+
+	if (!dirty || !tlscache || !(path = homepath(tlscache)))
+		return;
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+		die("asprintf: %s", strerror(errno));
+	if ((fd = mkstemp(tmp)) < 0 || !(fp = fdopen(fd, "w"))) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		goto end;
+	}
+
+	for (t = hosts; t; t = t->next) {
+		if (!t->session || expired(t->session) ||
+		    !SSL_SESSION_is_resumable(t->session) ||
+		    (n = i2d_SSL_SESSION(t->session, NULL)) <= 0)
+			continue;
+		p = der = xmalloc(n);
+		i2d_SSL_SESSION(t->session, &p);
+		fprintf(fp, "%s\t%s\t", t->host, t->port);
+		for (i = 0; i < n; ++i)
+			fprintf(fp, "%02x", der[i]);
+		fputc('\n', fp);
+		free(der);
+	}
+
+	if (fclose(fp) == 0 && rename(tmp, path) == 0)
+		dirty = 0;
+	else
+		unlink(tmp);
+end:
+	free(tmp);
+	free(path);
+}
+
+void
+tlsstats(FILE *fp)
+{
+	if (!nhandshakes && !nresumed && !nfailed)
+		return;
+	fprintf(fp, "tls: %llu full handshakes, %llu resumed, %llu failed\n",
+	        nhandshakes, nresumed, nfailed);
+}
+#else
+void
+tlsuse(const char *host, const char *port)
+{
+	die("TLS support not built in");
+}
+
+int
+tlswanted(const char *host, const char *port)
+{
+	return 0;
+}
+
+int
+tlsconnect(int fd, const char *host, const char *port, const char **err)
+{
+	*err = "TLS support not built in";
+	return -1;
+}
+
+int
+tlspending(int fd)
+{
+	return 0;
+}
+
+ssize_t
+tlsread(int fd, void *buf, size_t n)
+{
+	return read(fd, buf, n);
+}
+
+ssize_t
+tlswrite(int fd, const void *buf, size_t n)
+{
+	return write(fd, buf, n);
+}
+
+void
+tlsclose(int fd)
+{
+}
+
+void
+tlssave(void)
+{
+}
+
+void
+tlsstats(FILE *fp)
+{
+}
+#endif
@@ -0,0 +1,430 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+#include "config.h"
+
+#define TRACEMAGIC	"sacc trace 1"
+
+typedef struct key Key;
+typedef struct response Response;
+
+/* a key of the user, read delay µs after the one before */
+struct key {
+	long long delay;
+	int c;
+};
+
+/* an answer of a server, served again by replays */
+struct response {
+	char *key;	/* host, port and selector, tab separated */
+	char *buf;
+	size_t len;
+	int used;
+	Response *next;
+};
+
+static FILE *rec;	/* trace being recorded */
+static int replaying;
+static Key *keys;
+static size_t nkeys, nextkey;
+static Response *responses, **lastresponse = &responses;
+static long long lastkey;	/* µs time the last key was read */
+static long long unpainted;	/* µs time of the first key not painted */
+static long long *latencies;
+static size_t nlatencies;
+static long long *frames;	/* bytes of each frame, when replaying */
+static size_t nframes;
+static unsigned long long nrecorded, nserved, nmissed;
+
+static long long
+usnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+push(long long **v, size_t *n, long long x)
+{
+	/* grow by powers of two */
+	if (!(*n & (*n - 1)))
+		*v = xreallocarray(*v, *n ? *n * 2 : 1, sizeof(**v));
+	(*v)[(*n)++] = x;
+}
+
+/* record the session to path, the keys of the user and the answers of
+ * the servers, from url */
+void
+tracerecord(const char *path, const char *url)
+{
+	struct winsize ws;
+	char *term;
+
+	if (!(rec = fopen(path, "w")))
+		die("Can't record trace %s: %s", path, strerror(errno));
+	if (ioctl(1, TIOCGWINSZ, &ws) < 0)
+		ws.ws_row = ws.ws_col = 0;
+	if (!(term = getenv("TERM")))
+		term = "dumb";
+	fprintf(rec, "%s\nurl %s\nterm %s %d %d\n", TRACEMAGIC, url, term,
+	        ws.ws_row, ws.ws_col);
+}
+
+static void
+badtrace(const char *path, size_t line)
+{
+	die("Can't replay trace %s: line %zu is malformed", path, line);
+}
+
+/* load the trace of path to replay it headless, returning the url it
+ * starts from */
+char *
+tracereplay(const char *path)
+{
+	FILE *fp;
+	Response *r;
+	char *line = NULL, *url = NULL, *p, lines[16], columns[16];
+	size_t sz = 0, n = 0, len;
+	ssize_t linelen;
+	long long delay;
+	int c, rows, cols;
+
+	if (!(fp = fopen(path, "r")))
+		die("Can't replay trace %s: %s", path, strerror(errno));
+
+	while ((linelen = getline(&line, &sz, fp)) > 0) {
+		++n;
+		line[strcspn(line, "\n")] = '\0';
+		if (n == 1) {
+			if (strcmp(line, TRACEMAGIC))
+				die("%s isn't a sacc trace", path);
+		} else if (!strncmp(line, "url ", 4)) {
+			url = xstrdup(line + 4);
+		} else if (!strncmp(line, "term ", 5)) {
+			if (!(p = strchr(line + 5, ' ')) ||
+			    sscanf(p, "%d %d", &rows, &cols) != 2)
+				badtrace(path, n);
+			*p = '\0';
+			setenv("TERM", line + 5, 1);
+			if (rows > 0 && cols > 0) {
+				snprintf(lines, sizeof(lines), "%d", rows);
+				snprintf(columns, sizeof(columns), "%d", cols);
+				setenv("LINES", lines, 1);
+				setenv("COLUMNS", columns, 1);
+			}
+		} else if (line[0] == 'k') {
+			if (sscanf(line, "k %lld %d", &delay, &c) != 2)
+				badtrace(path, n);
+			if (!(nkeys & (nkeys - 1)))
+				keys = xreallocarray(keys, nkeys ? nkeys * 2 : 1,
+				                     sizeof(*keys));
+			keys[nkeys].delay = delay;
+			keys[nkeys++].c = c;
+		} else if (line[0] == 'r') {
+			/* "r <len> <key>", then the answer and a newline */
+			len = strtoull(line + 1, &p, 10);
+			if (*p++ != ' ')
+				badtrace(path, n);
+			r = xcalloc(sizeof(Response));
+			r->key = xstrdup(p);
+			r->buf = xmalloc(len + 1);
+			r->len = len;
+			if (fread(r->buf, 1, len, fp) != len ||
+			    fgetc(fp) != '\n')
+				badtrace(path, n);
+			r->buf[len] = '\0';
+			*lastresponse = r;
+			lastresponse = &r->next;
+		} else if (line[0]) {
+			badtrace(path, n);
+		}
+	}
+	free(line);
+	fclose(fp);
+
+	if (!url)
+		die("Can't replay trace %s: no url", path);
+	/* what the user did in the pager didn't go through sacc */
+	setenv("PAGER", "cat", 1);
+	replaying = 1;
+
+	return url;
+}
+
+int
+tracereplaying(void)
+{
+	return replaying;
+}
+
+/* send the frames of a replay to a file in dir, their size being read
+ * back as they are painted */
+void
+tracescreen(const char *dir)
+{
+	char *path;
+	int fd;
+
+	if (asprintf(&path, "%s/screen-XXXXXX", dir) < 0)
+		die("asprintf: %s", strerror(errno));
+	if ((fd = mkstemp(path)) < 0)
+		die("Can't create %s: %s", path, strerror(errno));
+	unlink(path);
+	free(path);
+	/* appending, the file can be emptied under stdout */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_APPEND);
+	if (dup2(fd, 1) < 0)
+		die("dup2: %s", strerror(errno));
+	close(fd);
+}
+
+/* ms before the next key of a replay is due, -1 when not replaying */
+int
+tracedue(void)
+{
+	long long t, delay;
+
+	if (!replaying)
+		return -1;
+	if (nextkey == nkeys)
+		return 0;
+
+	delay = keys[nextkey].delay;
+	if (replaypause >= 0 && delay > replaypause * 1000LL)
+		delay = replaypause * 1000LL;
+	if (!lastkey)
+		lastkey = usnow();
+	t = lastkey + delay - usnow();
+
+	return (t > 0) ? (t + 999) / 1000 : 0;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	long long x = *(long long *)a, y = *(long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* the pth percentile of the n values of v, sorting them */
+static long long
+percentile(long long *v, size_t n, int p)
+{
+	qsort(v, n, sizeof(*v), cmp);
+
+	return v[(n - 1) * p / 100];
+}
+
+void
+tracestats(FILE *fp)
+{
+	unsigned long long total = 0;
+	size_t i;
+
+	if (!rec && !replaying)
+		return;
+
+	if (replaying)
+		fprintf(fp, "trace: replayed %zu of %zu keys, %llu answers, "
+		        "%llu missing\n", nextkey, nkeys, nserved, nmissed);
+	else
+		fprintf(fp, "trace: recorded %zu keys, %llu answers\n",
+		        nkeys, nrecorded);
+	if (nlatencies) {
+		fprintf(fp, "input to paint: p50 %.3f ms, p99 %.3f ms, "
+		        "%zu keys painted\n",
+		        percentile(latencies, nlatencies, 50) / 1000.0,
+		        percentile(latencies, nlatencies, 99) / 1000.0,
+		        nlatencies);
+	}
+	if (nframes) {
+		for (i = 0; i < nframes; ++i)
+			total += frames[i];
+		fprintf(fp, "bytes per frame: p50 %lld, p99 %lld, "
+		        "%llu in %zu frames\n",
+		        percentile(frames, nframes, 50),
+		        percentile(frames, nframes, 99), total, nframes);
+	}
+}
+
+/* getchar() for the UIs: recorded, or taken from the trace replayed,
+ * EOF once it ran out for the UI to quit */
+int
+getkey(void)
+{
+	long long t;
+	int c, due;
+
+	if (replaying) {
+		if (nextkey == nkeys)
+			return EOF;
+		while ((due = tracedue()) > 0)
+			netwait(-1, due);
+		c = keys[nextkey++].c;
+		t = usnow();
+	} else {
+		c = getchar();
+		if (!rec)
+			return c;
+		t = usnow();
+		fprintf(rec, "k %lld %d\n", lastkey ? t - lastkey : 0, c);
+		fflush(rec);
+		++nkeys;
+	}
+
+	lastkey = t;
+	if (!unpainted)
+		unpainted = t;
+
+	return c;
+}
+
+/* fgets() of the keys, for line-oriented input */
+char *
+getkeys(char *buf, int size)
+{
+	int c, n = 0;
+
+	while (n < size - 1 && (c = getkey()) != EOF) {
+		buf[n++] = c;
+		if (c == '\n')
+			break;
+	}
+	if (!n)
+		return NULL;
+	buf[n] = '\0';
+
+	return buf;
+}
+
+/* getline() of the keys */
+ssize_t
+getkeyline(char **line, size_t *size)
+{
+	size_t n = 0;
+	int c;
+
+	while ((c = getkey()) != EOF) {
+		if (n + 2 > *size) {
+			*size = *size ? *size * 2 : 128;
+			*line = xreallocarray(*line, *size, 1);
+		}
+		(*line)[n++] = c;
+		if (c == '\n')
+			break;
+	}
+	if (!n)
+		return -1;
+	(*line)[n] = '\0';
+
+	return n;
+}
+
+/* a frame was flushed to the screen */
+void
+tracepaint(void)
+{
+	struct stat st;
+	long long t;
+
+	if (!rec && !replaying)
+		return;
+
+	t = usnow();
+	if (unpainted) {
+		push(&latencies, &nlatencies, t - unpainted);
+		unpainted = 0;
+	}
+	if (replaying && fstat(1, &st) == 0) {
+		push(&frames, &nframes, st.st_size);
+		/* else the next frames are counted with this one */
+		if (ftruncate(1, 0) < 0)
+			die("Can't empty the replay screen: %s",
+			    strerror(errno));
+	}
+}
+
+/* keep the answer of a server for the replays */
+void
+traceput(const char *host, const char *port, const char *selector,
+         const char *buf, size_t len)
+{
+	if (!rec)
+		return;
+	fprintf(rec, "r %zu %s\t%s\t%s\n", len, host, port, selector);
+	fwrite(buf, 1, len, rec);
+	fputc('\n', rec);
+	++nrecorded;
+}
+
+/* the recorded answer of a server, the next one for a request made
+ * several times, or NULL */
+char *
+traceget(const char *host, const char *port, const char *selector,
+         size_t *len)
+{
+	Response *r, *last = NULL;
+	char *key, *buf;
+
+	if (asprintf(&key, "%s\t%s\t%s", host, port, selector) < 0)
+		die("asprintf: %s", strerror(errno));
+	for (r = responses; r; r = r->next) {
+		if (strcmp(r->key, key))
+			continue;
+		last = r;
+		if (!r->used)
+			break;
+	}
+	free(key);
+
+	if (!(r = r ? r : last)) {
+		++nmissed;
+		return NULL;
+	}
+	r->used = 1;
+	++nserved;
+
+	buf = xmalloc(r->len + 1);
+	memcpy(buf, r->buf, r->len + 1);
+	*len = r->len;
+
+	return buf;
+}
+
+void
+traceclose(void)
+{
+	Response *r;
+
+	if (replaying)
+		tracestats(stderr);
+	if (rec) {
+		fclose(rec);
+		rec = NULL;
+	}
+	while ((r = responses)) {
+		responses = r->next;
+		free(r->key);
+		free(r->buf);
+		free(r);
+	}
+	free(keys);
+	free(latencies);
+	free(frames);
+	/* the UI paints its last frame after */
+	replaying = 0;
+}
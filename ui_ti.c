@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,6 +6,7 @@
 #include <term.h>
 #include <termios.h>
 #include <unistd.h>
+#include <wchar.h>
 #include <sys/types.h>
 
 #include "config.h"
@@ -13,10 +15,32 @@
 #define C(c) #c
 #define S(c) C(c)
 
+#define VIEWSLICE	(1 << 20) /* bytes of text indexed per idle step */
+
 static char bufout[256];
+static char linebuf[BUFSIZ];
 static struct termios tsave;
 static struct termios tsacc;
 static Item *curentry;
+static const char *liveprompt, *liveinput; /* uiliveprompt() going on */
+static struct {
+	Item *item;
+	char *raw;
+	size_t *off;	/* offset of each known line in raw */
+	size_t nlines;
+	size_t size;
+	size_t scanned;	/* bytes of raw covered by lines */
+	size_t top;	/* first displayed line */
+	int complete;
+} view;
+
+/* show what was drawn, a frame painted */
+static void
+flush(void)
+{
+	fflush(stdout);
+	tracepaint();
+}
 
 void
 uisetup(void)
@@ -31,7 +55,7 @@ uisetup(void)
 	putp(tparm(save_cursor, 0, 0, 0, 0, 0, 0, 0, 0, 0));
 	putp(tparm(change_scroll_region, 0, lines-2, 0, 0, 0, 0, 0, 0, 0));
 	putp(tparm(restore_cursor, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	fflush(stdout);
+	flush();
 }
 
 void
@@ -40,7 +64,7 @@ uicleanup(void)
 	putp(tparm(change_scroll_region, 0, lines-1, 0, 0, 0, 0, 0, 0, 0));
 	putp(tparm(clear_screen, 0, 0, 0, 0, 0, 0, 0, 0, 0));
 	tcsetattr(0, TCSANOW, &tsave);
-	fflush(stdout);
+	flush();
 }
 
 char *
@@ -71,15 +95,15 @@ uiprompt(char *fmt, ...)
 
 	tsacc.c_lflag |= (ECHO|ICANON);
 	tcsetattr(0, TCSANOW, &tsacc);
-	fflush(stdout);
+	flush();
 
 	n = 0;
-	r = getline(&input, &n, stdin);
+	r = getkeyline(&input, &n);
 
 	tsacc.c_lflag &= ~(ECHO|ICANON);
 	tcsetattr(0, TCSANOW, &tsacc);
 	putp(tparm(restore_cursor, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	fflush(stdout);
+	flush();
 
 	if (r < 0) {
 		clearerr(stdin);
@@ -91,6 +115,101 @@ uiprompt(char *fmt, ...)
 	return input;
 }
 
+/* whether s ends inside a multibyte character */
+static int
+partial(const char *s, size_t len)
+{
+	mbstate_t st;
+	size_t i = len;
+
+	while (i && (s[i-1] & 0xc0) == 0x80)
+		--i;
+	if (i)
+		--i;
+	memset(&st, 0, sizeof(st));
+
+	return mbrlen(s + i, len - i, &st) == (size_t)-2;
+}
+
+static void
+drawprompt(const char *prompt, const char *input)
+{
+	size_t n;
+
+	putp(tparm(cursor_address, lines-1, 0, 0, 0, 0, 0, 0, 0, 0));
+	putp(tparm(clr_eol, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+	putp(tparm(enter_standout_mode, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+	n = mbsprint(prompt, columns);
+	putp(tparm(exit_standout_mode, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+	if (n < columns)
+		mbsprint(input, columns - n);
+	flush();
+}
+
+/* prompt for a line edited here, typed() being told what it holds
+ * after each change while the network and idle work go on */
+char *
+uiliveprompt(void (*typed)(const char *input), char *fmt, ...)
+{
+	va_list ap;
+	char prompt[BUFSIZ], *input;
+	size_t len = 0, size = 64;
+	int c;
+
+	va_start(ap, fmt);
+	if (vsnprintf(prompt, sizeof(prompt), fmt, ap) >= sizeof(prompt))
+		prompt[sizeof(prompt)-1] = '\0';
+	va_end(ap);
+
+	input = xmalloc(size);
+	input[0] = '\0';
+
+	liveprompt = prompt;
+	for (;;) {
+		liveinput = input;
+		drawprompt(prompt, input);
+		waitinput();
+		switch (c = getkey()) {
+		case EOF:
+		case 0x04: /* ^D */
+			if (len && c != EOF)
+				continue;
+			clear(&input);
+			goto end;
+		case '\n':
+		case '\r':
+			goto end;
+		case 0x7f:
+		case '\b':
+			if (!len)
+				continue;
+			/* a whole multibyte character */
+			while (--len && (input[len] & 0xc0) == 0x80)
+				;
+			break;
+		case 0x15: /* ^U */
+			len = 0;
+			break;
+		default:
+			if ((unsigned char)c < ' ')
+				continue;
+			if (len + 1 == size)
+				input = xreallocarray(input, size *= 2, 1);
+			input[len++] = c;
+			if (partial(input, len))
+				continue;
+		}
+		input[len] = '\0';
+		typed(input);
+	}
+end:
+	if (input)
+		input[len] = '\0';
+	liveprompt = NULL;
+
+	return input;
+}
+
 static void
 printitem(Item *item)
 {
@@ -139,8 +258,11 @@ help(Item *entry)
 		       S(_key_search) ": search current page.\n"
 		       S(_key_searchnext) ": search string forward.\n"
 		       S(_key_searchprev) ": search string backward.\n"
+		       S(_key_searchall) ": search all fetched pages.\n"
+		       S(_key_goto) ": go to line or percentage of text.\n"
 		       S(_key_cururi) ": print page URI.\n"
 		       S(_key_seluri) ": print item URI.\n"
+		       S(_key_stats) ": show session statistics.\n"
 		       S(_key_help) ": show this help.\n"
 		       "^D, " S(_key_quit) ": exit sacc.\n"
 	};
@@ -178,30 +300,39 @@ uistatus(char *fmt, ...)
 		printf("%*s", columns - n, " ");
 
 	putp(tparm(restore_cursor, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	fflush(stdout);
+	flush();
 
-	getchar();
+	getkey();
 }
 
 static void
 displaystatus(Item *item)
 {
 	Dir *dir = item->dat;
-	char *fmt;
+	char *fmt, *path, *stale;
 	size_t n, nitems = dir ? dir->nitems : 0;
 	unsigned long long printoff = dir ? dir->printoff : 0;
+	long long pct;
 
 	putp(tparm(save_cursor, 0, 0, 0, 0, 0, 0, 0, 0, 0));
 
 	putp(tparm(cursor_address, lines-1, 0, 0, 0, 0, 0, 0, 0, 0));
 	putp(tparm(enter_standout_mode, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	fmt = (strcmp(item->port, "70") && strcmp(item->port, "gopher")) ?
-	      "%1$3lld%%| %2$s:%5$s/%3$c%4$s" : "%3lld%%| %s/%c%s";
-	if (snprintf(bufout, sizeof(bufout), fmt,
-	             (printoff + lines-1 >= nitems) ? 100 :
-	             (printoff + lines-1) * 100 / nitems,
-	             item->host, item->type, item->selector, item->port)
-	    >= sizeof(bufout))
+	pct = (printoff + lines-1 >= nitems) ? 100 :
+	      (printoff + lines-1) * 100 / nitems;
+	stale = revalidating(item) ? " [stale]" : "";
+	if ((path = localpath(item))) {
+		n = snprintf(bufout, sizeof(bufout), "%3lld%%| %s%s",
+		             pct, path, stale);
+	} else {
+		fmt = (strcmp(item->port, "70") &&
+		       strcmp(item->port, "gopher")) ?
+		      "%1$3lld%%| %2$s:%5$s/%3$c%4$s%6$s" :
+		      "%1$3lld%%| %2$s/%3$c%4$s%6$s";
+		n = snprintf(bufout, sizeof(bufout), fmt, pct, item->host,
+		             item->type, item->selector, item->port, stale);
+	}
+	if (n >= sizeof(bufout))
 		bufout[sizeof(bufout)-1] = '\0';
 	n = mbsprint(bufout, columns);
 	putp(tparm(exit_standout_mode, 0, 0, 0, 0, 0, 0, 0, 0, 0));
@@ -209,12 +340,14 @@ displaystatus(Item *item)
 		printf("%*s", columns - n, " ");
 
 	putp(tparm(restore_cursor, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	fflush(stdout);
+	flush();
 }
 
 static void
 displayuri(Item *item)
 {
+	const char *desc;
+	char *path;
 	size_t n;
 
 	if (item->type == 0 || item->type == 'i')
@@ -238,7 +371,13 @@ displayuri(Item *item)
 		             item->selector, item->host, item->port);
 		break;
 	default:
-		n = snprintf(bufout, sizeof(bufout), "gopher://%s", item->host);
+		if ((path = localpath(item))) {
+			n = snprintf(bufout, sizeof(bufout), "file://%s", path);
+			break;
+		}
+		n = snprintf(bufout, sizeof(bufout), "gopher%s://%s",
+		             tlswanted(item->host, item->port) ? "s" : "",
+		             item->host);
 
 		if (n < sizeof(bufout) && strcmp(item->port, "70")) {
 			n += snprintf(bufout+n, sizeof(bufout)-n, ":%s",
@@ -248,10 +387,15 @@ displayuri(Item *item)
 			n += snprintf(bufout+n, sizeof(bufout)-n, "/%c%s",
 			              item->type, item->selector);
 		}
-		if (n < sizeof(bufout) && item->type == '7' && item->tag) {
+		if (n < sizeof(bufout) && item->tag &&
+		    (item->type == '7' || item->type == '2')) {
 			n += snprintf(bufout+n, sizeof(bufout)-n, "%%09%s",
 			              item->tag + strlen(item->selector));
 		}
+		if (n < sizeof(bufout) && (desc = plusdescribe(item))) {
+			n += snprintf(bufout+n, sizeof(bufout)-n, " (%s)",
+			              desc);
+		}
 		break;
 	}
 
@@ -264,18 +408,18 @@ displayuri(Item *item)
 		printf("%*s", columns - n, " ");
 
 	putp(tparm(restore_cursor, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	fflush(stdout);
+	flush();
 }
 
 void
 uidisplay(Item *entry)
 {
-	Item *items;
 	Dir *dir;
 	size_t i, curln, lastln, nitems, printoff;
 
 	if (!entry ||
-	    !(entry->type == '1' || entry->type == '+' || entry->type == '7'))
+	    !(entry->type == '1' || entry->type == '+' || entry->type == '7' ||
+	      entry->type == '2'))
 		return;
 
 	curentry = entry;
@@ -288,7 +432,6 @@ uidisplay(Item *entry)
 
 	putp(tparm(save_cursor, 0, 0, 0, 0, 0, 0, 0, 0, 0));
 
-	items = dir->items;
 	nitems = dir->nitems;
 	printoff = dir->printoff;
 	curln = dir->curline;
@@ -302,7 +445,7 @@ uidisplay(Item *entry)
 			putp(tparm(enter_standout_mode,
 			           0, 0, 0, 0, 0, 0, 0, 0, 0));
 		}
-		printitem(&items[i]);
+		printitem(diritem(dir, i));
 		putp(tparm(column_address, 0, 0, 0, 0, 0, 0, 0, 0, 0));
 		if (i == curln)
 			putp(tparm(exit_standout_mode,
@@ -310,7 +453,60 @@ uidisplay(Item *entry)
 	}
 
 	putp(tparm(restore_cursor, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	fflush(stdout);
+	flush();
+
+	/* results shown as the query is typed */
+	if (liveprompt)
+		drawprompt(liveprompt, liveinput);
+}
+
+static int
+samerow(Dir *old, Dir *dir, size_t row)
+{
+	Item *a = NULL, *b = NULL;
+
+	if (old->printoff + row < old->nitems)
+		a = diritem(old, old->printoff + row);
+	if (dir->printoff + row < dir->nitems)
+		b = diritem(dir, dir->printoff + row);
+	if ((old->printoff + row == old->curline) !=
+	    (dir->printoff + row == dir->curline))
+		return 0;
+
+	return (!a && !b) || (a && b && a->type == b->type &&
+	                      !strcmp(a->username, b->username));
+}
+
+/* repaint the rows of the page that differ from the old one */
+void
+uirefresh(Item *entry, Dir *old)
+{
+	Dir *dir = entry->dat;
+	size_t row;
+
+	if (entry != curentry || view.item)
+		return;
+
+	for (row = 0; old && row < lines-1; ++row) {
+		if (samerow(old, dir, row))
+			continue;
+		putp(tparm(cursor_address, row, 0, 0, 0, 0, 0, 0, 0, 0));
+		putp(tparm(clr_eol, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+		if (dir->printoff + row >= dir->nitems)
+			continue;
+		if (dir->printoff + row == dir->curline)
+			putp(tparm(enter_standout_mode,
+			           0, 0, 0, 0, 0, 0, 0, 0, 0));
+		printitem(diritem(dir, dir->printoff + row));
+		if (dir->printoff + row == dir->curline)
+			putp(tparm(exit_standout_mode,
+			           0, 0, 0, 0, 0, 0, 0, 0, 0));
+	}
+	if (old)
+		putp(tparm(cursor_address, dir->curline - dir->printoff, 0,
+		           0, 0, 0, 0, 0, 0, 0));
+
+	displaystatus(entry);
 }
 
 static void
@@ -329,7 +525,7 @@ movecurline(Item *item, int l)
 	if (curline < 0 || curline >= nitems)
 		return;
 
-	printitem(&dir->items[dir->curline]);
+	printitem(diritem(dir, dir->curline));
 	dir->curline = curline;
 
 	if (l > 0) {
@@ -340,7 +536,7 @@ movecurline(Item *item, int l)
 			putp(tparm(cursor_address, plines,
 			           0, 0, 0, 0, 0, 0, 0, 0));
 			putp(tparm(scroll_forward, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-			printitem(&dir->items[offline]);
+			printitem(diritem(dir, offline));
 
 			putp(tparm(restore_cursor, 0, 0, 0, 0, 0, 0, 0, 0, 0));
 			dir->printoff += l;
@@ -352,7 +548,7 @@ movecurline(Item *item, int l)
 
 			putp(tparm(cursor_address, 0, 0, 0, 0, 0, 0, 0, 0, 0));
 			putp(tparm(scroll_reverse, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-			printitem(&dir->items[offline]);
+			printitem(diritem(dir, offline));
 			putchar('\n');
 
 			putp(tparm(restore_cursor, 0, 0, 0, 0, 0, 0, 0, 0, 0));
@@ -363,10 +559,10 @@ movecurline(Item *item, int l)
 	putp(tparm(cursor_address, curline - dir->printoff,
 	           0, 0, 0, 0, 0, 0, 0, 0));
 	putp(tparm(enter_standout_mode, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	printitem(&dir->items[curline]);
+	printitem(diritem(dir, curline));
 	putp(tparm(exit_standout_mode, 0, 0, 0, 0, 0, 0, 0, 0, 0));
 	displaystatus(item);
-	fflush(stdout);
+	flush();
 }
 
 static void
@@ -421,14 +617,14 @@ searchinline(const char *searchstr, Item *entry, int pos)
 
 	if (pos > 0) {
 		for (i = dir->curline + 1; i < dir->nitems; ++i) {
-			if (strcasestr(dir->items[i].username, searchstr)) {
+			if (strcasestr(diritem(dir, i)->username, searchstr)) {
 				jumptoline(entry, i, 1);
 				break;
 			}
 		}
 	} else {
 		for (i = dir->curline - 1; i > -1; --i) {
-			if (strcasestr(dir->items[i].username, searchstr)) {
+			if (strcasestr(diritem(dir, i)->username, searchstr)) {
 				jumptoline(entry, i, 1);
 				break;
 			}
@@ -448,7 +644,7 @@ nearentry(Item *entry, int direction)
 	item = dir->curline + direction;
 
 	for (; item < lastitem; item += direction) {
-		if (dir->items[item].type != 'i')
+		if (diritem(dir, item)->type != 'i')
 			return item;
 	}
 
@@ -459,16 +655,20 @@ Item *
 uiselectitem(Item *entry)
 {
 	Dir *dir;
-	char *searchstr = NULL;
+	Item *hits;
+	char *searchstr = NULL, *query;
 	int plines = lines-2;
 
 	if (!entry || !(dir = entry->dat))
 		return NULL;
 
 	for (;;) {
-		switch (getchar()) {
+		waitinput();
+		/* a refetch may have swapped the page in the meantime */
+		dir = entry->dat;
+		switch (getkey()) {
 		case 0x1b: /* ESC */
-			switch (getchar()) {
+			switch (getkey()) {
 			case 0x1b:
 				goto quit;
 			case '[':
@@ -476,17 +676,17 @@ uiselectitem(Item *entry)
 			default:
 				continue;
 			}
-			switch (getchar()) {
+			switch (getkey()) {
 			case '4':
-				if (getchar() != '~')
+				if (getkey() != '~')
 					continue;
 				goto end;
 			case '5':
-				if (getchar() != '~')
+				if (getkey() != '~')
 					continue;
 				goto pgup;
 			case '6':
-				if (getchar() != '~')
+				if (getkey() != '~')
 					continue;
 				goto pgdown;
 			case 'A':
@@ -510,7 +710,7 @@ uiselectitem(Item *entry)
 		case '\n':
 		pgnext:
 			if (dir)
-				return &dir->items[dir->curline];
+				return diritem(dir, dir->curline);
 			continue;
 		case _key_lndown:
 		lndown:
@@ -556,23 +756,36 @@ uiselectitem(Item *entry)
 		case _key_searchprev:
 			searchinline(searchstr, entry, -1);
 			continue;
+		case _key_searchall:
+			if (!(query = uiprompt("Search fetched pages for: ")))
+				continue;
+			hits = query[0] ? searchsession(query, entry) : NULL;
+			free(query);
+			if (hits)
+				return hits;
+			continue;
+		case EOF:
 		case 0x04:
 		case _key_quit:
 		quit:
 			return NULL;
 		case _key_fetch:
 		fetch:
-			if (entry->raw)
-				continue;
-			return entry;
+			if (!entry->raw)
+				return entry;
+			revalidate(entry);
+			displaystatus(entry);
+			continue;
 		case _key_cururi:
 			if (dir)
 				displayuri(entry);
 			continue;
 		case _key_seluri:
 			if (dir)
-				displayuri(&dir->items[dir->curline]);
+				displayuri(diritem(dir, dir->curline));
 			continue;
+		case _key_stats:
+			return sessionstats(entry);
 		case _key_help: /* FALLTHROUGH */
 			return help(entry);
 		default:
@@ -581,6 +794,295 @@ uiselectitem(Item *entry)
 	}
 }
 
+static void
+viewscan(size_t end)
+{
+	char *p;
+	size_t lim;
+
+	lim = (end < (size_t)-1 - VIEWSLICE) ? end + VIEWSLICE : end;
+	while (!view.complete && view.scanned < lim) {
+		if (view.nlines == view.size) {
+			view.size = view.size ? view.size * 2 : 1024;
+			view.off = xreallocarray(view.off, view.size,
+			                           sizeof(size_t));
+		}
+		if (!(p = strchr(view.raw + view.scanned, '\n'))) {
+			view.off[view.nlines++] = view.scanned;
+			view.scanned += strlen(view.raw + view.scanned);
+			view.complete = 1;
+		} else {
+			view.off[view.nlines++] = view.scanned;
+			view.scanned = p+1 - view.raw;
+			if (!view.raw[view.scanned])
+				view.complete = 1;
+		}
+	}
+	if (view.complete && view.nlines > 1 &&
+	    !view.raw[view.off[view.nlines-1]])
+		--view.nlines;
+}
+
+/* index lines until `line' is known or the text is exhausted */
+static void
+viewneed(size_t line)
+{
+	while (!view.complete && view.nlines <= line)
+		viewscan(view.scanned);
+}
+
+int
+uiidle(void)
+{
+	if (!view.item || view.complete)
+		return 0;
+	viewscan(view.scanned);
+	return !view.complete;
+}
+
+static void
+viewline(size_t line)
+{
+	char *s = view.raw + view.off[line];
+	size_t i, col;
+
+	for (i = col = 0; *s && *s != '\n' && i < sizeof(linebuf)-8; ++s) {
+		if (*s == '\t') {
+			do
+				linebuf[i++] = ' ';
+			while (++col % 8 && i < sizeof(linebuf)-8);
+		} else if ((unsigned char)*s >= ' ' && *s != 0x7f) {
+			linebuf[i++] = *s;
+			if ((*s & 0xc0) != 0x80)
+				++col;
+		}
+	}
+	linebuf[i] = '\0';
+	mbsprint(linebuf, columns);
+}
+
+static void
+viewdisplay(void)
+{
+	Item *item = view.item;
+	size_t i, n, rows = lines-1;
+	int pct;
+
+	viewneed(view.top + rows);
+
+	putp(tparm(clear_screen, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+	for (i = view.top; i < view.nlines && i < view.top + rows; ++i) {
+		putp(tparm(cursor_address, i - view.top,
+		           0, 0, 0, 0, 0, 0, 0, 0));
+		viewline(i);
+	}
+
+	putp(tparm(cursor_address, lines-1, 0, 0, 0, 0, 0, 0, 0, 0));
+	putp(tparm(enter_standout_mode, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+	pct = (!view.complete || view.top + rows < view.nlines) ?
+	      (view.top + rows) * 100 / (view.nlines ? view.nlines : 1) : 100;
+	if (snprintf(bufout, sizeof(bufout), "%3d%%| %s/%c%s [%zu/%zu%s]",
+	             pct > 100 ? 100 : pct, item->host ? item->host : "",
+	             item->type, item->selector ? item->selector : "",
+	             view.top+1, view.nlines, view.complete ? "" : "+")
+	    >= sizeof(bufout))
+		bufout[sizeof(bufout)-1] = '\0';
+	n = mbsprint(bufout, columns);
+	putp(tparm(exit_standout_mode, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+	if (n < columns)
+		printf("%*s", columns - n, " ");
+	flush();
+}
+
+static void
+viewset(ssize_t line)
+{
+	size_t rows = lines-1;
+
+	if (line < 0)
+		line = 0;
+	viewneed(line + rows);
+	if (line + rows > view.nlines)
+		line = (view.nlines > rows) ? view.nlines - rows : 0;
+	view.top = line;
+}
+
+static void
+viewgoto(void)
+{
+	char *input, *end;
+	unsigned long long n;
+
+	if (!(input = uiprompt("Go to line or percentage: ")))
+		return;
+	n = strtoull(input, &end, 10);
+	if (end != input && *end == '%') {
+		viewneed((size_t)-1);
+		viewset((n > 100 ? 100 : n) * view.nlines / 100);
+	} else if (end != input) {
+		viewset(n ? n-1 : 0);
+	}
+	free(input);
+}
+
+static int
+linematch(size_t line, const char *str)
+{
+	const char *s, *p, *q;
+
+	for (s = view.raw + view.off[line]; *s && *s != '\n'; ++s) {
+		for (p = s, q = str; *q && *p && *p != '\n' &&
+		     tolower((unsigned char)*p) == tolower((unsigned char)*q);
+		     ++p, ++q)
+			;
+		if (!*q)
+			return 1;
+	}
+	return 0;
+}
+
+/* find the line holding byte offset `off' in the line index */
+static size_t
+viewlineof(size_t off)
+{
+	size_t lo = 0, hi, mid;
+
+	while (!view.complete && view.scanned <= off)
+		viewscan(view.scanned);
+	for (hi = view.nlines; hi - lo > 1;) {
+		mid = lo + (hi - lo) / 2;
+		if (view.off[mid] <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void
+viewsearch(const char *str, int pos)
+{
+	char *p;
+	ssize_t i;
+
+	if (!str)
+		return;
+
+	if (pos > 0) {
+		viewneed(view.top+1);
+		if (view.top+1 >= view.nlines)
+			return;
+		if ((p = strcasestr(view.raw + view.off[view.top+1], str)))
+			viewset(viewlineof(p - view.raw));
+	} else {
+		for (i = view.top - 1; i >= 0; --i) {
+			if (linematch(i, str)) {
+				viewset(i);
+				break;
+			}
+		}
+	}
+}
+
+int
+uiviewtext(Item *item)
+{
+	char *searchstr = NULL;
+	int plines = lines-2;
+
+	if (!builtinpager || !item->raw)
+		return 0;
+
+	memset(&view, 0, sizeof(view));
+	view.item = item;
+	view.raw = item->raw;
+	viewset(0);
+
+	for (;;) {
+		viewdisplay();
+		waitinput();
+		switch (getkey()) {
+		case 0x1b: /* ESC */
+			if (getkey() != '[')
+				continue;
+			switch (getkey()) {
+			case '4':
+				if (getkey() != '~')
+					continue;
+				goto end;
+			case '5':
+				if (getkey() != '~')
+					continue;
+				goto pgup;
+			case '6':
+				if (getkey() != '~')
+					continue;
+				goto pgdown;
+			case 'A':
+				goto lnup;
+			case 'B':
+				goto lndown;
+			case 'D':
+				goto quit;
+			case 'H':
+				goto home;
+			}
+			continue;
+		case _key_lndown:
+		lndown:
+			viewset(view.top + 1);
+			continue;
+		case _key_lnup:
+		lnup:
+			viewset((ssize_t)view.top - 1);
+			continue;
+		case ' ':
+		case _key_pgdown:
+		pgdown:
+			viewset(view.top + plines);
+			continue;
+		case _key_pgup:
+		pgup:
+			viewset((ssize_t)view.top - plines);
+			continue;
+		case _key_home:
+		home:
+			viewset(0);
+			continue;
+		case _key_end:
+		end:
+			viewneed((size_t)-1);
+			viewset(view.nlines);
+			continue;
+		case _key_goto:
+			viewgoto();
+			continue;
+		case _key_search:
+			free(searchstr);
+			if (!((searchstr = uiprompt("Search for: ")) &&
+			    searchstr[0])) {
+				clear(&searchstr);
+				continue;
+			}
+		case _key_searchnext:
+			viewsearch(searchstr, +1);
+			continue;
+		case _key_searchprev:
+			viewsearch(searchstr, -1);
+			continue;
+		case EOF:
+		case 0x04:
+		case _key_pgprev:
+		case _key_quit:
+		quit:
+			free(searchstr);
+			free(view.off);
+			memset(&view, 0, sizeof(view));
+			return 1;
+		}
+	}
+}
+
 void
 uisigwinch(int signal)
 {
@@ -589,6 +1091,11 @@ uisigwinch(int signal)
 	setupterm(NULL, 1, NULL);
 	putp(tparm(change_scroll_region, 0, lines-2, 0, 0, 0, 0, 0, 0, 0));
 
+	if (view.item) {
+		viewdisplay();
+		return;
+	}
+
 	if (!curentry || !(dir = curentry->dat))
 		return;
 
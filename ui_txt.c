@@ -15,14 +15,27 @@ static Item *curentry;
 static char cmd;
 int lines, columns;
 
+/* show what was drawn, a frame painted */
+static void
+flush(void)
+{
+	fflush(stdout);
+	tracepaint();
+}
+
 static void
 viewsize(int *ln, int *col)
 {
 	struct winsize ws;
+	char *l, *c;
 
 	if (ioctl(1, TIOCGWINSZ, &ws) < 0) {
-		die("Could not get terminal resolution: %s",
-		    strerror(errno));
+		/* not a terminal, as when replaying a trace */
+		if (!(l = getenv("LINES")) || !(c = getenv("COLUMNS")))
+			die("Could not get terminal resolution: %s",
+			    strerror(errno));
+		ws.ws_row = atoi(l);
+		ws.ws_col = atoi(c);
 	}
 
 	if (ln)
@@ -43,6 +56,18 @@ uicleanup(void)
 	return;
 }
 
+int
+uiidle(void)
+{
+	return 0;
+}
+
+int
+uiviewtext(Item *item)
+{
+	return 0;
+}
+
 void
 help(void)
 {
@@ -56,7 +81,9 @@ help(void)
 	     "t: go to the top of the page\n"
 	     "b: go to the bottom of the page\n"
 	     "/str: search for string \"str\"\n"
-	     "!: refetch failed item.\n"
+	     "Sstr: search all fetched pages for string \"str\"\n"
+	     "i: show session statistics.\n"
+	     "!: refetch item.\n"
 	     "^D, q: quit.\n"
 	     "h, ?: this help.");
 }
@@ -85,26 +112,31 @@ uistatus(char *fmt, ...)
 		bufout[sizeof(bufout)-1] = '\0';
 
 	mbsprint(bufout, columns);
-	fflush(stdout);
+	flush();
 
-	getchar();
+	getkey();
 }
 
 static void
 printstatus(Item *item, char c)
 {
 	Dir *dir = item->dat;
-	char *fmt;
+	char *fmt, *path;
 	size_t nitems = dir ? dir->nitems : 0;
 	unsigned long long printoff = dir ? dir->printoff : 0;
 
-	fmt = (strcmp(item->port, "70") && strcmp(item->port, "gopher")) ?
-	      "%1$3lld%%%*2$3$c %4$s:%8$s/%5$c%6$s [%7$c]: " :
-              "%3lld%%%*c %s/%c%s [%c]: ";
+	if ((path = localpath(item)))
+		fmt = "%1$3lld%%%3$*2$c %4$s%9$s [%7$c]: ";
+	else if (strcmp(item->port, "70") && strcmp(item->port, "gopher"))
+		fmt = "%1$3lld%%%3$*2$c %4$s:%8$s/%5$c%6$s%9$s [%7$c]: ";
+	else
+		fmt = "%1$3lld%%%3$*2$c %4$s/%5$c%6$s%9$s [%7$c]: ";
 	if (snprintf(bufout, sizeof(bufout), fmt,
 	             (printoff + lines-1 >= nitems) ? 100 :
 	             (printoff + lines) * 100 / nitems, ndigits(nitems)+2, '|',
-	             item->host, item->type, item->selector, c, item->port)
+	             path ? path : item->host, item->type, item->selector, c,
+	             item->port,
+	             revalidating(item) ? " (stale)" : "")
 	    >= sizeof(bufout))
 		bufout[sizeof(bufout)-1] = '\0';
 	mbsprint(bufout, columns);
@@ -124,9 +156,9 @@ uiprompt(char *fmt, ...)
 	va_end(ap);
 
 	mbsprint(bufout, columns);
-	fflush(stdout);
+	flush();
 
-	if ((r = getline(&input, &n, stdin)) < 0) {
+	if ((r = getkeyline(&input, &n)) < 0) {
 		clearerr(stdin);
 		clear(&input);
 		putchar('\n');
@@ -137,42 +169,87 @@ uiprompt(char *fmt, ...)
 	return input;
 }
 
+/* a plain prompt, results only show once the line is entered */
+char *
+uiliveprompt(void (*typed)(const char *input), char *fmt, ...)
+{
+	va_list ap;
+	char prompt[BUFSIZ];
+
+	va_start(ap, fmt);
+	if (vsnprintf(prompt, sizeof(prompt), fmt, ap) >= sizeof(prompt))
+		prompt[sizeof(prompt)-1] = '\0';
+	va_end(ap);
+
+	return uiprompt("%s", prompt);
+}
+
+static void
+printline(Item *item, size_t i, int nd)
+{
+	if (snprintf(bufout, sizeof(bufout), "%*zu %s %s",
+	             nd, i+1, typedisplay(item->type), item->username)
+	    >= sizeof(bufout))
+		bufout[sizeof(bufout)-1] = '\0';
+	mbsprint(bufout, columns);
+	putchar('\n');
+}
+
 void
 uidisplay(Item *entry)
 {
-	Item *items;
 	Dir *dir;
 	size_t i, nlines, nitems;
 	int nd;
 
 	if (!entry ||
-	    !(entry->type == '1' || entry->type == '+' || entry->type == '7') ||
+	    !(entry->type == '1' || entry->type == '+' || entry->type == '7' ||
+	      entry->type == '2') ||
 	    !(dir = entry->dat))
 		return;
 
 	curentry = entry;
 
-	items = dir->items;
 	nitems = dir->nitems;
 	nlines = dir->printoff + lines;
 	nd = ndigits(nitems);
 
-	for (i = dir->printoff; i < nitems && i < nlines; ++i) {
-		if (snprintf(bufout, sizeof(bufout), "%*zu %s %s",
-		             nd, i+1, typedisplay(items[i].type),
-		             items[i].username)
-		    >= sizeof(bufout))
-			bufout[sizeof(bufout)-1] = '\0';
-		mbsprint(bufout, columns);
-		putchar('\n');
-	}
+	for (i = dir->printoff; i < nitems && i < nlines; ++i)
+		printline(diritem(dir, i), i, nd);
 
-	fflush(stdout);
+	flush();
+}
+
+/* print the lines of the page that differ from the old one */
+void
+uirefresh(Item *entry, Dir *old)
+{
+	Dir *dir = entry->dat;
+	Item *a, *b;
+	size_t i, nlines;
+	int nd;
+
+	if (entry != curentry)
+		return;
+
+	putchar('\n');
+	nlines = dir->printoff + lines;
+	nd = ndigits(dir->nitems);
+	for (i = dir->printoff; old && i < dir->nitems && i < nlines; ++i) {
+		a = (i < old->nitems) ? diritem(old, i) : NULL;
+		b = diritem(dir, i);
+		if (!a || a->type != b->type || strcmp(a->username, b->username))
+			printline(b, i, nd);
+	}
+	printstatus(entry, cmd);
+	flush();
 }
 
 void
 printuri(Item *item, size_t i)
 {
+	const char *desc;
+	char *path;
 	int n;
 
 	if (!item)
@@ -204,9 +281,15 @@ printuri(Item *item, size_t i)
 			n += snprintf(bufout+n, sizeof(bufout)-n, "%s: ",
 			              item->username);
 		}
+		if (n < sizeof(bufout) && (path = localpath(item))) {
+			n += snprintf(bufout+n, sizeof(bufout)-n, "file://%s",
+			              path);
+			break;
+		}
 		if (n < sizeof(bufout)) {
-			n += snprintf(bufout+n, sizeof(bufout)-n, "gopher://%s",
-			              item->host);
+			n += snprintf(bufout+n, sizeof(bufout)-n, "gopher%s://%s",
+			              tlswanted(item->host, item->port) ?
+			              "s" : "", item->host);
 		}
 		if (n < sizeof(bufout) && strcmp(item->port, "70")) {
 			n += snprintf(bufout+n, sizeof(bufout)-n, ":%s",
@@ -216,10 +299,15 @@ printuri(Item *item, size_t i)
 			n += snprintf(bufout+n, sizeof(bufout)-n, "/%c%s",
 			              item->type, item->selector);
 		}
-		if (n < sizeof(bufout) && item->type == '7' && item->tag) {
+		if (n < sizeof(bufout) && item->tag &&
+		    (item->type == '7' || item->type == '2')) {
 			n += snprintf(bufout+n, sizeof(bufout)-n, "%%09%s",
 			              item->tag + strlen(item->selector));
 		}
+		if (n < sizeof(bufout) && (desc = plusdescribe(item))) {
+			n += snprintf(bufout+n, sizeof(bufout)-n, " (%s)",
+			              desc);
+		}
 		break;
 	}
 
@@ -240,14 +328,15 @@ searchinline(const char *searchstr, Item *entry)
 		return;
 
 	for (i = 0; i < dir->nitems; ++i)
-		if (strcasestr(dir->items[i].username, searchstr))
-			printuri(&(dir->items[i]), i + 1);
+		if (strcasestr(diritem(dir, i)->username, searchstr))
+			printuri(diritem(dir, i), i + 1);
 }
 
 Item *
 uiselectitem(Item *entry)
 {
 	Dir *dir;
+	Item *hits;
 	char buf[BUFSIZ], *sstr, nl;
 	int item, nitems;
 
@@ -260,9 +349,13 @@ uiselectitem(Item *entry)
 		if (!cmd)
 			cmd = 'h';
 		printstatus(entry, cmd);
-		fflush(stdout);
+		flush();
 
-		if (!fgets(buf, sizeof(buf), stdin)) {
+		waitinput();
+		/* a refetch may have swapped the page in the meantime */
+		dir = entry->dat;
+		nitems = dir->nitems;
+		if (!getkeys(buf, sizeof(buf))) {
 			putchar('\n');
 			return NULL;
 		}
@@ -271,15 +364,15 @@ uiselectitem(Item *entry)
 			nl = '\0';
 			if (sscanf(buf, "%d%c", &item, &nl) != 2 || nl != '\n')
 				item = -1;
-		} else if (!strcmp(buf+1, "\n")) {
-			item = -1;
-			cmd = *buf;
-		} else if (*buf == '/') {
+		} else if (*buf == '/' || *buf == 'S') {
 			for (sstr = buf+1; *sstr && *sstr != '\n'; ++sstr)
 			     ;
 			*sstr = '\0';
 			sstr = buf+1;
 			cmd = *buf;
+		} else if (!strcmp(buf+1, "\n")) {
+			item = -1;
+			cmd = *buf;
 		} else if (isdigit((unsigned char)*(buf+1))) {
 			nl = '\0';
 			if (sscanf(buf+1, "%d%c", &item, &nl) != 2 || nl != '\n')
@@ -314,20 +407,27 @@ uiselectitem(Item *entry)
 			dir->printoff = 0;
 			return entry;
 		case '!':
-			if (entry->raw)
-				continue;
-			return entry;
+			if (!entry->raw)
+				return entry;
+			revalidate(entry);
+			continue;
 		case 'U':
 			printuri(entry, 0);
 			continue;
 		case 'u':
 			if (item > 0 && item <= nitems)
-				printuri(&dir->items[item-1], item);
+				printuri(diritem(dir, item-1), item);
 			continue;
 		case '/':
 			if (*sstr)
 				searchinline(sstr, entry);
 			continue;
+		case 'S':
+			if (*sstr && (hits = searchsession(sstr, entry)))
+				return hits;
+			continue;
+		case 'i':
+			return sessionstats(entry);
 		case 'h':
 		case '?':
 			help();
@@ -342,7 +442,7 @@ uiselectitem(Item *entry)
 	}
 
 	if (item > 0)
-		return &dir->items[item-1];
+		return diritem(dir, item-1);
 
 	return entry->entry;
 }
@@ -358,5 +458,5 @@ uisigwinch(int signal)
 	putchar('\n');
 	uidisplay(curentry);
 	printstatus(curentry, cmd);
-	fflush(stdout);
+	flush();
 }